@@ -0,0 +1,200 @@
+#!/bin/sh
+# Time pstack and canal against generated stress inputs.
+#
+# usage: bench.sh [-q] [-r runs] [-b baseline] <pstack> <canal> <bench source dir>
+#
+# Inputs are built in the current directory, and reused by later runs:
+#   threads  - a live process with many threads, each deep in recursion
+#   cus      - a live process running a binary with many compilation units
+#              and FDEs, with a call chain through all of them
+#   cus-gz   - as "cus", with compressed debug sections
+#   core     - a core of a process with many threads and a large heap
+#
+# Each result is printed as a tab-separated line of input, command, median
+# and minimum wall time in milliseconds, run count, and "ok", or the exit
+# status of the command if it failed, and saved in results.tsv. With "-b",
+# medians more than THRESHOLD percent (default 10) slower than in the
+# baseline results are reported, and we exit with status 1 if there are
+# any.
+#
+# The size of the inputs can be set in the environment: THREADS, DEPTH, CUS,
+# FUNCS (per CU, at least 2) and MEGS (of heap in the core). "-q" (or QUICK
+# in the environment) uses small ones, for a quick check that everything
+# works. DEBUGFLAGS chooses the debug info for the inputs, and BASELINE in
+# the environment is the same as "-b", for "make bench".
+
+set -e
+
+THREADS=${THREADS:-2000}
+DEPTH=${DEPTH:-200}
+CUS=${CUS:-2000}
+FUNCS=${FUNCS:-50}
+MEGS=${MEGS:-2048}
+THRESHOLD=${THRESHOLD:-10}
+CXX=${CXX:-c++}
+DEBUGFLAGS=${DEBUGFLAGS:--gdwarf-4} # we don't read DWARF 5 yet.
+RUNS=5
+BASELINE=${BASELINE:-}
+
+quick() {
+    THREADS=20; DEPTH=20; CUS=20; FUNCS=5; MEGS=16
+}
+if [ -n "$QUICK" ]; then
+    quick
+fi
+while getopts "qr:b:" opt; do
+    case $opt in
+        q) quick ;;
+        r) RUNS=$OPTARG ;;
+        b) BASELINE=$OPTARG ;;
+        *) echo "usage: $0 [-q] [-r runs] [-b baseline] <pstack> <canal> <bench source dir>" >&2; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 3 ]; then
+    echo "usage: $0 [-q] [-r runs] [-b baseline] <pstack> <canal> <bench source dir>" >&2
+    exit 2
+fi
+PSTACK=$1
+CANAL=$2
+SRC=$3
+
+PIDS=
+trap 'for p in $PIDS; do kill $p 2>/dev/null || true; done' EXIT
+
+# Build "stress" with a chain of calls through generated compilation units.
+buildchain() {
+    name=$1
+    flags=$2
+    dir=gen-$name-$CUS-$FUNCS
+    if [ ! -x $dir/stress ]; then
+        mkdir -p $dir
+        i=0
+        while [ $i -lt $CUS ]; do
+            next=$((i + 1))
+            {
+                if [ $next -lt $CUS ]; then
+                    echo "extern \"C\" void cu${next}_0(int);"
+                else
+                    echo "extern \"C\" void stress_wait(void);"
+                fi
+                j=$((FUNCS - 1))
+                while [ $j -gt 0 ]; do
+                    echo "extern \"C\" int cu${i}_$j(int x) { int y = x * $j; return y + $i; }"
+                    j=$((j - 1))
+                done
+                echo "extern \"C\" void cu${i}_0(int x) {"
+                echo "    volatile int v = cu${i}_1 ? x : 0;"
+                if [ $next -lt $CUS ]; then
+                    echo "    cu${next}_0(v + 1);"
+                else
+                    echo "    stress_wait();"
+                fi
+                echo "}"
+            } > $dir/cu$i.cc
+            i=$next
+        done
+        echo 'extern "C" void cu0_0(int); extern "C" void stress_chain(void) { cu0_0(0); }' > $dir/chain.cc
+        for f in $dir/cu*.cc $dir/chain.cc; do
+            echo "$CXX $DEBUGFLAGS -O0 $flags -c -o ${f%.cc}.o $f"
+        done | xargs -P "$(nproc)" -I{} sh -c {}
+        $CXX $DEBUGFLAGS -O0 $flags -o $dir/stress $SRC/stress.cc $dir/*.o -lpthread
+    fi
+    echo $dir/stress
+}
+
+# Start "stress" with the given arguments, wait for it to be ready, and
+# leave its pid in $pid.
+start() {
+    exe=$1
+    shift
+    : > stress.pid
+    $exe "$@" > stress.pid &
+    pid=$!
+    PIDS="$PIDS $pid"
+    while [ ! -s stress.pid ]; do
+        if ! kill -0 $pid 2>/dev/null; then
+            echo "$exe $* failed" >&2
+            exit 1
+        fi
+        sleep 0.1
+    done
+}
+
+now() {
+    date +%s%N
+}
+
+# Run a command $RUNS times, and record its median and minimum time under
+# the given input and command names.
+measure() {
+    input=$1
+    label=$2
+    shift 2
+    times=
+    status=ok
+    run=0
+    while [ $run -lt $RUNS ]; do
+        before=$(now)
+        "$@" > /dev/null 2>&1 || status="exit $?"
+        after=$(now)
+        times="$times $(( (after - before) / 1000 ))"
+        run=$((run + 1))
+    done
+    echo $times | tr ' ' '\n' | sort -n | awk -v input="$input" -v label="$label" -v status="$status" '
+        { t[NR] = $1 }
+        END { printf "%s\t%s\t%.3f\t%.3f\t%d\t%s\n", input, label,
+            t[int((NR + 1) / 2)] / 1000, t[1] / 1000, NR, status }' | tee -a results.tsv.new
+}
+
+: > results.tsv.new
+
+simple=./gen-stress
+if [ ! -x $simple ]; then
+    $CXX $DEBUGFLAGS -O0 -o $simple $SRC/stress.cc -lpthread
+fi
+chain=$(buildchain plain "")
+gz=$(buildchain gz "-gz=zlib")
+
+start $simple -t $THREADS -d $DEPTH
+measure threads "pstack" $PSTACK $pid
+measure threads "pstack -a" $PSTACK -a $pid
+measure threads "canal" $CANAL $simple $pid
+
+start $chain -t 1 -d 1
+measure cus "pstack" $PSTACK $pid
+measure cus "pstack -a" $PSTACK -a $pid
+
+start $gz -t 1 -d 1
+measure cus-gz "pstack" $PSTACK $pid
+measure cus-gz "pstack -a" $PSTACK -a $pid
+
+if [ "$(cat /proc/sys/kernel/core_pattern)" = core ]; then
+    core=gen-core-$THREADS-$DEPTH-$MEGS
+    if [ ! -f $core ]; then
+        rm -f core core.[0-9]*
+        (ulimit -c unlimited; $simple -a -t $THREADS -d $DEPTH -m $MEGS) || true
+        mv $(ls core core.[0-9]* 2>/dev/null | head -1) $core
+    fi
+    measure core "pstack" $PSTACK $simple $core
+    measure core "pstack -a" $PSTACK -a $simple $core
+    measure core "canal" $CANAL $simple $core
+else
+    echo "core_pattern isn't \"core\": skipping core benchmarks" >&2
+fi
+
+mv results.tsv.new results.tsv
+
+if [ -n "$BASELINE" ]; then
+    awk -F '\t' -v threshold=$THRESHOLD '
+        NR == FNR { base[$1 "\t" $2] = $3; next }
+        ($1 "\t" $2) in base && base[$1 "\t" $2] > 0 {
+            change = ($3 - base[$1 "\t" $2]) * 100 / base[$1 "\t" $2]
+            if (change > threshold) {
+                printf "REGRESSION\t%s\t%s\t%.3f -> %.3f ms (+%.1f%%)\n",
+                    $1, $2, base[$1 "\t" $2], $3, change
+                bad = 1
+            }
+        }
+        END { exit bad }' "$BASELINE" results.tsv
+fi
@@ -0,0 +1,132 @@
+/*
+ * A process for benchmarking pstack and canal: it fills "-m" megabytes of
+ * heap with pointers to a few objects with vtables, for canal to find, and
+ * starts "-t" threads, each of which recurses "-d" levels deep before
+ * blocking. The main thread then does the same, and prints its pid and waits
+ * to be killed, or with "-a", aborts to leave a core.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+static pthread_mutex_t l = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t c = PTHREAD_COND_INITIALIZER;
+static int ready;
+static int depth = 100;
+static bool dumpCore;
+static pthread_t mainThread;
+
+// Generated large binaries provide their own chain of calls through many
+// compilation units, ending in stress_wait.
+extern "C" void stress_chain(void) __attribute__((weak));
+
+struct Shape {
+   virtual ~Shape() {}
+   virtual double area() const = 0;
+};
+
+struct Square : public Shape {
+   double side;
+   Square(double side_) : side(side_) {}
+   double area() const { return side * side; }
+};
+
+struct Circle : public Shape {
+   double radius;
+   Circle(double radius_) : radius(radius_) {}
+   double area() const { return 3.14159 * radius * radius; }
+};
+
+extern "C" void
+stress_wait(void)
+{
+   if (pthread_equal(pthread_self(), mainThread)) {
+      // Everything else is ready.
+      if (dumpCore)
+         abort();
+      printf("%d\n", int(getpid()));
+      fflush(stdout);
+      for (;;)
+         pause();
+   }
+   pthread_mutex_lock(&l);
+   ready++;
+   pthread_cond_signal(&c);
+   pthread_mutex_unlock(&l);
+   for (;;)
+      pause();
+}
+
+// Give each frame some locals and arguments, for "pstack -a".
+static int __attribute__((noinline))
+recurse(int level, const char *name, double value)
+{
+   volatile char buf[64];
+   buf[level % sizeof buf] = name[0];
+   if (level == 0) {
+      if (stress_chain)
+         stress_chain();
+      stress_wait();
+   }
+   return recurse(level - 1, name, value * 2) + buf[0];
+}
+
+static void *
+entry(void *)
+{
+   recurse(depth, "thread", 1.0);
+   return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+   int threads = 10;
+   size_t megabytes = 0;
+   int ch;
+   mainThread = pthread_self();
+   while ((ch = getopt(argc, argv, "t:d:m:a")) != -1) {
+      switch (ch) {
+         case 't': threads = atoi(optarg); break;
+         case 'd': depth = atoi(optarg); break;
+         case 'm': megabytes = strtoul(optarg, 0, 0); break;
+         case 'a': dumpCore = true; break;
+         default:
+            fprintf(stderr, "usage: stress [-t threads] [-d depth] [-m megabytes] [-a]\n");
+            return 1;
+      }
+   }
+
+   // Fill the heap with pointers to our objects, in 1MB blocks.
+   std::vector<Shape *> shapes;
+   for (int i = 0; i < 16; i++)
+      shapes.push_back(i % 2 ? (Shape *)new Square(i) : (Shape *)new Circle(i));
+   for (size_t i = 0; i < megabytes; i++) {
+      size_t count = (1 << 20) / sizeof (Shape *);
+      Shape **block = (Shape **)malloc(count * sizeof *block);
+      for (size_t j = 0; j < count; j++)
+         block[j] = shapes[j % shapes.size()];
+   }
+
+   pthread_attr_t attrs;
+   pthread_attr_init(&attrs);
+   pthread_attr_setstacksize(&attrs, 256 * 1024 + depth * 256);
+   for (int i = 0; i < threads; i++) {
+      pthread_t tid;
+      if (pthread_create(&tid, &attrs, entry, 0) != 0) {
+         fprintf(stderr, "can't create thread %d: %s\n", i, strerror(errno));
+         return 1;
+      }
+   }
+   pthread_mutex_lock(&l);
+   while (ready != threads)
+      pthread_cond_wait(&c, &l);
+   pthread_mutex_unlock(&l);
+
+   recurse(depth, "main", 1.0);
+}
@@ -5,7 +5,12 @@
 #include <iostream>
 #include <exception>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <sstream>
+#include <thread>
 #include <libpstack/proc.h>
 #include <libpstack/elf.h>
 #include <libpstack/dwarf.h>
@@ -65,6 +70,160 @@ bool operator < (const ListedSymbol &sym, Elf_Off addr) {
 }
 
 static const char *virtpattern = "_ZTV*"; /* wildcard for all vtbls */
+
+/*
+ * A range of memory to scan: a PT_LOAD segment of a core, or a mapping of
+ * a live process. "offset" is where its content starts in the reader we
+ * scan it with.
+ */
+struct ScanRegion {
+    Elf_Addr vaddr;
+    Elf_Off offset;
+    Elf_Off filesz;
+    Elf_Off memsz;
+    ScanRegion(Elf_Addr vaddr_, Elf_Off offset_, Elf_Off filesz_, Elf_Off memsz_)
+        : vaddr(vaddr_), offset(offset_), filesz(filesz_), memsz(memsz_) {}
+};
+
+/*
+ * Call "scan" with the content of the part of a region from offset "from"
+ * to "to", and the address it starts at. If the reader is mapped, we pass
+ * the whole range in one go. Otherwise we read it in large blocks. Blocks
+ * overlap by "overlap" bytes, and we pass up to "overlap" bytes past "to",
+ * so anything up to overlap + 1 bytes long that starts in the range is
+ * seen whole in exactly one block.
+ */
+static void
+scanSegment(const Reader &io, const ScanRegion &region, Elf_Off from, Elf_Off to,
+        size_t overlap, const std::function<void(Elf_Addr, const char *, size_t)> &scan)
+{
+    Elf_Off end = std::min(to + overlap, region.filesz);
+    const char *mapped = io.view(region.offset + from, end - from);
+    if (mapped) {
+        scan(region.vaddr + from, mapped, end - from);
+        return;
+    }
+    std::vector<char> buf(std::max(size_t(4 * 1024 * 1024), 2 * overlap));
+    for (Elf_Off off = from; off < end;) {
+        size_t want = std::min(Elf_Off(buf.size()), end - off);
+        size_t got = io.read(region.offset + off, want, &buf[0]);
+        if (got == 0)
+            break;
+        scan(region.vaddr + off, &buf[0], got);
+        if (got < want || off + got == end)
+            break;
+        off += got - overlap;
+    }
+}
+
+/*
+ * The writable mappings of a live process, where we'd expect to find its
+ * heap objects. We read them through /proc/<pid>/mem, so their offsets
+ * are their addresses.
+ */
+static std::vector<ScanRegion>
+liveRegions(pid_t pid)
+{
+    std::vector<ScanRegion> regions;
+    std::string name = LiveReader::procname(pid, "maps");
+    std::ifstream maps(name);
+    if (!maps.good())
+        throw Exception() << "cannot open " << name << ": " << strerror(errno);
+    std::string line;
+    while (std::getline(maps, line)) {
+        std::istringstream fields(line);
+        Elf_Addr start, end;
+        char dash;
+        std::string perms;
+        fields >> std::hex >> start >> dash >> end >> perms;
+        if (!fields || perms.size() < 2 || perms[1] != 'w')
+            continue;
+        regions.emplace_back(start, start, end - start, end - start);
+    }
+    return regions;
+}
+
+/*
+ * Decide if we should scan the page at "addr" when sampling a fraction of
+ * pages. We hash the address, so the choice doesn't fall in step with
+ * anything laid out at regular intervals.
+ */
+static bool
+samplePage(Elf_Addr addr, double fraction)
+{
+    return double((uint64_t(addr >> 12) * 0x9e3779b97f4a7c15ULL) >> 11) < fraction * double(uint64_t(1) << 53);
+}
+
+/*
+ * A quick test for whether a value might be an address in any of a set of
+ * ranges: we hash each page the ranges cover into a bitmap. Values whose
+ * page's bit is clear can't be in any range.
+ */
+class PageFilter {
+    static const int bits = 20;
+    static const int pageShift = 12;
+    std::vector<uint64_t> map;
+    static size_t slot(Elf_Off addr) {
+        return (uint64_t(addr >> pageShift) * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+    }
+public:
+    PageFilter() : map((size_t(1) << bits) / 64) {}
+    void add(Elf_Off start, Elf_Off end) {
+        if (end <= start)
+            return;
+        Elf_Off first = start >> pageShift, last = (end - 1) >> pageShift;
+        if (last - first >= (Elf_Off(1) << bits)) {
+            std::fill(map.begin(), map.end(), ~uint64_t(0));
+            return;
+        }
+        for (Elf_Off page = first;; ++page) {
+            size_t i = slot(page << pageShift);
+            map[i / 64] |= uint64_t(1) << (i % 64);
+            if (page == last)
+                break;
+        }
+    }
+    bool mayContain(Elf_Off addr) const {
+        size_t i = slot(addr);
+        return (map[i / 64] >> (i % 64)) & 1;
+    }
+};
+
+/*
+ * Sort a set of address ranges, and merge any that overlap or abut, so we
+ * can find the one containing an address with a binary search.
+ */
+static void
+mergeRanges(std::vector<std::pair<Elf_Off, Elf_Off>> &ranges)
+{
+    std::sort(ranges.begin(), ranges.end());
+    size_t out = 0;
+    for (auto &range : ranges) {
+        if (range.second <= range.first)
+            continue;
+        if (out != 0 && range.first <= ranges[out - 1].second)
+            ranges[out - 1].second = std::max(ranges[out - 1].second, range.second);
+        else
+            ranges[out++] = range;
+    }
+    ranges.resize(out);
+}
+
+/*
+ * A piece of a region to be scanned by one thread, and the output it
+ * produces, which we print in order once all the pieces are done.
+ */
+struct ScanChunk {
+    const ScanRegion *region;
+    Elf_Off from;
+    Elf_Off to;
+    std::ostringstream out;
+    std::ostringstream log;
+    ScanChunk(const ScanRegion *region_, Elf_Off from_, Elf_Off to_)
+        : region(region_), from(from_), to(to_) {}
+};
+
+static const Elf_Off chunkSize = 16 * 1024 * 1024;
 static bool compareSymbolsByAddress(const ListedSymbol &l, const ListedSymbol &r)
     { return l.memaddr() < r.memaddr(); }
 static bool compareSymbolsByFrequency(const ListedSymbol &l, const ListedSymbol &r)
@@ -81,6 +240,9 @@ operator <<(ostream &os, const Usage &)
       << "\t-v: verbose (repeat for more verbosity)" << endl
       << "\t-h: this message" << endl
       << "\t-r <prefix=path>: replace 'prefix' in core with 'path' when loading shared libraries" << endl
+      << "\t-T <threads>: number of threads to scan the core with (default 0: one per CPU)" << endl
+      << "\t-F <fraction>: scan only this fraction of pages (e.g. 0.01), chosen at random" << endl
+      << "\tgiven a pid rather than a core, canal scans the process's writable mappings, without stopping it" << endl
       ;
 }
 
@@ -88,6 +250,7 @@ int
 mainExcept(int argc, char *argv[])
 {
     std::vector<std::string> patterns;
+    ImageCache imageCache;
     shared_ptr<ElfObject> exec;
     shared_ptr<ElfObject> core;
     shared_ptr<Process> process;
@@ -99,13 +262,14 @@ mainExcept(int argc, char *argv[])
 
     std::vector<std::pair<Elf_Off, Elf_Off>> searchaddrs;
     std::vector<std::pair<std::string, std::string>> pathReplacements;
-    char *strbuf = 0;
     char *findstr = 0;
     size_t findstrlen = 0;
     int symOffset = -1;
     bool showloaded = false;
+    size_t threads = 0;
+    double sampleFraction = 1;
 
-    while ((c = getopt(argc, argv, "o:vhr:sp:f:e:S:R:K:lV")) != -1) {
+    while ((c = getopt(argc, argv, "o:vhr:sp:f:e:S:R:K:lVT:F:")) != -1) {
         switch (c) {
             case 'V':
                showsyms = true;
@@ -141,7 +305,8 @@ mainExcept(int argc, char *argv[])
             case 'S':
                 findstr = optarg;
                 findstrlen = strlen(findstr);
-                strbuf = new char[findstrlen];
+                if (findstrlen == 0)
+                    throw "must specify a non-empty string for '-S'";
                 break;
 
             case 'f': {
@@ -191,6 +356,16 @@ mainExcept(int argc, char *argv[])
             case 'l':
                 showloaded = true;
                 break;
+
+            case 'T':
+                threads = strtoul(optarg, 0, 0);
+                break;
+
+            case 'F':
+                sampleFraction = strtod(optarg, 0);
+                if (sampleFraction <= 0 || sampleFraction > 1)
+                    throw "the fraction for '-F' must be more than 0, and at most 1";
+                break;
         }
     }
 
@@ -208,10 +383,10 @@ mainExcept(int argc, char *argv[])
     std::istringstream(argv[optind]) >> pid;
     if (pid != 0 && kill(pid, 0) == 0) {
        std::clog << "attaching to live process" << std::endl;
-       process = make_shared<LiveProcess>(exec, pid, pathReplacements);
+       process = make_shared<LiveProcess>(exec, pid, pathReplacements, imageCache);
     } else {
-       core = make_shared<ElfObject>(loadFile(argv[optind]));
-       process = make_shared<CoreProcess>(exec, core, pathReplacements);
+       core = make_shared<ElfObject>(loadCore(argv[optind]));
+       process = make_shared<CoreProcess>(exec, core, pathReplacements, imageCache);
     }
     process->load();
     if (searchaddrs.size()) {
@@ -262,41 +437,100 @@ mainExcept(int argc, char *argv[])
        exit(0);
     sort(listed.begin() , listed.end() , compareSymbolsByAddress);
 
-    // Now run through the corefile, searching for virtual objects.
+    // Most words can't point at anything we're interested in: find the
+    // range of values that might, and the pages they're on, so we can
+    // reject the others quickly.
+    PageFilter filter;
+    Elf_Off lowest = std::numeric_limits<Elf_Off>::max(), highest = 0;
+    mergeRanges(searchaddrs);
+    if (searchaddrs.size()) {
+        for (auto &range : searchaddrs) {
+            lowest = std::min(lowest, range.first);
+            highest = std::max(highest, range.second);
+            filter.add(range.first, range.second);
+        }
+    } else {
+        for (auto &sym : listed) {
+            // symOffset may point past a symbol of size 0.
+            Elf_Off end = sym.memaddr() + std::max(Elf_Off(sym.sym.st_size), Elf_Off(symOffset + 1));
+            lowest = std::min(lowest, sym.memaddr());
+            highest = std::max(highest, end);
+            filter.add(sym.memaddr(), end);
+        }
+    }
+
+    // Now run through the corefile, or the live process's memory, searching
+    // for virtual objects. We can share a core's reader between threads
+    // only if it's mapped: other readers keep caches that aren't safe to
+    // share. For a live process, we read straight from /proc/<pid>/mem.
     off_t filesize = 0;
     off_t memsize = 0;
-    for (auto &hdr : core->getSegments(PT_LOAD)) {
-        Elf_Off p;
-        filesize += hdr.p_filesz;
-        memsize += hdr.p_memsz;
-        if (verbose) {
-            IOFlagSave _(*debug);
-            *debug << "scan " << hex << hdr.p_vaddr <<  " to " << hdr.p_vaddr + hdr.p_memsz
-                << " (filesiz = " << hdr.p_filesz  << ", memsiz=" << hdr.p_memsz << ") ";
+    std::vector<ScanRegion> regions;
+    std::shared_ptr<Reader> io;
+    bool shareable = true;
+    if (core) {
+        io = core->getio();
+        for (auto &hdr : core->getSegments(PT_LOAD)) {
+            regions.emplace_back(hdr.p_vaddr, hdr.p_offset, hdr.p_filesz, hdr.p_memsz);
+            if (io->view(hdr.p_offset, hdr.p_filesz) == 0)
+                shareable = false;
         }
+    } else {
+        io = std::make_shared<LiveReader>(pid, "mem");
+        regions = liveRegions(pid);
+    }
+    std::vector<std::unique_ptr<ScanChunk>> chunks;
+    for (auto &region : regions) {
+        filesize += region.filesz;
+        memsize += region.memsz;
+        for (Elf_Off from = 0; from < region.filesz; from += chunkSize)
+            chunks.emplace_back(make_unique<ScanChunk>(&region, from,
+                        std::min(from + chunkSize, region.filesz)));
+    }
 
-        if (findstr) {
-            for (auto loc = hdr.p_vaddr; loc < hdr.p_vaddr + hdr.p_filesz - findstrlen; loc++) {
-                size_t rc = process->io->read(loc, findstrlen, strbuf);
-                assert(rc == findstrlen);
-                if (memcmp(strbuf, findstr, rc) == 0) {
-                    IOFlagSave _(cout);
-                    std::cout << "0x" << hex << loc << "\n";
-                }
+    // Scan a chunk, or, if we're sampling, the pages we pick from it. The
+    // mappings of a live process can change under us, so we just say if we
+    // can't read one.
+    std::atomic<size_t> pagesScanned(0);
+    auto scanChunk = [&](ScanChunk &chunk, size_t overlap,
+            const std::function<void(Elf_Addr, const char *, size_t)> &scan) {
+        try {
+            if (sampleFraction == 1) {
+                scanSegment(*io, *chunk.region, chunk.from, chunk.to, overlap, scan);
+                return;
             }
-        } else {
-            for (auto loc = hdr.p_vaddr; loc < hdr.p_vaddr + hdr.p_filesz; loc += sizeof p) {
+            for (Elf_Off page = chunk.from; page < chunk.to; page += 4096) {
+                if (!samplePage(chunk.region->vaddr + page, sampleFraction))
+                    continue;
+                scanSegment(*io, *chunk.region, page, std::min(page + 4096, chunk.to), overlap, scan);
+                pagesScanned++;
+            }
+        }
+        catch (const Exception &ex) {
+            if (core)
+                throw;
+            if (verbose)
+                chunk.log << "(" << ex.what() << ")";
+        }
+    };
+
+    auto scanWords = [&](ScanChunk &chunk, std::vector<size_t> &counts) {
+        const ScanRegion &region = *chunk.region;
+        scanChunk(chunk, 0, [&](Elf_Addr base, const char *data, size_t size) {
+            Elf_Off p;
+            for (size_t off = 0; off + sizeof p <= size; off += sizeof p) {
+                auto loc = base + off;
                 // log a '.' every megabyte.
-                if (verbose && (loc - hdr.p_vaddr) % (1024 * 1024) == 0)
-                    clog << '.';
-                process->io->readObj(loc, &p);
+                if (verbose && (loc - region.vaddr) % (1024 * 1024) == 0)
+                    chunk.log << '.';
+                memcpy(&p, data + off, sizeof p);
+                if (p < lowest || p >= highest || !filter.mayContain(p))
+                    continue;
                 if (searchaddrs.size()) {
-                    for (auto range = searchaddrs.begin(); range != searchaddrs.end(); ++range) {
-                        if (p >= range->first && p < range->second && (p % 4 == 0)) {
-                            IOFlagSave _(cout);
-                            cout << "0x" << hex << loc << "\n";
-                        }
-                    }
+                    auto range = std::upper_bound(searchaddrs.begin(), searchaddrs.end(),
+                            std::make_pair(p, std::numeric_limits<Elf_Off>::max()));
+                    if (range != searchaddrs.begin() && p < (--range)->second && p % 4 == 0)
+                        chunk.out << "0x" << hex << loc << "\n";
                 } else {
                     auto found = lower_bound(listed.begin(), listed.end(), p);
                     if (found != listed.end() &&
@@ -304,22 +538,60 @@ mainExcept(int argc, char *argv[])
                                 ? found->memaddr() + symOffset == p
                                 : found->memaddr() <= p && found->memaddr() + found->sym.st_size > p)) {
                         if (showaddrs)
-                            cout
+                            chunk.out
                                 << found->name << " 0x" << std::hex << loc
                                 << std::dec <<  " ... size=" << found->sym.st_size
                                 << ", diff=" << p - found->memaddr() << endl;
-                        found->count++;
+                        counts[found - listed.begin()]++;
                     }
                 }
             }
+        });
+    };
+
+    auto scanString = [&](ScanChunk &chunk) {
+        scanChunk(chunk, findstrlen - 1, [&](Elf_Addr base, const char *data, size_t size) {
+            for (const char *end = data + size, *match = data;
+                    (match = (const char *)memmem(match, end - match, findstr, findstrlen)) != 0;
+                    ++match)
+                chunk.out << "0x" << hex << base + (match - data) << "\n";
+        });
+    };
+
+    // Each thread keeps its own counts, and we add them up at the end.
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    threads = shareable ? std::max(size_t(1), std::min(threads, chunks.size())) : 1;
+    std::vector<std::vector<size_t>> counts(threads, std::vector<size_t>(listed.size()));
+    parallelFor(chunks.size(), threads, [&](size_t i, size_t thread) {
+        if (findstr)
+            scanString(*chunks[i]);
+        else
+            scanWords(*chunks[i], counts[thread]);
+    });
+
+    auto chunk = chunks.begin();
+    for (auto &region : regions) {
+        if (verbose) {
+            IOFlagSave _(*debug);
+            *debug << "scan " << hex << region.vaddr <<  " to " << region.vaddr + region.memsz
+                << " (filesiz = " << region.filesz  << ", memsiz=" << region.memsz << ") ";
+        }
+        for (; chunk != chunks.end() && (*chunk)->region == &region; ++chunk) {
+            if (verbose)
+                *debug << (*chunk)->log.str();
+            cout << (*chunk)->out.str();
         }
-
         if (verbose)
             *debug << endl;
-
     }
-    if (verbose)
+    for (auto &threadCounts : counts)
+        for (size_t i = 0; i < listed.size(); ++i)
+            listed[i].count += threadCounts[i];
+    if (verbose && core)
         *debug << "core file contains " << filesize << " out of " << memsize << " bytes of memory\n";
+    if (sampleFraction != 1)
+        clog << "sampled " << pagesScanned << " of " << filesize / 4096 << " pages\n";
 
     sort(listed.begin() , listed.end() , compareSymbolsByFrequency);
 
@@ -6,25 +6,69 @@
 CoreProcess::CoreProcess(
         std::shared_ptr<ElfObject> exe,
         std::shared_ptr<ElfObject> core,
-        const PathReplacementList &pathReplacements_)
-    : Process(exe, std::make_shared<CoreReader>(this), pathReplacements_)
+        const PathReplacementList &pathReplacements_,
+        ImageCache &cache)
+    : Process(exe, std::make_shared<CoreReader>(this), pathReplacements_, cache)
     , coreImage(core)
+    , pid(-1)
 {
 }
 
+void
+CoreProcess::indexNotes()
+{
+    prstatus.clear();
+    fpregs.clear();
+    auxv.reset();
+    files.reset();
+    pid = -1;
+    lwpid_t lwp = -1;
+    for (auto note : coreImage->notes) {
+        if (note.name() != "CORE")
+            continue;
+        switch (note.type()) {
+#ifdef NT_PRSTATUS
+            case NT_PRSTATUS: {
+                if (note.size() < sizeof (prstatus_t))
+                    break;
+                lwp = ((const prstatus_t *)note.data())->pr_pid;
+                if (pid == -1)
+                    pid = lwp;
+                prstatus.insert(std::make_pair(lwp, note));
+                break;
+            }
+#endif
+#ifdef NT_FPREGSET
+            case NT_FPREGSET:
+                if (lwp != -1)
+                    fpregs.insert(std::make_pair(lwp, note));
+                break;
+#endif
+            case NT_AUXV:
+                if (!auxv)
+                    auxv = make_unique<ElfNoteDesc>(note);
+                break;
+#ifdef NT_FILE
+            case NT_FILE:
+                if (!files)
+                    files = make_unique<ElfNoteDesc>(note);
+                break;
+#endif
+        }
+    }
+}
+
 void
 CoreProcess::load()
 {
+    indexNotes();
 #ifdef __linux__
     /* Find the linux-gate VDSO, and treat as an ELF file */
-    for (auto note : coreImage->notes) {
-       if (note.name() == "CORE" && note.type() == NT_AUXV) {
-           processAUXV(note.data(), note.size());
-           break;
-       }
-    }
+    if (auxv)
+        processAUXV(auxv->data(), auxv->size());
 #endif
     Process::load();
+    prefetchDebugImages();
 }
 
 std::string CoreReader::describe() const
@@ -82,13 +126,10 @@ CoreReader::read(off_t remoteAddr, size_t size, char *ptr) const
         hdr = 0;
         obj.reset();
         Elf_Off reloc;
-        for (auto i = p->objects.begin(); i != p->objects.end(); ++i) {
-            hdr = i->object->findHeaderForAddress(remoteAddr - i->reloc);
-            if (hdr) {
-                obj = i->object;
-                reloc = i->reloc;
-                break;
-            }
+        auto loaded = p->findSegment(remoteAddr, &hdr);
+        if (loaded) {
+            obj = loaded->object;
+            reloc = loaded->reloc;
         }
 
         if (hdr) {
@@ -115,18 +156,23 @@ CoreReader::read(off_t remoteAddr, size_t size, char *ptr) const
 CoreReader::CoreReader(CoreProcess *p_) : p(p_) { }
 
 bool
-CoreProcess::getRegs(lwpid_t pid, CoreRegisters *reg)
+CoreProcess::getRegs(lwpid_t lwp, CoreRegisters *reg)
 {
-   for (auto note : coreImage->notes) {
-        const prstatus_t *prstatus = (const prstatus_t *)note.data();
-#ifdef NT_PRSTATUS
-        if (note.name() == "CORE" && note.type() == NT_PRSTATUS && prstatus->pr_pid == pid) {
-            memcpy(reg, &prstatus->pr_reg, sizeof(*reg));
-            return true;
-        }
-#endif
-   }
-   return false;
+    auto note = prstatus.find(lwp);
+    if (note == prstatus.end())
+        return false;
+    memcpy(reg, &((const prstatus_t *)note->second.data())->pr_reg, sizeof(*reg));
+    return true;
+}
+
+bool
+CoreProcess::getFPRegs(lwpid_t lwp, prfpregset_t *reg)
+{
+    auto note = fpregs.find(lwp);
+    if (note == fpregs.end() || note->second.size() < sizeof *reg)
+        return false;
+    memcpy(reg, note->second.data(), sizeof *reg);
+    return true;
 }
 
 void
@@ -144,11 +190,5 @@ CoreProcess::stop(lwpid_t)
 pid_t
 CoreProcess::getPID() const
 {
-    for (auto note : coreImage->notes) {
-        if (note.name() == "CORE" && note.type() == NT_PRSTATUS) {
-            const prstatus_t *status = (const prstatus_t *)note.data();
-            return status->pr_pid;
-        }
-    }
-    return -1;
+    return pid;
 }
@@ -24,11 +24,11 @@ std::ostream &operator << (std::ostream &os, const DwarfFileEntry &fe) {
         << "}";
 }
 
-std::ostream &operator << (std::ostream &os, const DwarfLineState &ls) {
+std::ostream &operator << (std::ostream &os, const DwarfLineRow &row) {
     return os
-        << "{ \"file\": " << *ls.file
-        << ", \"line\": " << ls.line
-        << ", \"addr\": " << ls.addr
+        << "{ \"file\": " << row.file
+        << ", \"line\": " << row.line
+        << ", \"addr\": " << row.addr
         << "}";
 }
 
@@ -44,13 +44,30 @@ std::ostream &operator << (std::ostream &os, const DwarfLineInfo &lines) {
         << "}";
 }
 
+std::ostream & operator << (std::ostream &os, const DwarfEntries &entries) {
+    os << "[ ";
+    const char *sep = "";
+    for (auto entry : entries) {
+        os << sep << *entry;
+        sep = ",\n";
+    }
+    return os << " ]";
+}
+
 std::ostream & operator << (std::ostream &os, const DwarfEntry &entry) {
     os
         << "{ \"type\": \"" << entry.type->tag << "\""
-        << ", \"attributes\": " << entry.attributes;
+        << ", \"attributes\": { ";
+    auto attributes = entry.attributes();
+    const char *sep = "";
+    for (size_t i = 0; i < entry.type->specs.size(); ++i) {
+        os << sep << " \"" << entry.type->specs[i].name << "\": " << attributes[i];
+        sep = ",\n";
+    }
+    os << " }";
 
     if (entry.type->hasChildren)
-        os << ", \"children\": " << entry.children;
+        os << ", \"children\": " << entry.children();
 
     return os
         << " }";
@@ -80,7 +97,7 @@ std::ostream &operator << (std::ostream &os, const DwarfUnit &unit) {
         << " , \"offset\":" <<  unit.offset
         << " , \"version\":" <<  int(unit.version)
         << " , \"addrlen\":" <<  int(unit.addrlen)
-        << " , \"linenumbers\":" << unit.lines
+        << " , \"linenumbers\":" << unit.getLines()
         << " , \"entries\":" <<  unit.entries
         << " }";
 }
@@ -273,6 +290,7 @@ std::ostream &
 operator << (std::ostream &os, const DwarfFrameInfo &info)
 {
 
+    info.decodeAll();
     os << "{ \"cielist\": [";
     const char *sep = "";
     for (auto cieent = info.cies.begin(); cieent != info.cies.end(); ++cieent) {
@@ -283,8 +301,8 @@ operator << (std::ostream &os, const DwarfFrameInfo &info)
     os << "], \"fdelist\": [";
 
     sep = "";
-    for (auto fde = info.fdeList.begin(); fde != info.fdeList.end(); ++ fde) {
-        os << sep << std::make_pair(&info, &(*fde));
+    for (auto fde = info.fdes.begin(); fde != info.fdes.end(); ++ fde) {
+        os << sep << std::make_pair(&info, &fde->second);
         sep = ",\n";
     }
     return os << " ] }";
@@ -298,11 +316,11 @@ operator << (std::ostream &os, DwarfInfo &dwarf)
         << ", \"pubnameUnits\": " << dwarf.pubnames()
         << ", \"aranges\": " << dwarf.ranges();
 
-    if (dwarf.debugFrame)
-        os << ", \"debugframe\": " << *dwarf.debugFrame;
+    if (dwarf.getDebugFrame())
+        os << ", \"debugframe\": " << *dwarf.getDebugFrame();
 
-    if (dwarf.ehFrame)
-        os << ", \"ehFrame\": " << *dwarf.ehFrame;
+    if (dwarf.getEhFrame())
+        os << ", \"ehFrame\": " << *dwarf.getEhFrame();
     return os << "}";
 }
 
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <exception>
 #include <stack>
 #include <libgen.h>
 #include <sstream>
@@ -27,9 +29,13 @@ DWARFReader::getuint(int len)
     uint8_t bytes[16];
     if (len > 16)
         throw Exception() << "can't deal with ints of size " << len;
-    io->readObj(off, bytes, len);
-    off += len;
-    uint8_t *p = bytes + len;
+    const uint8_t *p = span(len);
+    if (p == 0) {
+        io->readObj(off, bytes, len);
+        off += len;
+        p = bytes;
+    }
+    p += len;
     for (i = 1; i <= len; i++)
         rc = rc << 8 | p[-i];
     return rc;
@@ -43,9 +49,13 @@ DWARFReader::getint(int len)
     uint8_t bytes[16];
     if (len > 16 || len < 1)
         throw Exception() << "can't deal with ints of size " << len;
-    io->readObj(off, bytes, len);
-    off += len;
-    uint8_t *p = bytes + len;
+    const uint8_t *p = span(len);
+    if (p == 0) {
+        io->readObj(off, bytes, len);
+        off += len;
+        p = bytes;
+    }
+    p += len;
     rc = (p[-1] & 0x80) ? -1 : 0;
     for (i = 1; i <= len; i++)
         rc = rc << 8 | p[-i];
@@ -55,18 +65,26 @@ DWARFReader::getint(int len)
 uint32_t
 DWARFReader::getu32()
 {
-    unsigned char q[4];
-    io->readObj(off, q, 4);
-    off += sizeof q;
+    unsigned char buf[4];
+    const unsigned char *q = span(sizeof buf);
+    if (q == 0) {
+        io->readObj(off, buf, sizeof buf);
+        off += sizeof buf;
+        q = buf;
+    }
     return q[0] | q[1] << 8 | q[2] << 16 | uint32_t(q[3] << 24);
 }
 
 uint16_t
 DWARFReader::getu16()
 {
-    unsigned char q[2];
-    io->readObj(off, q, 2);
-    off += sizeof q;
+    unsigned char buf[2];
+    const unsigned char *q = span(sizeof buf);
+    if (q == 0) {
+        io->readObj(off, buf, sizeof buf);
+        off += sizeof buf;
+        q = buf;
+    }
     return q[0] | q[1] << 8;
 }
 
@@ -74,6 +92,8 @@ uint8_t
 DWARFReader::getu8()
 {
     unsigned char q;
+    if (resident(1))
+        return data[off++];
     io->readObj(off, &q, 1);
     off++;
     return q;
@@ -82,27 +102,56 @@ DWARFReader::getu8()
 int8_t
 DWARFReader::gets8()
 {
-    int8_t q;
-    io->readObj(off, &q, 1);
-    off += 1;
-    return q;
+    return int8_t(getu8());
 }
 
 std::string
 DWARFReader::getstring()
 {
-    std::ostringstream s;
-    for (size_t len = 0;; ++len) {
-        char c;
-        io->readObj(off, &c);
-        off += 1;
-        if (c == 0)
-            break;
-        s << c;
-        if (len > 2000)
-            abort();
+    auto p = viewstring();
+    if (p)
+        return p;
+    std::string s = io->readString(off);
+    off += s.size() + 1;
+    return s;
+}
+
+/*
+ * If the string at the current offset is resident in memory, skip over it
+ * and return a pointer to it. Otherwise, returns null.
+ */
+const char *
+DWARFReader::viewstring()
+{
+    for (size_t len = 1; resident(len); len = dataLen - off + 1) {
+        auto p = (const char *)data + off;
+        auto term = (const char *)memchr(p, 0, dataLen - off);
+        if (term) {
+            off += term - p + 1;
+            return p;
+        }
     }
-    return s.str();
+    return 0;
+}
+
+/*
+ * Extend "data" to cover at least the first "need" bytes of a compressed
+ * section, inflating a chunk at a time. The inflated section doesn't move
+ * as it grows, so pointers we've handed out stay good.
+ */
+bool
+DWARFReader::grow(Elf_Off need)
+{
+    static const Elf_Off chunk = 64 * 1024;
+    Elf_Off want = std::min(mappable, std::max(need, dataLen + chunk));
+    auto p = (const unsigned char *)io->view(0, want);
+    if (p == 0) {
+        mappable = 0;
+        return false;
+    }
+    data = p;
+    dataLen = want;
+    return true;
 }
 
 uintmax_t
@@ -111,7 +160,10 @@ DWARFReader::getuleb128shift(int *shift, bool &isSigned)
     uintmax_t result;
     unsigned char byte;
     for (result = 0, *shift = 0;;) {
-        io->readObj(off++, &byte);
+        if (resident(1))
+            byte = data[off++];
+        else
+            io->readObj(off++, &byte);
         result |= (uintmax_t)(byte & 0x7f) << *shift;
         *shift += 7;
         if ((byte & 0x80) == 0)
@@ -166,51 +218,108 @@ DwarfPubnameUnit::DwarfPubnameUnit(DWARFReader &r)
 }
 
 DwarfInfo::DwarfInfo(std::shared_ptr<ElfObject> obj)
-    : info(obj->getSection(".debug_info", SHT_PROGBITS))
+    : unitRangesIndexed(false)
+    , info(obj->getSection(".debug_info", SHT_PROGBITS))
     , debstr(obj->getSection(".debug_str", SHT_PROGBITS))
     , pubnamesh(obj->getSection(".debug_pubnames", SHT_PROGBITS))
     , arangesh(obj->getSection(".debug_aranges", SHT_PROGBITS))
     , debug_frame(obj->getSection(".debug_frame", SHT_PROGBITS))
     , altImageLoaded(false)
+    , unitOffsetsScanned(false)
+    , debugStrings(nullptr)
+    , debugFrameLoaded(false)
+    , ehFrameLoaded(false)
     , abbrev(obj->getSection(".debug_abbrev", SHT_PROGBITS))
     , lineshdr(obj->getSection(".debug_line", SHT_PROGBITS))
+    , rangesh(obj->getSection(".debug_ranges", SHT_PROGBITS))
     , elf(obj)
 {
-    // want these first: other sections refer into this.
-    if (debstr) {
-        debugStrings = new char[debstr->getSize()];
-        debstr->io->readObj(0, debugStrings, debstr->getSize());
-    } else {
-        debugStrings = 0;
-    }
-    auto eh_frame = obj->getSection(".eh_frame", SHT_PROGBITS);
-    if (eh_frame) {
-        try {
-            ehFrame = make_unique<DwarfFrameInfo>(this, eh_frame, FI_EH_FRAME);
-        }
-        catch (const Exception &ex) {
-            ehFrame = 0;
-            std::clog << "can't decode .eh_frame for "
-                << obj->getio()->describe() << ": " << ex.what() << "\n";
+    StatTimer _("parse dwarf", *obj->getio());
+    if (!dwarfIndexDirectory.empty())
+        index = loadDwarfIndex(*this);
+    if (index)
+        index->restoreSymbols(*elf);
+}
+
+const char *
+DwarfInfo::getDebugStrings()
+{
+    auto strings = debugStrings.load(std::memory_order_acquire);
+    if (strings || !debstr)
+        return strings;
+    std::lock_guard<std::mutex> guard(loadLock);
+    strings = debugStrings.load(std::memory_order_relaxed);
+    if (!strings) {
+        StatTimer _("parse dwarf", *elf->getio());
+        strings = debstr->io->view(0, debstr->getSize());
+        if (strings == 0) {
+            debugStringsBuf.reset(new char[debstr->getSize()]);
+            debstr->io->readObj(0, debugStringsBuf.get(), debstr->getSize());
+            strings = debugStringsBuf.get();
         }
-    } else {
-        ehFrame = 0;
+        debugStrings.store(strings, std::memory_order_release);
     }
+    return strings;
+}
 
-    if (debug_frame && ! noDebugLibs) {
-        DWARFReader reader(debug_frame);
-        try {
-            debugFrame = make_unique<DwarfFrameInfo>(this, debug_frame, FI_DEBUG_FRAME);
-        }
-        catch (const Exception &ex) {
-            debugFrame = 0;
-            std::clog << "can't decode .debug_frame for "
-                << obj->getio()->describe() << ": " << ex.what() << "\n";
+/*
+ * A compressed .debug_str is inflated only as far as the strings we look
+ * at: its InflateReader keeps what it has inflated in place, so the string
+ * it points to stays good.
+ */
+const char *
+DwarfInfo::getDebugString(Elf_Off offset)
+{
+    if (debstr && ((*debstr)->sh_flags & SHF_COMPRESSED)) {
+        auto string = debstr->io->viewString(offset);
+        if (string == 0)
+            throw Exception() << "no string at offset " << offset << " in " << elf->getio()->describe();
+        return string;
+    }
+    return getDebugStrings() + offset;
+}
+
+std::unique_ptr<DwarfFrameInfo>
+DwarfInfo::loadFrameInfo(std::shared_ptr<const ElfSection> section, FIType type)
+{
+    if (!section)
+        return nullptr;
+    StatTimer _("parse dwarf", *elf->getio());
+    try {
+        return make_unique<DwarfFrameInfo>(this, section, type);
+    }
+    catch (const Exception &ex) {
+        std::clog << "can't decode " << (type == FI_EH_FRAME ? ".eh_frame" : ".debug_frame")
+            << " for " << elf->getio()->describe() << ": " << ex.what() << "\n";
+        return nullptr;
+    }
+}
+
+DwarfFrameInfo *
+DwarfInfo::getEhFrame()
+{
+    if (!ehFrameLoaded.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> guard(loadLock);
+        if (!ehFrameLoaded.load(std::memory_order_relaxed)) {
+            ehFrame = loadFrameInfo(elf->getSection(".eh_frame", SHT_PROGBITS), FI_EH_FRAME);
+            ehFrameLoaded.store(true, std::memory_order_release);
         }
-    } else {
-        debugFrame = 0;
     }
+    return ehFrame.get();
+}
 
+DwarfFrameInfo *
+DwarfInfo::getDebugFrame()
+{
+    if (!debugFrameLoaded.load(std::memory_order_acquire)) {
+        std::lock_guard<std::mutex> guard(loadLock);
+        if (!debugFrameLoaded.load(std::memory_order_relaxed)) {
+            if (!noDebugLibs)
+                debugFrame = loadFrameInfo(debug_frame, FI_DEBUG_FRAME);
+            debugFrameLoaded.store(true, std::memory_order_release);
+        }
+    }
+    return debugFrame.get();
 }
 
 std::list<DwarfPubnameUnit> &
@@ -225,9 +334,12 @@ DwarfInfo::pubnames()
     return pubnameUnits;
 }
 
+unsigned DwarfInfo::unitThreads = 1;
+
 std::shared_ptr<DwarfUnit>
 DwarfInfo::getUnit(off_t offset)
 {
+    std::lock_guard<std::mutex> guard(unitsLock);
     auto unit = unitsm.find(offset);
     if (unit != unitsm.end())
         return unit->second;
@@ -238,14 +350,69 @@ DwarfInfo::getUnit(off_t offset)
     return unitsm[offset];
 }
 
+std::shared_ptr<DwarfUnit>
+DwarfInfo::unitContaining(Elf_Off offset)
+{
+    if (info == 0)
+        return std::shared_ptr<DwarfUnit>();
+    Elf_Off start;
+    {
+        std::lock_guard<std::mutex> guard(unitsLock);
+        if (!unitOffsetsScanned) {
+            DWARFReader r(info);
+            while (!r.empty()) {
+                unitOffsets.push_back(r.getOffset());
+                size_t dwarfLen;
+                auto length = r.getlength(&dwarfLen);
+                r.setOffset(r.getOffset() + length);
+            }
+            unitOffsetsScanned = true;
+        }
+        auto it = std::upper_bound(unitOffsets.begin(), unitOffsets.end(), offset);
+        if (it == unitOffsets.begin())
+            return std::shared_ptr<DwarfUnit>();
+        start = *--it;
+    }
+    auto unit = getUnit(start);
+    if (unit && offset >= unit->end)
+        return std::shared_ptr<DwarfUnit>();
+    return unit;
+}
+
 std::list<std::shared_ptr<DwarfUnit>>
 DwarfInfo::getUnits()
 {
     std::list<std::shared_ptr<DwarfUnit>> list;
     if (info == 0)
         return list;
-    DWARFReader r(info);
 
+    if (unitThreads != 1 && canDecodeInParallel()) {
+        // Find where each unit starts from the headers alone, then decode
+        // the ones we don't have yet in parallel.
+        std::vector<Elf_Off> offsets, missing;
+        DWARFReader r(info);
+        while (!r.empty()) {
+            auto off = r.getOffset();
+            size_t dwarfLen;
+            auto length = r.getlength(&dwarfLen);
+            r.setOffset(r.getOffset() + length);
+            offsets.push_back(off);
+        }
+        {
+            std::lock_guard<std::mutex> guard(unitsLock);
+            for (auto off : offsets)
+                if (unitsm.find(off) == unitsm.end())
+                    missing.push_back(off);
+        }
+        decodeUnits(missing);
+        std::lock_guard<std::mutex> guard(unitsLock);
+        for (auto off : offsets)
+            list.push_back(unitsm[off]);
+        return list;
+    }
+
+    std::lock_guard<std::mutex> guard(unitsLock);
+    DWARFReader r(info);
     while (!r.empty()) {
        auto off = r.getOffset();
        if (unitsm.find(off) != unitsm.end()) {
@@ -260,6 +427,54 @@ DwarfInfo::getUnits()
     return list;
 }
 
+/*
+ * Units only share the DwarfInfo's sections, so we can decode them
+ * concurrently if those sections are all in memory. Other readers keep
+ * caches that aren't safe to share between threads.
+ */
+bool
+DwarfInfo::canDecodeInParallel() const
+{
+    for (auto &section : { info, abbrev, lineshdr }) {
+        // Compressed sections' readers lock, so are safe to share, and
+        // viewing them all would inflate them before we need to.
+        if (section && !((*section)->sh_flags & SHF_COMPRESSED)
+                && section->io->view(0, section->getSize()) == 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Decode the units at "offsets" on a pool of threads, and add them to
+ * unitsm. If any fail to decode, we keep those before the first failure, as
+ * if we'd decoded them in order, and rethrow its exception.
+ */
+void
+DwarfInfo::decodeUnits(const std::vector<Elf_Off> &offsets)
+{
+    std::vector<std::shared_ptr<DwarfUnit>> units(offsets.size());
+    std::exception_ptr error;
+    try {
+        parallelFor(offsets.size(), unitThreads, [&](size_t i, size_t) {
+            DWARFReader r(info, offsets[i]);
+            units[i] = std::make_shared<DwarfUnit>(this, r);
+        });
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> guard(unitsLock);
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        if (!units[i])
+            std::rethrow_exception(error);
+        // Someone may have decoded this unit with getUnit() in the meantime.
+        if (unitsm.find(offsets[i]) == unitsm.end())
+            unitsm[offsets[i]] = units[i];
+    }
+}
+
 
 std::list<DwarfARangeSet> &
 DwarfInfo::ranges()
@@ -275,7 +490,6 @@ DwarfInfo::ranges()
 
 DwarfInfo::~DwarfInfo()
 {
-    delete[] debugStrings;
 }
 
 DwarfARangeSet::DwarfARangeSet(DWARFReader &r)
@@ -309,10 +523,31 @@ DwarfARangeSet::DwarfARangeSet(DWARFReader &r)
     }
 }
 
+static intmax_t
+dwarfAttr2Int(const DwarfAttribute &attr)
+{
+    switch (attr.spec->form) {
+    case DW_FORM_data1:
+    case DW_FORM_data2:
+    case DW_FORM_data4:
+    case DW_FORM_data8:
+    case DW_FORM_sdata:
+    case DW_FORM_udata:
+        return attr.value.sdata;
+    case DW_FORM_sec_offset:
+        return attr.value.ref;
+    default:
+        abort();
+    }
+}
+
 DwarfUnit::DwarfUnit(DwarfInfo *di, DWARFReader &r)
     : dwarf(di)
     , offset(r.getOffset())
+    , linesDecoded(false)
+    , functionsIndexed(false)
 {
+    StatTimer _("decode dwarf units", *di->elf->getio());
     length = r.getlength(&dwarfLen);
     Elf_Off nextoff = r.getOffset() + length;
     version = r.getu16();
@@ -329,23 +564,63 @@ DwarfUnit::DwarfUnit(DwarfInfo *di, DWARFReader &r)
                 std::forward_as_tuple(DwarfTag(code)),
                 std::forward_as_tuple(abbR, code));
 
-    DWARFReader entriesR(r, r.getOffset(), nextoff - r.getOffset());
+    end = nextoff;
     assert(nextoff <= r.getLimit());
-    decodeEntries(entriesR, entries, nullptr);
+    // A unit holds a single top-level entry, so we take the end of the unit
+    // as its end, rather than skipping all its descendents to find it.
+    Elf_Off entryOff = r.getOffset();
+    code = r.getuleb128();
+    if (code != 0) {
+        DWARFReader entriesR(r, r.getOffset(), nextoff - r.getOffset());
+        auto e = arena.make<DwarfEntry>(entriesR, code, this, entryOff, nullptr);
+        if (e->type->hasChildren)
+            e->nextOffset = nextoff;
+        allEntries.insert(entryOff, e);
+        entries.first = arena.array<DwarfEntry *>(1);
+        entries.first[0] = e;
+        entries.count = 1;
+    }
     r.setOffset(nextoff);
 }
 
-std::string
-DwarfUnit::name() const
+DwarfLineInfo &
+DwarfUnit::getLines() const
 {
-    return (*entries.begin())->name();
+    if (linesDecoded)
+        return lines;
+    try {
+        for (auto entry : entries) {
+            switch (entry->type->tag) {
+            case DW_TAG_partial_unit:
+            case DW_TAG_compile_unit: {
+                auto stmtsAttr = entry->attrForName(DW_AT_stmt_list);
+                if (dwarf->lineshdr && stmtsAttr) {
+                    static auto &decoded = Stats::counter("dwarf line tables decoded");
+                    Stats::add(decoded);
+                    size_t stmts = dwarfAttr2Int(*stmtsAttr);
+                    DWARFReader r2(dwarf->lineshdr, stmts);
+                    lines.build(r2, this);
+                }
+                break;
+            }
+            default: // not otherwise interested for the mo.
+                break;
+            }
+        }
+    }
+    catch (...) {
+        // Leave nothing half built, so the next caller sees the error too.
+        lines.clear();
+        throw;
+    }
+    linesDecoded = true;
+    return lines;
 }
 
-DwarfUnit::~DwarfUnit()
+std::string
+DwarfUnit::name() const
 {
-   // Delete all DwarfEntry's for this unit
-   for (auto e : allEntries)
-      delete e.second;
+    return (*entries.begin())->name();
 }
 
 DwarfAbbreviation::DwarfAbbreviation(DWARFReader &r, intmax_t code_)
@@ -363,24 +638,6 @@ DwarfAbbreviation::DwarfAbbreviation(DWARFReader &r, intmax_t code_)
     }
 }
 
-static intmax_t
-dwarfAttr2Int(const DwarfAttribute &attr)
-{
-    switch (attr.spec->form) {
-    case DW_FORM_data1:
-    case DW_FORM_data2:
-    case DW_FORM_data4:
-    case DW_FORM_data8:
-    case DW_FORM_sdata:
-    case DW_FORM_udata:
-        return attr.value.sdata;
-    case DW_FORM_sec_offset:
-        return attr.value.ref;
-    default:
-        abort();
-    }
-}
-
 DwarfLineState::DwarfLineState(DwarfLineInfo *li)
 {
     reset(li);
@@ -390,7 +647,7 @@ void
 DwarfLineState::reset(DwarfLineInfo *li)
 {
     addr = 0;
-    file = &li->files[1];
+    file = li->files.size() > 1 ? 1 : 0;
     line = 1;
     column = 0;
     is_stmt = li->default_is_stmt;
@@ -406,6 +663,17 @@ dwarfStateAddRow(DwarfLineInfo *li, const DwarfLineState &state)
     li->matrix.push_back(state);
 }
 
+void
+DwarfLineInfo::clear()
+{
+    opcode_lengths.clear();
+    directories.clear();
+    files.clear();
+    matrix.clear();
+    index.clear();
+    indexed = false;
+}
+
 void
 DwarfLineInfo::build(DWARFReader &r, const DwarfUnit *unit)
 {
@@ -507,7 +775,9 @@ DwarfLineInfo::build(DWARFReader &r, const DwarfUnit *unit)
                 state.line += r.getsleb128();
                 break;
             case DW_LNS_set_file:
-                state.file = &files[r.getuleb128()];
+                state.file = r.getuleb128();
+                if (state.file >= files.size())
+                    state.file = 0;
                 break;
             case DW_LNS_copy:
                 dwarfStateAddRow(this, state);
@@ -542,6 +812,44 @@ DwarfLineInfo::build(DWARFReader &r, const DwarfUnit *unit)
 }
 
 
+/*
+ * Find the rows of the matrix whose address range covers "addr", in matrix
+ * order.
+ */
+void
+DwarfLineInfo::rowsForAddr(uintmax_t addr, std::vector<const DwarfLineRow *> &rows)
+{
+    addrIndex();
+    auto it = std::upper_bound(index.begin(), index.end(), addr,
+        [](uintmax_t addr, const DwarfLineRange &range) { return addr < range.start; });
+    size_t first = rows.size();
+    while (it != index.begin()) {
+        --it;
+        if (it->maxEnd <= addr)
+            break;
+        if (it->end > addr)
+            rows.push_back(&matrix[it->row]);
+    }
+    std::sort(rows.begin() + first, rows.end());
+}
+
+const std::vector<DwarfLineRange> &
+DwarfLineInfo::addrIndex()
+{
+    if (!indexed) {
+        for (size_t i = 0; i + 1 < matrix.size(); ++i) {
+            if (!matrix[i].end_sequence && matrix[i].addr < matrix[i + 1].addr)
+                index.emplace_back(matrix[i].addr, matrix[i + 1].addr, i);
+        }
+        std::stable_sort(index.begin(), index.end(),
+            [](const DwarfLineRange &l, const DwarfLineRange &r) { return l.start < r.start; });
+        for (size_t i = 1; i < index.size(); ++i)
+            index[i].maxEnd = std::max(index[i].end, index[i - 1].maxEnd);
+        indexed = true;
+    }
+    return index;
+}
+
 DwarfFileEntry::DwarfFileEntry(const std::string &name_, std::string dir_,
         unsigned lastMod_, unsigned length_)
     : name(name_)
@@ -567,7 +875,7 @@ DwarfAttribute::DwarfAttribute(DWARFReader &r, const DwarfEntry *entry_, const D
 
     case DW_FORM_GNU_strp_alt: {
         DwarfInfo *info = entry->unit->dwarf;
-        value.string = info->getAltDwarf()->debugStrings + r.getint(entry->unit->dwarfLen);
+        value.string = info->getAltDwarf()->getDebugString(r.getint(entry->unit->dwarfLen));
         break;
     }
 
@@ -608,7 +916,7 @@ DwarfAttribute::DwarfAttribute(DWARFReader &r, const DwarfEntry *entry_, const D
         break;
 
     case DW_FORM_strp:
-        value.string = entry->unit->dwarf->debugStrings + r.getint(entry->unit->dwarfLen);
+        value.string = entry->unit->dwarf->getDebugString(r.getint(entry->unit->dwarfLen));
         break;
 
     case DW_FORM_ref1:
@@ -632,7 +940,9 @@ DwarfAttribute::DwarfAttribute(DWARFReader &r, const DwarfEntry *entry_, const D
         break;
 
     case DW_FORM_string:
-        value.string = strdup(r.getstring().c_str());
+        value.string = r.viewstring();
+        if (value.string == 0)
+            value.string = entry->unit->arena.strdup(r.getstring());
         break;
 
     case DW_FORM_block1:
@@ -673,7 +983,7 @@ DwarfAttribute::DwarfAttribute(DWARFReader &r, const DwarfEntry *entry_, const D
         break;
 
     case DW_FORM_ref_sig8:
-        value.ref = r.getu8();
+        value.ref = r.getuint(8);
         break;
 
     default:
@@ -682,68 +992,478 @@ DwarfAttribute::DwarfAttribute(DWARFReader &r, const DwarfEntry *entry_, const D
     }
 }
 
-DwarfEntry *
-DwarfEntry::firstChild(DwarfTag tag)
+/*
+ * Skip over an attribute's value without decoding it.
+ */
+static void
+skipForm(DWARFReader &r, const DwarfUnit *unit, DwarfForm form)
+{
+    switch (form) {
+    case DW_FORM_flag_present:
+        break;
+    case DW_FORM_data1: case DW_FORM_ref1: case DW_FORM_flag:
+        r.skip(1);
+        break;
+    case DW_FORM_data2: case DW_FORM_ref2:
+        r.skip(2);
+        break;
+    case DW_FORM_data4: case DW_FORM_ref4:
+        r.skip(4);
+        break;
+    case DW_FORM_data8: case DW_FORM_ref8: case DW_FORM_ref_sig8:
+        r.skip(8);
+        break;
+    case DW_FORM_addr:
+        r.skip(unit->addrlen);
+        break;
+    case DW_FORM_strp: case DW_FORM_ref_addr: case DW_FORM_sec_offset:
+    case DW_FORM_GNU_strp_alt: case DW_FORM_GNU_ref_alt:
+        r.skip(unit->dwarfLen);
+        break;
+    case DW_FORM_sdata: case DW_FORM_udata: case DW_FORM_ref_udata:
+        r.getuleb128();
+        break;
+    case DW_FORM_string:
+        while (r.getu8() != 0)
+            ;
+        break;
+    case DW_FORM_block1:
+        r.skip(r.getu8());
+        break;
+    case DW_FORM_block2:
+        r.skip(r.getu16());
+        break;
+    case DW_FORM_block4:
+        r.skip(r.getu32());
+        break;
+    case DW_FORM_exprloc: case DW_FORM_block:
+        r.skip(r.getuleb128());
+        break;
+    default:
+        throw Exception() << "can't skip DWARF form " << int(form);
+    }
+}
+
+/*
+ * Skip over the attributes of a DIE of the given type. If it has a
+ * DW_AT_sibling attribute, returns the sibling's offset, otherwise 0.
+ */
+static Elf_Off
+skipAttributes(DWARFReader &r, const DwarfUnit *unit, const DwarfAbbreviation *type)
+{
+    Elf_Off sibling = 0;
+    for (auto &spec : type->specs) {
+        if (spec.name != DW_AT_sibling) {
+            skipForm(r, unit, spec.form);
+            continue;
+        }
+        switch (spec.form) {
+        case DW_FORM_ref1: sibling = unit->offset + r.getu8(); break;
+        case DW_FORM_ref2: sibling = unit->offset + r.getu16(); break;
+        case DW_FORM_ref4: sibling = unit->offset + r.getu32(); break;
+        case DW_FORM_ref8: sibling = unit->offset + r.getuint(8); break;
+        case DW_FORM_ref_udata: sibling = unit->offset + r.getuleb128(); break;
+        case DW_FORM_ref_addr: sibling = r.getuint(unit->dwarfLen); break;
+        default: skipForm(r, unit, spec.form); break;
+        }
+    }
+    return sibling;
+}
+
+const DwarfEntry *
+DwarfEntry::firstChild(DwarfTag tag) const
 {
-   for (auto &ent : children)
+   for (auto &ent : children())
       if (ent->type->tag == tag)
          return ent;
    return 0;
 }
 
-DwarfEntry::DwarfEntry(DWARFReader &r, intmax_t code, DwarfUnit *unit_, intmax_t offset_, DwarfEntry *parent_)
-    : parent(parent_)
+DwarfEntry::DwarfEntry(DWARFReader &r, intmax_t code, DwarfUnit *unit_, intmax_t offset_, const DwarfEntry *parent_)
+    : attrOffset(r.getOffset())
+    , childrenDecoded(false)
+    , attrs(0)
+    , parent(parent_)
     , unit(unit_)
-    , type(&unit->abbreviations.find(DwarfTag(code))->second)
+    , type(unit->abbrevForCode(code))
     , offset(offset_)
 {
+    static auto &decoded = Stats::counter("dwarf DIEs decoded");
+    Stats::add(decoded);
+    Elf_Off sibling = skipAttributes(r, unit, type);
+    childOffset = r.getOffset();
+    nextOffset = type->hasChildren ? sibling : childOffset;
+}
 
-    for (auto spec = type->specs.begin(); spec != type->specs.end(); ++spec) {
-        attributes.emplace(std::piecewise_construct,
-                std::forward_as_tuple(spec->name),
-                std::forward_as_tuple(r, this, &(*spec)));
+const DwarfAttribute *
+DwarfEntry::attributes() const
+{
+    if (attrs == 0) {
+        DWARFReader r(unit->dwarf->info, attrOffset, childOffset - attrOffset);
+        attrs = unit->arena.array<DwarfAttribute>(type->specs.size());
+        for (size_t i = 0; i < type->specs.size(); ++i)
+            new (attrs + i) DwarfAttribute(r, this, &type->specs[i]);
     }
-    switch (type->tag) {
-    case DW_TAG_partial_unit:
-    case DW_TAG_compile_unit: {
-        auto stmtsAttr = attrForName(DW_AT_stmt_list);
-        if (unit->dwarf->lineshdr && stmtsAttr) {
-            size_t stmts = dwarfAttr2Int(*stmtsAttr);
-            DWARFReader r2(unit->dwarf->lineshdr, stmts);
-            unit_->lines.build(r2, unit);
-        }
-#if 0
-        else {
-            if (verbose)
-               *debug << "warning: no line number info found in " << r.io->describe() <<  "/" << name() << " (stmts=" << stmtsAttr << ", hdr=" << unit->dwarf->lineshdr << std::endl;
+    return attrs;
+}
+
+const DwarfEntries &
+DwarfEntry::children() const
+{
+    if (!childrenDecoded) {
+        if (type->hasChildren) {
+            DWARFReader r(unit->dwarf->info, childOffset, unit->end - childOffset);
+            unit->decodeEntries(r, childList, this);
+            if (nextOffset == 0)
+                nextOffset = r.getOffset();
         }
-#endif
-        break;
+        childrenDecoded = true;
     }
-    default: // not otherwise interested for the mo.
-        break;
+    return childList;
+}
+
+Elf_Off
+DwarfEntry::next() const
+{
+    if (nextOffset == 0) {
+        DWARFReader r(unit->dwarf->info, childOffset, unit->end - childOffset);
+        unit->skipEntries(r);
+        nextOffset = r.getOffset();
     }
-    if (type->hasChildren)
-        unit_->decodeEntries(r, children, this);
+    return nextOffset;
+}
+
+const DwarfAbbreviation *
+DwarfUnit::abbrevForCode(intmax_t code) const
+{
+    auto abbrev = abbreviations.find(DwarfTag(code));
+    if (abbrev == abbreviations.end())
+        throw Exception() << "no abbreviation for code " << code
+            << " in unit at offset " << offset;
+    return &abbrev->second;
 }
 
 void
-DwarfUnit::decodeEntries(DWARFReader &r, DwarfEntries &entries, DwarfEntry *parent)
+DwarfUnit::decodeEntries(DWARFReader &r, DwarfEntries &entries, const DwarfEntry *parent)
 {
+    std::vector<DwarfEntry *> list;
     while (!r.empty()) {
         intmax_t offset = r.getOffset();
+        intmax_t code = r.getuleb128();
+        if (code == 0)
+            break;
+        auto e = arena.make<DwarfEntry>(r, code, this, offset, parent);
+        allEntries.insert(offset, e);
+        list.push_back(e);
+        r.setOffset(e->next());
+    }
+    entries.count = list.size();
+    entries.first = arena.array<DwarfEntry *>(list.size());
+    std::copy(list.begin(), list.end(), entries.first);
+}
+
+/*
+ * Skip a list of sibling entries and all their descendents, leaving the
+ * reader after the list's terminator.
+ */
+void
+DwarfUnit::skipEntries(DWARFReader &r) const
+{
+    while (!r.empty()) {
         intmax_t code = r.getuleb128();
         if (code == 0)
             return;
-        auto e = new DwarfEntry(r, code, this, offset, parent);
-        allEntries[offset] = e;
-        entries.push_back(e);
+        auto type = abbrevForCode(code);
+        Elf_Off sibling = skipAttributes(r, this, type);
+        if (!type->hasChildren)
+            continue;
+        if (sibling != 0)
+            r.setOffset(sibling);
+        else
+            skipEntries(r);
+    }
+}
+
+void
+DwarfEntryIndex::insert(Elf_Off off, DwarfEntry *entry)
+{
+    if ((count + 1) * 2 > slots.size()) {
+        std::vector<std::pair<Elf_Off, DwarfEntry *>> old(std::max(size_t(64), slots.size() * 2));
+        old.swap(slots);
+        count = 0;
+        for (auto &slot : old)
+            if (slot.second)
+                insert(slot.first, slot.second);
+    }
+    size_t i = slotFor(off);
+    for (; slots[i].second; i = (i + 1) & (slots.size() - 1)) {
+        if (slots[i].first == off) {
+            slots[i].second = entry;
+            return;
+        }
+    }
+    slots[i] = std::make_pair(off, entry);
+    ++count;
+}
+
+/*
+ * Find the entry at a specific offset, decoding only the entries on the
+ * path from the unit's top level down to it.
+ */
+DwarfEntry *
+DwarfUnit::entryAt(Elf_Off off)
+{
+    auto found = allEntries.find(off);
+    if (found)
+        return found;
+    const DwarfEntries *list = &entries;
+    for (;;) {
+        const DwarfEntry *container = 0;
+        for (auto e : *list) {
+            if (Elf_Off(e->offset) == off)
+                return e;
+            if (Elf_Off(e->offset) < off && off < e->next()) {
+                container = e;
+                break;
+            }
+        }
+        if (container == 0)
+            return 0;
+        list = &container->children();
+    }
+}
+
+/*
+ * Find the address ranges covered by an entry, from its DW_AT_low_pc and
+ * DW_AT_high_pc, or its DW_AT_ranges. Returns false if it has neither.
+ */
+bool
+DwarfEntry::addrRanges(std::vector<std::pair<uintmax_t, uintmax_t>> &out) const
+{
+    auto low = attrForName(DW_AT_low_pc);
+    auto high = attrForName(DW_AT_high_pc);
+    if (low && high && low->spec->form == DW_FORM_addr) {
+        uintmax_t start = low->value.addr;
+        uintmax_t end;
+        switch (high->spec->form) {
+        case DW_FORM_addr:
+            end = high->value.addr;
+            break;
+        case DW_FORM_data1: case DW_FORM_data2: case DW_FORM_data4:
+        case DW_FORM_data8: case DW_FORM_udata:
+            end = start + high->value.udata;
+            break;
+        case DW_FORM_sdata:
+            end = start + high->value.sdata;
+            break;
+        default:
+            return false;
+        }
+        out.emplace_back(start, end);
+        return true;
+    }
+
+    auto ranges = attrForName(DW_AT_ranges);
+    if (ranges == 0 || !unit->dwarf->rangesh)
+        return false;
+    uintmax_t off;
+    switch (ranges->spec->form) {
+    case DW_FORM_sec_offset:
+        off = ranges->value.ref;
+        break;
+    case DW_FORM_data4: case DW_FORM_data8:
+        off = ranges->value.udata;
+        break;
+    default:
+        return false;
+    }
+
+    // Offsets in the list are relative to the unit's base address.
+    uintmax_t base = 0;
+    if (!unit->entries.empty()) {
+        auto unitLow = (*unit->entries.begin())->attrForName(DW_AT_low_pc);
+        if (unitLow && unitLow->spec->form == DW_FORM_addr)
+            base = unitLow->value.addr;
+    }
+    uintmax_t baseSelect = unit->addrlen >= sizeof (uintmax_t)
+        ? std::numeric_limits<uintmax_t>::max()
+        : (uintmax_t(1) << unit->addrlen * 8) - 1;
+    DWARFReader r(unit->dwarf->rangesh, off);
+    while (!r.empty()) {
+        uintmax_t start = r.getuint(unit->addrlen);
+        uintmax_t end = r.getuint(unit->addrlen);
+        if (start == 0 && end == 0)
+            break;
+        if (start == baseSelect)
+            base = end;
+        else
+            out.emplace_back(base + start, base + end);
     }
+    return true;
+}
+
+/*
+ * Add the ranges of all subprograms in "entries" and their descendents to
+ * the unit's function index. We don't look inside subprograms themselves,
+ * so the index holds only the outermost function for each address.
+ */
+void
+DwarfUnit::indexFunctions(const DwarfEntries &list)
+{
+    std::vector<std::pair<uintmax_t, uintmax_t>> ranges;
+    for (auto entry : list) {
+        if (entry->type->tag == DW_TAG_subprogram) {
+            ranges.clear();
+            entry->addrRanges(ranges);
+            for (auto &range : ranges)
+                if (range.first < range.second)
+                    functions.emplace_back(range.first, range.second, entry);
+        } else if (entry->type->hasChildren) {
+            indexFunctions(entry->children());
+        }
+    }
+}
+
+const std::vector<DwarfFunctionRange> &
+DwarfUnit::functionIndex()
+{
+    if (!functionsIndexed) {
+        indexFunctions(entries);
+        std::stable_sort(functions.begin(), functions.end(),
+            [](const DwarfFunctionRange &l, const DwarfFunctionRange &r) { return l.start < r.start; });
+        for (size_t i = 1; i < functions.size(); ++i)
+            functions[i].maxEnd = std::max(functions[i].end, functions[i - 1].maxEnd);
+        functionsIndexed = true;
+    }
+    return functions;
+}
+
+const DwarfFunctionRange *
+DwarfUnit::functionForAddr(uintmax_t addr)
+{
+    functionIndex();
+
+    // Ranges should be disjoint, but if they overlap, prefer the first in
+    // DIE order.
+    auto it = std::upper_bound(functions.begin(), functions.end(), addr,
+        [](uintmax_t addr, const DwarfFunctionRange &range) { return addr < range.start; });
+    const DwarfFunctionRange *found = 0;
+    while (it != functions.begin()) {
+        --it;
+        if (it->maxEnd <= addr)
+            break;
+        if (it->end > addr && (found == 0 || it->function->offset < found->function->offset))
+            found = &*it;
+    }
+    return found;
+}
+
+/*
+ * Build the index of address ranges to units. We use .debug_aranges where
+ * present. Otherwise, we use the ranges of each unit's top-level entry,
+ * which needs no more than that entry's attributes. Units whose entries
+ * give no ranges might cover any address, so we keep them to try last.
+ */
+void
+DwarfInfo::indexUnitRanges()
+{
+    if (hasRanges()) {
+        for (auto &rs : ranges())
+            for (auto &r : rs.ranges)
+                if (r.length != 0)
+                    unitRanges.emplace_back(r.start, r.start + r.length,
+                            rs.debugInfoOffset, unitRanges.size());
+    } else {
+        std::vector<std::pair<uintmax_t, uintmax_t>> addrs;
+        for (auto &unit : getUnits()) {
+            if (unit->entries.empty())
+                continue;
+            addrs.clear();
+            (*unit->entries.begin())->addrRanges(addrs);
+            bool ranged = false;
+            for (auto &r : addrs) {
+                if (r.first < r.second) {
+                    unitRanges.emplace_back(r.first, r.second, unit->offset, unitRanges.size());
+                    ranged = true;
+                }
+            }
+            if (!ranged)
+                unrangedUnits.push_back(unit->offset);
+        }
+    }
+    std::sort(unitRanges.begin(), unitRanges.end(),
+        [](const DwarfUnitRange &l, const DwarfUnitRange &r) { return l.start < r.start; });
+    for (size_t i = 1; i < unitRanges.size(); ++i)
+        unitRanges[i].maxEnd = std::max(unitRanges[i].end, unitRanges[i - 1].maxEnd);
+    unitRangesIndexed = true;
+}
+
+std::list<std::shared_ptr<DwarfUnit>>
+DwarfInfo::unitsForAddr(uintmax_t addr)
+{
+    if (!unitRangesIndexed)
+        indexUnitRanges();
+
+    std::vector<const DwarfUnitRange *> found;
+    auto it = std::upper_bound(unitRanges.begin(), unitRanges.end(), addr,
+        [](uintmax_t addr, const DwarfUnitRange &range) { return addr < range.start; });
+    while (it != unitRanges.begin()) {
+        --it;
+        if (it->maxEnd <= addr)
+            break;
+        if (it->end > addr)
+            found.push_back(&*it);
+    }
+    std::sort(found.begin(), found.end(),
+        [](const DwarfUnitRange *l, const DwarfUnitRange *r) { return l->seq < r->seq; });
+
+    std::list<std::shared_ptr<DwarfUnit>> units;
+    for (auto range : found) {
+        auto unit = getUnit(range->unit);
+        if (unit && std::find(units.begin(), units.end(), unit) == units.end())
+            units.push_back(unit);
+    }
+    for (auto offset : unrangedUnits) {
+        auto unit = getUnit(offset);
+        if (unit)
+            units.push_back(unit);
+    }
+    return units;
+}
+
+/*
+ * Find the outermost function containing "addr", and, if "start" is
+ * non-null, the start of the range of the function that covers it.
+ */
+DwarfEntry *
+DwarfInfo::functionForAddr(uintmax_t addr, uintmax_t *start)
+{
+    if (index) {
+        Elf_Off unitOff, entryOff;
+        uintmax_t rangeStart;
+        if (!index->functionForAddr(addr, unitOff, entryOff, rangeStart))
+            return 0;
+        auto unit = getUnit(unitOff);
+        auto entry = unit ? unit->entryAt(entryOff) : 0;
+        if (entry && start)
+            *start = rangeStart;
+        return entry;
+    }
+    for (auto &unit : unitsForAddr(addr)) {
+        auto function = unit->functionForAddr(addr);
+        if (function) {
+            if (start)
+                *start = function->start;
+            return function->function;
+        }
+    }
+    return 0;
 }
 
 std::shared_ptr<DwarfInfo>
 DwarfInfo::getAltDwarf()
 {
+    std::lock_guard<std::recursive_mutex> guard(altLock);
     if (!altDwarf) {
         altDwarf = std::make_shared<DwarfInfo>(getAltImage());
     }
@@ -753,6 +1473,7 @@ DwarfInfo::getAltDwarf()
 std::shared_ptr<ElfObject>
 DwarfInfo::getAltImage()
 {
+    std::lock_guard<std::recursive_mutex> guard(altLock);
     if (!altImageLoaded) {
         altImageLoaded = true;
         auto section = elf->getSection(".gnu_debugaltlink", 0);
@@ -824,7 +1545,7 @@ DwarfFrameInfo::decodeAddress(DWARFReader &f, int encoding) const
     case 0:
         break;
     case DW_EH_PE_pcrel:
-        base += offset + dwarf->elf->getBase() + (*section)->sh_offset;
+        base += offset + (*section)->sh_addr;
         break;
     }
     return base;
@@ -851,7 +1572,7 @@ DWARFReader::getlength(size_t *addrLen)
 }
 
 Elf_Off
-DwarfFrameInfo::decodeCIEFDEHdr(DWARFReader &r, Elf_Addr &id, enum FIType type, DwarfCIE **ciep)
+DwarfFrameInfo::decodeCIEFDEHdr(DWARFReader &r, Elf_Addr &id, enum FIType type, DwarfCIE **ciep) const
 {
     size_t addrLen;
     Elf_Off length = r.getlength(&addrLen);
@@ -861,15 +1582,13 @@ DwarfFrameInfo::decodeCIEFDEHdr(DWARFReader &r, Elf_Addr &id, enum FIType type,
 
     Elf_Off idoff = r.getOffset();
     id = r.getuint(addrLen);
-    if (!isCIE(id) && ciep) {
-        auto ciei = cies.find(type == FI_EH_FRAME ? idoff - id : id);
-        *ciep = ciei != cies.end() ? &ciei->second : 0;
-    }
+    if (!isCIE(id) && ciep)
+        *ciep = cieAt(type == FI_EH_FRAME ? idoff - id : id);
     return idoff + length;
 }
 
 bool
-DwarfFrameInfo::isCIE(Elf_Addr cieid)
+DwarfFrameInfo::isCIE(Elf_Addr cieid) const
 {
     return (type == FI_DEBUG_FRAME && cieid == 0xffffffff) || (type == FI_EH_FRAME && cieid == 0);
 }
@@ -878,82 +1597,343 @@ DwarfFrameInfo::DwarfFrameInfo(DwarfInfo *info, std::shared_ptr<const ElfSection
     : dwarf(info)
     , section(section_)
     , type(type_)
+    , hdrTable(0)
+    , hdrCount(0)
+    , hdrBase(0)
+    , indexed(false)
 {
-    Elf_Addr cieid;
-    DWARFReader reader(section);
+    if (type != FI_EH_FRAME)
+        return;
+    /*
+     * Use the binary search table from .eh_frame_hdr if it's in the form
+     * the GNU linkers generate: 4-byte entries relative to the start of the
+     * header.
+     */
+    auto ehHdr = info->elf->getSection(".eh_frame_hdr", SHT_PROGBITS);
+    if (!ehHdr)
+        return;
+    DWARFReader r(ehHdr);
+    if (ehHdr->getSize() < 12)
+        return;
+    uint8_t version = r.getu8();
+    uint8_t ptrEnc = r.getu8();
+    uint8_t countEnc = r.getu8();
+    uint8_t tableEnc = r.getu8();
+    bool ptrIs4Bytes = (ptrEnc & 0xf) == DW_EH_PE_sdata4 || (ptrEnc & 0xf) == DW_EH_PE_udata4;
+    if (version != 1 || !ptrIs4Bytes || countEnc != DW_EH_PE_udata4
+            || tableEnc != (DW_EH_PE_datarel | DW_EH_PE_sdata4))
+        return;
+    r.skip(4); // eh_frame_ptr: we know where .eh_frame is already.
+    hdrCount = r.getu32();
+    hdrTable = r.getOffset();
+    if (hdrTable + hdrCount * 8 > ehHdr->getSize())
+        return;
+    hdrBase = (*ehHdr)->sh_addr;
+    hdr = ehHdr;
+}
 
-    // decode in 2 passes: first for CIE, then for FDE
-    off_t start = reader.getOffset();
-    off_t nextoff;
-    for (; !reader.empty();  reader.setOffset(nextoff)) {
-        size_t cieoff = reader.getOffset();
-        nextoff = decodeCIEFDEHdr(reader, cieid, type, 0);
-        if (nextoff == 0)
+DwarfCIE *
+DwarfFrameInfo::cieAt(Elf_Off off) const
+{
+    auto it = cies.find(off);
+    if (it != cies.end())
+        return &it->second;
+    DWARFReader r(section, off);
+    Elf_Addr id;
+    Elf_Off next = decodeCIEFDEHdr(r, id, type, 0);
+    if (next == 0 || !isCIE(id))
+        return 0;
+    return &cies.emplace(std::piecewise_construct,
+            std::forward_as_tuple(off),
+            std::forward_as_tuple(this, r, next)).first->second;
+}
+
+const DwarfFDE *
+DwarfFrameInfo::fdeAt(Elf_Off off) const
+{
+    auto it = fdes.find(off);
+    if (it != fdes.end())
+        return &it->second;
+    DWARFReader r(section, off);
+    Elf_Addr id;
+    DwarfCIE *cie = 0;
+    Elf_Off next = decodeCIEFDEHdr(r, id, type, &cie);
+    if (next == 0 || isCIE(id) || cie == 0)
+        return 0;
+    return &fdes.emplace(std::piecewise_construct,
+            std::forward_as_tuple(off),
+            std::forward_as_tuple(this, r, cie, next)).first->second;
+}
+
+/*
+ * Decode every CIE and FDE in the section.
+ */
+void
+DwarfFrameInfo::decodeAll() const
+{
+    DWARFReader reader(section);
+    Elf_Addr id;
+    while (!reader.empty()) {
+        Elf_Off off = reader.getOffset();
+        Elf_Off next = decodeCIEFDEHdr(reader, id, type, 0);
+        if (next == 0)
             break;
-        if (isCIE(cieid))
-            cies.emplace(std::piecewise_construct,
-                    std::forward_as_tuple(cieoff),
-                    std::forward_as_tuple(this, reader, nextoff));
-    }
-    reader.setOffset(start);
-    for (reader.setOffset(start); !reader.empty(); reader.setOffset(nextoff)) {
-        DwarfCIE *cie;
-        nextoff = decodeCIEFDEHdr(reader, cieid, type, &cie);
-        if (nextoff == 0)
+        if (isCIE(id))
+            cieAt(off);
+        else
+            fdeAt(off);
+        reader.setOffset(next);
+    }
+}
+
+/*
+ * XXX: addr can be just past last instruction in function, so the ranges we
+ * match are inclusive of their end. Where that means two FDEs match, we
+ * prefer the one that comes first in the section.
+ */
+static bool
+fdeCovers(const DwarfFDE *fde, Elf_Addr addr)
+{
+    return fde && fde->iloc <= addr && fde->iloc + fde->irange >= addr;
+}
+
+const DwarfFDE *
+DwarfFrameInfo::findFDEFromHdr(Elf_Addr addr) const
+{
+    DWARFReader r(hdr, hdrTable, hdrCount * 8);
+    // Find the number of entries with initial location <= addr.
+    size_t lo = 0, hi = hdrCount;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        r.setOffset(hdrTable + mid * 8);
+        if (Elf_Addr(hdrBase + r.getint(4)) <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    Elf_Addr ehBase = (*section)->sh_addr;
+    auto offsetOf = [&](size_t idx) -> Elf_Off {
+        r.setOffset(hdrTable + idx * 8 + 4);
+        Elf_Addr fdeAddr = hdrBase + r.getint(4);
+        if (fdeAddr < ehBase || fdeAddr - ehBase >= section->getSize())
+            throw Exception() << "FDE address " << fdeAddr << " outside "
+                << section->io->describe();
+        return fdeAddr - ehBase;
+    };
+
+    const DwarfFDE *found = 0;
+    Elf_Off foundOff = 0;
+    if (lo >= 1) {
+        foundOff = offsetOf(lo - 1);
+        found = fdeAt(foundOff);
+        if (!fdeCovers(found, addr))
+            found = 0;
+    }
+    if (lo >= 2 && (found == 0 || found->iloc == addr)) {
+        Elf_Off prevOff = offsetOf(lo - 2);
+        auto prev = fdeAt(prevOff);
+        if (fdeCovers(prev, addr) && (found == 0 || prevOff < foundOff))
+            found = prev;
+    }
+    return found;
+}
+
+const std::vector<DwarfFDERange> &
+DwarfFrameInfo::addrIndex() const
+{
+    if (!indexed) {
+        indexed = true;
+        try {
+            decodeAll();
+        }
+        catch (const Exception &ex) {
+            if (verbose)
+                *debug << "can't decode all of " << section->io->describe()
+                    << ": " << ex.what() << "\n";
+        }
+        for (auto &fde : fdes)
+            fdeIndex.emplace_back(fde.second.iloc, fde.second.iloc + fde.second.irange,
+                    fde.first, &fde.second);
+        std::sort(fdeIndex.begin(), fdeIndex.end(),
+            [](const DwarfFDERange &l, const DwarfFDERange &r) { return l.start < r.start; });
+        for (size_t i = 1; i < fdeIndex.size(); ++i)
+            fdeIndex[i].maxEnd = std::max(fdeIndex[i].end, fdeIndex[i - 1].maxEnd);
+    }
+    return fdeIndex;
+}
+
+const DwarfFDE *
+DwarfFrameInfo::findFDEFromIndex(Elf_Addr addr) const
+{
+    if (dwarf->index && dwarf->index->hasFDEs(type)) {
+        Elf_Off offset;
+        return dwarf->index->fdeForAddr(type, addr, offset) ? fdeAt(offset) : 0;
+    }
+
+    addrIndex();
+    auto it = std::upper_bound(fdeIndex.begin(), fdeIndex.end(), addr,
+        [](Elf_Addr addr, const DwarfFDERange &range) { return addr < range.start; });
+    const DwarfFDERange *found = 0;
+    while (it != fdeIndex.begin()) {
+        --it;
+        if (it->maxEnd < addr)
             break;
-        if (!isCIE(cieid))
-            fdeList.push_back(DwarfFDE(this, reader, cie, nextoff));
+        if (it->end >= addr && (found == 0 || it->offset < found->offset))
+            found = &*it;
     }
+    return found ? found->fde : 0;
 }
 
 const DwarfFDE *
 DwarfFrameInfo::findFDE(Elf_Addr addr) const
 {
-    for (auto fde = fdeList.begin(); fde != fdeList.end(); ++fde)
-        // XXX: addr can be just past last instruction in function
-        if (fde->iloc <= addr && fde->iloc + fde->irange >= addr)
-            return &(*fde);
-    return 0;
+    if (hdr) {
+        try {
+            return findFDEFromHdr(addr);
+        }
+        catch (const Exception &ex) {
+            if (verbose)
+                *debug << "can't use .eh_frame_hdr for " << section->io->describe()
+                    << ": " << ex.what() << "\n";
+            hdr = 0;
+        }
+    }
+    return findFDEFromIndex(addr);
 }
 
 std::vector<std::pair<const DwarfFileEntry *, int>>
 DwarfInfo::sourceFromAddr(uintmax_t addr)
 {
     std::vector<std::pair<const DwarfFileEntry *, int>> info;
-    std::list<std::shared_ptr<DwarfUnit>> units;
+    if (index) {
+        index->sourceFromAddr(addr, info);
+        return info;
+    }
+    std::vector<const DwarfLineRow *> rows;
+    for (auto unit : unitsForAddr(addr)) {
+        auto &lines = unit->getLines();
+        rows.clear();
+        lines.rowsForAddr(addr, rows);
+        for (auto row : rows)
+            info.push_back(std::make_pair(&lines.files[row->file], row->line));
+    }
 
-    if (hasRanges()) {
-        auto &rangelist = ranges();
-        for (auto &rs : rangelist) {
-            for (auto r = rs.ranges.begin(); r != rs.ranges.end(); ++r) {
-                if (r->start <= addr && r->start + r->length > addr) {
-                    units.push_back(getUnit(rs.debugInfoOffset));
-                    break;
+    return info;
+}
 
-                }
+static void
+decodeExpression(DWARFReader &r, DwarfExpression &ops)
+{
+    while (!r.empty()) {
+        auto op = DwarfExpressionOp(r.getu8());
+        switch (op) {
+            case DW_OP_consts:
+            case DW_OP_fbreg:
+            case DW_OP_breg0: case DW_OP_breg1: case DW_OP_breg2: case DW_OP_breg3:
+            case DW_OP_breg4: case DW_OP_breg5: case DW_OP_breg6: case DW_OP_breg7:
+            case DW_OP_breg8: case DW_OP_breg9: case DW_OP_breg10: case DW_OP_breg11:
+            case DW_OP_breg12: case DW_OP_breg13: case DW_OP_breg14: case DW_OP_breg15:
+            case DW_OP_breg16: case DW_OP_breg17: case DW_OP_breg18: case DW_OP_breg19:
+            case DW_OP_breg20: case DW_OP_breg21: case DW_OP_breg22: case DW_OP_breg23:
+            case DW_OP_breg24: case DW_OP_breg25: case DW_OP_breg26: case DW_OP_breg27:
+            case DW_OP_breg28: case DW_OP_breg29: case DW_OP_breg30: case DW_OP_breg31:
+                ops.emplace_back(op, r.getsleb128());
+                break;
+
+            case DW_OP_constu:
+            case DW_OP_regx:
+                ops.emplace_back(op, r.getuleb128());
+                break;
+
+            case DW_OP_const2s:
+                ops.emplace_back(op, int16_t(r.getu16()));
+                break;
+
+            case DW_OP_const4u:
+                ops.emplace_back(op, r.getu32());
+                break;
+
+            case DW_OP_const4s:
+                ops.emplace_back(op, int32_t(r.getu32()));
+                break;
+
+            case DW_OP_addr:
+                ops.emplace_back(op, r.getuint(r.addrLen));
+                break;
+
+            case DW_OP_entry_value: case DW_OP_GNU_entry_value: {
+                auto len = r.getuleb128();
+                DWARFReader sub(r, r.getOffset(), len);
+                auto start = ops.size();
+                ops.emplace_back(op);
+                decodeExpression(sub, ops);
+                ops[start].arg = ops.size() - start - 1;
+                r.skip(len);
+                break;
             }
+
+            case DW_OP_deref:
+            case DW_OP_minus: case DW_OP_plus:
+            case DW_OP_and: case DW_OP_or:
+            case DW_OP_le: case DW_OP_ge: case DW_OP_eq:
+            case DW_OP_lt: case DW_OP_gt: case DW_OP_ne:
+            case DW_OP_shl: case DW_OP_shr:
+            case DW_OP_call_frame_cfa:
+            case DW_OP_stack_value:
+            case DW_OP_lit0: case DW_OP_lit1: case DW_OP_lit2: case DW_OP_lit3: case DW_OP_lit4:
+            case DW_OP_lit5: case DW_OP_lit6: case DW_OP_lit7: case DW_OP_lit8: case DW_OP_lit9:
+            case DW_OP_lit10: case DW_OP_lit11: case DW_OP_lit12: case DW_OP_lit13: case DW_OP_lit14:
+            case DW_OP_lit15: case DW_OP_lit16: case DW_OP_lit17: case DW_OP_lit18: case DW_OP_lit19:
+            case DW_OP_lit20: case DW_OP_lit21: case DW_OP_lit22: case DW_OP_lit23: case DW_OP_lit24:
+            case DW_OP_lit25: case DW_OP_lit26: case DW_OP_lit27: case DW_OP_lit28: case DW_OP_lit29:
+            case DW_OP_lit30: case DW_OP_lit31:
+            case DW_OP_reg0: case DW_OP_reg1: case DW_OP_reg2: case DW_OP_reg3:
+            case DW_OP_reg4: case DW_OP_reg5: case DW_OP_reg6: case DW_OP_reg7:
+            case DW_OP_reg8: case DW_OP_reg9: case DW_OP_reg10: case DW_OP_reg11:
+            case DW_OP_reg12: case DW_OP_reg13: case DW_OP_reg14: case DW_OP_reg15:
+            case DW_OP_reg16: case DW_OP_reg17: case DW_OP_reg18: case DW_OP_reg19:
+            case DW_OP_reg20: case DW_OP_reg21: case DW_OP_reg22: case DW_OP_reg23:
+            case DW_OP_reg24: case DW_OP_reg25: case DW_OP_reg26: case DW_OP_reg27:
+            case DW_OP_reg28: case DW_OP_reg29: case DW_OP_reg30: case DW_OP_reg31:
+                ops.emplace_back(op);
+                break;
+
+            default:
+                // We don't know how long this one's operands are, so can't go on.
+                ops.emplace_back(op);
+                return;
         }
-    } else {
-        units = getUnits();
     }
+}
 
-    for (auto unit : units) {
-        for (auto i = unit->lines.matrix.begin(); i != unit->lines.matrix.end(); ++i) {
-            if (i->end_sequence)
-                continue;
-            auto next = i+1;
-            if (i->addr <= addr && next->addr > addr)
-                info.push_back(std::make_pair(i->file, i->line));
+const DwarfExpression &
+DwarfInfo::expression(const std::shared_ptr<const ElfSection> &sec, Elf_Off off, Elf_Off len) const
+{
+    static auto &decoded = Stats::counter("dwarf expressions decoded");
+    std::lock_guard<std::mutex> guard(expressionsLock);
+    auto inserted = expressions.insert(std::make_pair(std::make_pair(sec.get(), off), DwarfExpression()));
+    auto &ops = inserted.first->second;
+    if (inserted.second) {
+        Stats::add(decoded);
+        try {
+            DWARFReader r(sec, off, len);
+            decodeExpression(r, ops);
+        }
+        catch (...) {
+            expressions.erase(inserted.first);
+            throw;
         }
     }
-
-    return info;
+    return ops;
 }
 
 DwarfCallFrame::DwarfCallFrame()
 {
     cfaReg = 0;
     cfaValue.type = UNDEF;
+    for (auto &reg : registers)
+        reg.type = UNDEF;
 #define REGMAP(number, field) registers[number].type = SAME;
 #include <libpstack/dwarf/archreg.h>
 #undef REGMAP
@@ -963,8 +1943,14 @@ DwarfCallFrame::DwarfCallFrame()
 }
 
 
+/*
+ * Run the CFA instructions until we pass "wantAddr", and return the
+ * resulting rules. If "rows" is not null, the rules in effect at the start
+ * of each row are appended to it as we go.
+ */
 DwarfCallFrame
-DwarfCIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr)
+DwarfCIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr,
+        std::vector<DwarfCallFrameRow> *rows)
 {
     std::stack<DwarfCallFrame> stack;
     DwarfCallFrame frame;
@@ -979,25 +1965,30 @@ DwarfCIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr)
         dframe = execInsns(r2, 0, 0);
         frame = dframe;
     }
+    auto newRow = [&](uintmax_t next) {
+        if (rows)
+            rows->emplace_back(addr, frame);
+        addr = next;
+    };
     while (addr <= wantAddr) {
         if (r.empty())
-            return frame;
+            break;
         uint8_t rawOp = r.getu8();
         reg = rawOp &0x3f;
         DwarfCFAInstruction op = (DwarfCFAInstruction)(rawOp & ~0x3f);
         switch (op) {
         case DW_CFA_advance_loc:
-            addr += reg * codeAlign;
+            newRow(addr + reg * codeAlign);
             break;
 
         case DW_CFA_offset:
             offset = r.getuleb128();
-            frame.registers[reg].type = OFFSET;
-            frame.registers[reg].u.offset = offset * dataAlign;
+            frame.rule(reg).type = OFFSET;
+            frame.rule(reg).u.offset = offset * dataAlign;
             break;
 
         case DW_CFA_restore: {
-            frame.registers[reg] = dframe.registers[reg];
+            frame.rule(reg) = dframe.rule(reg);
             break;
         }
 
@@ -1008,48 +1999,48 @@ DwarfCIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr)
                 break;
 
             case DW_CFA_set_loc:
-                addr = r.getuint(r.addrLen);
+                newRow(r.getuint(r.addrLen));
                 break;
 
             case DW_CFA_advance_loc1:
-                addr += r.getu8() * codeAlign;
+                newRow(addr + r.getu8() * codeAlign);
                 break;
 
             case DW_CFA_advance_loc2:
-                addr += r.getu16() * codeAlign;
+                newRow(addr + r.getu16() * codeAlign);
                 break;
 
             case DW_CFA_advance_loc4:
-                addr += r.getu32() * codeAlign;
+                newRow(addr + r.getu32() * codeAlign);
                 break;
 
             case DW_CFA_offset_extended:
                 reg = r.getuleb128();
                 offset = r.getuleb128();
-                frame.registers[reg].type = OFFSET;
-                frame.registers[reg].u.offset = offset * dataAlign;
+                frame.rule(reg).type = OFFSET;
+                frame.rule(reg).u.offset = offset * dataAlign;
                 break;
 
             case DW_CFA_restore_extended:
                 reg = r.getuleb128();
-                frame.registers[reg] = dframe.registers[reg];
+                frame.rule(reg) = dframe.rule(reg);
                 break;
 
             case DW_CFA_undefined:
                 reg = r.getuleb128();
-                frame.registers[reg].type = UNDEF;
+                frame.rule(reg).type = UNDEF;
                 break;
 
             case DW_CFA_same_value:
                 reg = r.getuleb128();
-                frame.registers[reg].type = SAME;
+                frame.rule(reg).type = SAME;
                 break;
 
             case DW_CFA_register:
                 reg = r.getuleb128();
                 reg2 = r.getuleb128();
-                frame.registers[reg].type = REG;
-                frame.registers[reg].u.reg = reg2;
+                frame.rule(reg).type = REG;
+                frame.rule(reg).u.reg = reg2;
                 break;
 
             case DW_CFA_remember_state:
@@ -1090,7 +2081,7 @@ DwarfCIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr)
 
             case DW_CFA_val_expression: {
                 reg = r.getuleb128();
-                auto &unwind = frame.registers[reg];
+                auto &unwind = frame.rule(reg);
                 unwind.type = VAL_EXPRESSION;
                 unwind.u.expression.length = r.getuleb128();
                 unwind.u.expression.offset = r.getOffset();
@@ -1101,7 +2092,7 @@ DwarfCIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr)
             case DW_CFA_expression: {
                 reg = r.getuleb128();
                 offset = r.getuleb128();
-                auto &unwind = frame.registers[reg];
+                auto &unwind = frame.rule(reg);
                 unwind.type = EXPRESSION;
                 unwind.u.expression.offset = r.getOffset();
                 unwind.u.expression.length = offset;
@@ -1137,12 +2128,33 @@ DwarfCIE::execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr)
             break;
         }
     }
+    if (rows)
+        rows->emplace_back(addr, frame);
     return frame;
 }
 
-DwarfFDE::DwarfFDE(DwarfFrameInfo *fi, DWARFReader &reader, DwarfCIE *cie_, Elf_Off end_)
+const DwarfCallFrame &
+DwarfFDE::callFrame(uintmax_t addr) const
+{
+    static auto &lookups = Stats::counter("dwarf call frame lookups");
+    static auto &decodes = Stats::counter("dwarf call frame row decodes");
+    Stats::add(lookups);
+    if (rows.empty()) {
+        Stats::add(decodes);
+        DWARFReader r(cie->frameInfo->section, instructions, end - instructions);
+        cie->execInsns(r, iloc, std::numeric_limits<uintmax_t>::max(), &rows);
+    }
+    // Find the last row starting at or before addr.
+    auto row = std::upper_bound(rows.begin(), rows.end(), addr,
+        [](uintmax_t addr, const DwarfCallFrameRow &row) { return addr < row.start; });
+    return row == rows.begin() ? row->frame : (row - 1)->frame;
+}
+
+DwarfFDE::DwarfFDE(const DwarfFrameInfo *fi, DWARFReader &reader, DwarfCIE *cie_, Elf_Off end_)
     : cie(cie_)
 {
+    static auto &decoded = Stats::counter("dwarf FDEs decoded");
+    Stats::add(decoded);
     iloc = fi->decodeAddress(reader, cie->addressEncoding);
     irange = fi->decodeAddress(reader, cie->addressEncoding & 0xf);
     if (cie->augmentation.size() != 0 && cie->augmentation[0] == 'z') {
@@ -1237,32 +2249,36 @@ DwarfEntry::referencedEntry(DwarfAttrName name) const
         case DW_FORM_ref8:
             off = attr->value.ref + unit->offset;
             break;
-        case DW_FORM_GNU_ref_alt:
-            return 0; // XXX: deal with this.
+        case DW_FORM_GNU_ref_alt: {
+            // A reference into the .debug_info of the alt image.
+            try {
+                auto u = unit->dwarf->getAltDwarf()->unitContaining(attr->value.ref);
+                return u ? u->entryAt(attr->value.ref) : 0;
+            }
+            catch (const Exception &ex) {
+                if (verbose)
+                    *debug << "can't follow reference to alt image: " << ex.what() << "\n";
+                return 0;
+            }
+        }
         default:
             abort();
             break;
     }
-    const auto &entry = unit->allEntries.find(off);
-    if (entry != unit->allEntries.end())
-        return entry->second;
-    // Lets look in the parent
-    for (auto u : unit->dwarf->getUnits()) {
-        if (u.get() == unit)
-            continue;
-        const auto &entry = u->allEntries.find(off);
-        if (entry != u->allEntries.end())
-            return entry->second;
-    }
-    return 0;
+    if (off >= unit->offset && Elf_Off(off) < unit->end)
+        return unit->entryAt(off);
+    // It's in another unit.
+    auto u = unit->dwarf->unitContaining(off);
+    return u ? u->entryAt(off) : 0;
 }
 
 const DwarfAttribute *
 DwarfEntry::attrForName(DwarfAttrName name) const
 {
-    auto it = attributes.find(name);
-    if (it != attributes.end())
-        return &it->second;
+    auto attributes = this->attributes();
+    for (size_t i = 0; i < type->specs.size(); ++i)
+        if (type->specs[i].name == name)
+            return &attributes[i];
     if (name != DW_AT_abstract_origin) {
         auto ao = referencedEntry(DW_AT_abstract_origin);
         if (ao != 0)
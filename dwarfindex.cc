@@ -0,0 +1,371 @@
+#include <libpstack/dwarf.h>
+#include <libpstack/elf.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::string dwarfIndexDirectory;
+
+static const char indexMagic[8] = "PSTKIDX";
+static const uint32_t indexVersion = 2;
+static const char *symbolTables[2] = { ".symtab", ".dynsym" };
+
+/*
+ * Sort a table of ranges by start address, and fill in their "maxEnd"
+ * fields.
+ */
+template <typename Range> static void
+sortRanges(std::vector<Range> &ranges)
+{
+    std::stable_sort(ranges.begin(), ranges.end(),
+        [](const Range &l, const Range &r) { return l.start < r.start; });
+    for (size_t i = 0; i < ranges.size(); ++i)
+        ranges[i].maxEnd = i == 0 ? ranges[i].end : std::max(ranges[i].end, ranges[i - 1].maxEnd);
+}
+
+/*
+ * Call "visit" for each range in a sorted table that contains "addr".
+ */
+template <typename Range, typename Visit> static void
+visitRanges(const Range *table, size_t count, uintmax_t addr, Visit visit)
+{
+    auto it = std::upper_bound(table, table + count, addr,
+        [](uintmax_t addr, const Range &range) { return addr < range.start; });
+    while (it != table) {
+        --it;
+        if (it->maxEnd <= addr)
+            break;
+        if (it->end > addr)
+            visit(*it);
+    }
+}
+
+/*
+ * The index is keyed by build ID. A stripped object and its separate debug
+ * image share a build ID, so we add the section header offset to tell them
+ * apart.
+ */
+static std::string
+indexPath(const DwarfInfo &dwarf)
+{
+    for (auto note : dwarf.elf->notes) {
+        if (note.name() == "GNU" && note.type() == GNU_BUILD_ID) {
+            std::ostringstream path;
+            path << dwarfIndexDirectory << "/" << std::hex << std::setfill('0');
+            auto data = note.data();
+            for (size_t i = 0; i < note.size(); ++i)
+                path << std::setw(2) << int(data[i]);
+            path << "-" << dwarf.elf->getElfHeader().e_shoff << ".idx";
+            return path.str();
+        }
+    }
+    return "";
+}
+
+template <typename T> static void
+writeTable(std::ostream &os, const std::vector<T> &table)
+{
+    os.write((const char *)table.data(), table.size() * sizeof (T));
+}
+
+void
+writeDwarfIndex(DwarfInfo &dwarf, const std::string &path)
+{
+    DwarfIndexHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, indexMagic, sizeof header.magic);
+    header.version = indexVersion;
+
+    // If there's a .eh_frame_hdr, it's as good as anything we'd store.
+    std::vector<DwarfIndexFDE> fdes[2];
+    const DwarfFrameInfo *frames[2];
+    frames[FI_DEBUG_FRAME] = dwarf.getDebugFrame();
+    frames[FI_EH_FRAME] = dwarf.getEhFrame();
+    for (int type = 0; type < 2; ++type) {
+        if (frames[type] == 0 || frames[type]->hasHdr())
+            continue;
+        header.fdeTables |= 1 << type;
+        for (auto &range : frames[type]->addrIndex())
+            fdes[type].push_back({ range.start, range.end + 1, 0, range.offset });
+        sortRanges(fdes[type]);
+        header.fdeCount[type] = fdes[type].size();
+    }
+
+    std::vector<DwarfIndexFunction> functions;
+    std::vector<DwarfIndexLine> lines;
+    std::vector<DwarfIndexFile> files;
+    std::vector<char> strings;
+    std::map<std::string, uint32_t> stringOffsets;
+    std::map<const DwarfFileEntry *, uint32_t> fileIndex;
+
+    auto intern = [&](const std::string &s) -> uint32_t {
+        auto it = stringOffsets.find(s);
+        if (it != stringOffsets.end())
+            return it->second;
+        uint32_t off = strings.size();
+        strings.insert(strings.end(), s.c_str(), s.c_str() + s.size() + 1);
+        stringOffsets[s] = off;
+        return off;
+    };
+
+    uint64_t unitSeq = 0;
+    for (auto &unit : dwarf.getUnits()) {
+        for (auto &range : unit->functionIndex())
+            functions.push_back({ range.start, range.end, 0,
+                    uint64_t(unit->offset), uint64_t(range.function->offset) });
+        auto &unitLines = unit->getLines();
+        for (auto &range : unitLines.addrIndex()) {
+            auto &row = unitLines.matrix[range.row];
+            auto rowFile = &unitLines.files[row.file];
+            auto file = fileIndex.find(rowFile);
+            if (file == fileIndex.end()) {
+                files.push_back({ intern(rowFile->directory), intern(rowFile->name) });
+                file = fileIndex.insert(std::make_pair(rowFile, uint32_t(files.size() - 1))).first;
+            }
+            lines.push_back({ range.start, range.end, 0, unitSeq << 32 | range.row,
+                    file->second, row.line });
+        }
+        ++unitSeq;
+    }
+    sortRanges(functions);
+    sortRanges(lines);
+    header.functionCount = functions.size();
+    header.lineCount = lines.size();
+    header.fileCount = files.size();
+    header.stringsSize = strings.size();
+
+    // The symbol tables' indexes are already sorted, so store them as is.
+    std::vector<DwarfIndexSymbol> symbols[2][2];
+    for (int table = 0; table < 2; ++table) {
+        auto index = dwarf.elf->getSymbolIndex(symbolTables[table], STT_FUNC);
+        if (index == 0)
+            continue;
+        int kind = 0;
+        for (auto ranges : { &index->sized, &index->sizeless }) {
+            for (auto &range : *ranges)
+                symbols[table][kind].push_back({ range.start, range.end, range.maxEnd, range.index });
+            header.symbolCount[table][kind] = symbols[table][kind].size();
+            ++kind;
+        }
+    }
+
+    // Write to a temporary file, and rename it into place, so readers never
+    // see a partial index.
+    std::ostringstream tmpName;
+    tmpName << path << ".tmp." << getpid();
+    std::string tmp = tmpName.str();
+    {
+        std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+        if (!os)
+            throw Exception() << "cannot create " << tmp << ": " << strerror(errno);
+        os.write((const char *)&header, sizeof header);
+        writeTable(os, fdes[FI_DEBUG_FRAME]);
+        writeTable(os, fdes[FI_EH_FRAME]);
+        writeTable(os, functions);
+        writeTable(os, lines);
+        for (auto &table : symbols)
+            for (auto &kind : table)
+                writeTable(os, kind);
+        writeTable(os, files);
+        writeTable(os, strings);
+        os.close();
+        if (!os) {
+            unlink(tmp.c_str());
+            throw Exception() << "cannot write " << tmp;
+        }
+    }
+    if (rename(tmp.c_str(), path.c_str()) != 0) {
+        int err = errno;
+        unlink(tmp.c_str());
+        throw Exception() << "cannot rename " << tmp << " to " << path << ": " << strerror(err);
+    }
+}
+
+static std::unique_ptr<DwarfIndex>
+mapIndex(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        return std::unique_ptr<DwarfIndex>();
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || size_t(st.st_size) < sizeof (DwarfIndexHeader)) {
+        close(fd);
+        throw Exception() << path << " is not an index";
+    }
+    std::shared_ptr<Reader> reader;
+    try {
+        reader = std::make_shared<MmapReader>(path, fd, st.st_size);
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return make_unique<DwarfIndex>(reader, st.st_size);
+}
+
+/*
+ * Open the index for this object, building it first if there isn't a
+ * usable one already. Returns null if the object has no build ID, or we
+ * can't build the index.
+ */
+std::unique_ptr<DwarfIndex>
+loadDwarfIndex(DwarfInfo &dwarf)
+{
+    std::string path = indexPath(dwarf);
+    if (path == "")
+        return std::unique_ptr<DwarfIndex>();
+    try {
+        auto index = mapIndex(path);
+        if (index)
+            return index;
+    }
+    catch (const Exception &ex) {
+        if (verbose)
+            *debug << "rebuilding index " << path << ": " << ex.what() << "\n";
+    }
+    try {
+        writeDwarfIndex(dwarf, path);
+        auto index = mapIndex(path);
+        if (index)
+            return index;
+    }
+    catch (const Exception &ex) {
+        std::clog << "can't build index for " << dwarf.elf->getio()->describe()
+            << ": " << ex.what() << "\n";
+    }
+    return std::unique_ptr<DwarfIndex>();
+}
+
+DwarfIndex::DwarfIndex(std::shared_ptr<Reader> io_, size_t size)
+    : io(io_)
+{
+    std::string name = io->describe();
+    const char *base = io->view(0, size);
+    if (base == 0)
+        throw Exception() << name << " is not mapped";
+
+    header = (const DwarfIndexHeader *)base;
+    if (memcmp(header->magic, indexMagic, sizeof header->magic) != 0)
+        throw Exception() << name << " is not an index";
+    if (header->version != indexVersion)
+        throw Exception() << name << " has version " << header->version
+            << ", not " << indexVersion;
+
+    uint64_t expected = sizeof *header
+        + (header->fdeCount[0] + header->fdeCount[1]) * sizeof (DwarfIndexFDE)
+        + header->functionCount * sizeof (DwarfIndexFunction)
+        + header->lineCount * sizeof (DwarfIndexLine)
+        + header->fileCount * sizeof (DwarfIndexFile)
+        + header->stringsSize;
+    for (auto &table : header->symbolCount)
+        for (auto count : table)
+            expected += count * sizeof (DwarfIndexSymbol);
+    if (expected != size)
+        throw Exception() << name << " is " << size << " bytes, expected " << expected;
+
+    const char *p = base + sizeof *header;
+    fdes[FI_DEBUG_FRAME] = (const DwarfIndexFDE *)p;
+    p += header->fdeCount[FI_DEBUG_FRAME] * sizeof (DwarfIndexFDE);
+    fdes[FI_EH_FRAME] = (const DwarfIndexFDE *)p;
+    p += header->fdeCount[FI_EH_FRAME] * sizeof (DwarfIndexFDE);
+    functions = (const DwarfIndexFunction *)p;
+    p += header->functionCount * sizeof (DwarfIndexFunction);
+    lines = (const DwarfIndexLine *)p;
+    p += header->lineCount * sizeof (DwarfIndexLine);
+    for (int table = 0; table < 2; ++table) {
+        for (int kind = 0; kind < 2; ++kind) {
+            symbols[table][kind] = (const DwarfIndexSymbol *)p;
+            p += header->symbolCount[table][kind] * sizeof (DwarfIndexSymbol);
+        }
+    }
+    auto fileTable = (const DwarfIndexFile *)p;
+    p += header->fileCount * sizeof (DwarfIndexFile);
+    const char *strings = p;
+
+    if (header->stringsSize != 0 && strings[header->stringsSize - 1] != 0)
+        throw Exception() << name << " has an unterminated string table";
+    files.reserve(header->fileCount);
+    for (size_t i = 0; i < header->fileCount; ++i) {
+        if (fileTable[i].directory >= header->stringsSize || fileTable[i].name >= header->stringsSize)
+            throw Exception() << name << " has a bad file entry";
+        files.emplace_back(strings + fileTable[i].name, strings + fileTable[i].directory, 0, 0);
+    }
+}
+
+bool
+DwarfIndex::fdeForAddr(FIType type, uintmax_t addr, Elf_Off &offset) const
+{
+    // Prefer the earliest FDE in the section, as DwarfFrameInfo does.
+    const DwarfIndexFDE *found = 0;
+    visitRanges(fdes[type], header->fdeCount[type], addr, [&](const DwarfIndexFDE &fde) {
+        if (found == 0 || fde.offset < found->offset)
+            found = &fde;
+    });
+    if (found)
+        offset = found->offset;
+    return found != 0;
+}
+
+bool
+DwarfIndex::functionForAddr(uintmax_t addr, Elf_Off &unit, Elf_Off &entry, uintmax_t &start) const
+{
+    // Ranges should be disjoint, but if they overlap, prefer the first in
+    // DIE order.
+    const DwarfIndexFunction *found = 0;
+    visitRanges(functions, header->functionCount, addr, [&](const DwarfIndexFunction &function) {
+        if (found == 0 || function.entry < found->entry)
+            found = &function;
+    });
+    if (found) {
+        unit = found->unit;
+        entry = found->entry;
+        start = found->start;
+    }
+    return found != 0;
+}
+
+void
+DwarfIndex::sourceFromAddr(uintmax_t addr, std::vector<std::pair<const DwarfFileEntry *, int>> &info) const
+{
+    std::vector<const DwarfIndexLine *> rows;
+    visitRanges(lines, header->lineCount, addr, [&](const DwarfIndexLine &line) {
+        if (line.file < files.size())
+            rows.push_back(&line);
+    });
+    std::sort(rows.begin(), rows.end(),
+        [](const DwarfIndexLine *l, const DwarfIndexLine *r) { return l->order < r->order; });
+    for (auto row : rows)
+        info.push_back(std::make_pair(&files[row->file], int(row->line)));
+}
+
+/*
+ * Give the object the symbol table indexes we stored, so findSymbolByAddress
+ * needn't read and sort the tables again.
+ */
+void
+DwarfIndex::restoreSymbols(ElfObject &elf) const
+{
+    for (int table = 0; table < 2; ++table) {
+        ElfSymbolIndex index;
+        int kind = 0;
+        for (auto ranges : { &index.sized, &index.sizeless }) {
+            auto symbol = symbols[table][kind];
+            auto count = header->symbolCount[table][kind];
+            ranges->reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                ranges->emplace_back(symbol[i].start, symbol[i].end, symbol[i].index);
+                ranges->back().maxEnd = symbol[i].maxEnd;
+            }
+            ++kind;
+        }
+        elf.setSymbolIndex(symbolTables[table], STT_FUNC, std::move(index));
+    }
+}
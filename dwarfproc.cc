@@ -1,4 +1,3 @@
-#include <stack>
 #include <limits>
 
 #include <libpstack/proc.h>
@@ -78,10 +77,8 @@ DwarfExpressionStack::eval(const Process &proc, const DwarfAttribute *attr, cons
                 if (start == 0 && end == 0)
                     return 0;
                 auto len = r.getuint(2);
-                if (unitIp >= start && unitIp < end) {
-                    DWARFReader exr(r, r.getOffset(), Elf_Word(len));
-                    return eval(proc, exr, frame);
-                }
+                if (unitIp >= start && unitIp < end)
+                    return eval(proc, dwarf->expression(sec, r.getOffset(), len), frame);
                 r.skip(len);
             }
             abort();
@@ -91,8 +88,7 @@ DwarfExpressionStack::eval(const Process &proc, const DwarfAttribute *attr, cons
         case DW_FORM_block:
         case DW_FORM_exprloc: {
             auto &block = attr->value.block;
-            DWARFReader r(dwarf->info, block.offset, block.length);
-            return eval(proc, r, frame);
+            return eval(proc, dwarf->expression(dwarf->info, block.offset, block.length), frame);
         }
         default:
             abort();
@@ -100,44 +96,34 @@ DwarfExpressionStack::eval(const Process &proc, const DwarfAttribute *attr, cons
 }
 
 Elf_Addr
-DwarfExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame *frame)
+DwarfExpressionStack::eval(const Process &proc, const DwarfExpression &ops, const StackFrame *frame)
+{
+    return eval(proc, ops.data(), ops.data() + ops.size(), frame);
+}
+
+Elf_Addr
+DwarfExpressionStack::eval(const Process &proc, const DwarfOp *begin, const DwarfOp *end, const StackFrame *frame)
 {
     isReg = false;
-    while (!r.empty()) {
-        auto op = DwarfExpressionOp(r.getu8());
+    for (auto i = begin; i != end; ++i) {
+        auto op = i->op;
         switch (op) {
             case DW_OP_deref: {
                 intmax_t addr = poptop();
                 Elf_Addr value;
-                proc.io->readObj(addr, &value);
+                (memory ? memory : proc.io.get())->readObj(addr, &value);
                 push((intmax_t)(intptr_t)value);
                 break;
             }
 
-            case DW_OP_consts: {
-                push(r.getsleb128());
+            case DW_OP_consts:
+            case DW_OP_constu:
+            case DW_OP_const2s:
+            case DW_OP_const4u:
+            case DW_OP_const4s:
+            case DW_OP_addr:
+                push(i->arg);
                 break;
-            }
-
-            case DW_OP_constu: {
-                push(r.getuleb128());
-                break;
-            }
-
-            case DW_OP_const2s: {
-                push(int16_t(r.getu16()));
-                break;
-            }
-
-            case DW_OP_const4u: {
-                push(r.getu32());
-                break;
-            }
-
-            case DW_OP_const4s: {
-                push(int32_t(r.getu32()));
-                break;
-            }
 
             case DW_OP_minus: {
                 Elf_Addr tos = poptop();
@@ -161,8 +147,7 @@ DwarfExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame
             case DW_OP_breg20: case DW_OP_breg21: case DW_OP_breg22: case DW_OP_breg23:
             case DW_OP_breg24: case DW_OP_breg25: case DW_OP_breg26: case DW_OP_breg27:
             case DW_OP_breg28: case DW_OP_breg29: case DW_OP_breg30: case DW_OP_breg31: {
-                Elf_Off offset = r.getsleb128();
-                push(frame->getReg(op - DW_OP_breg0) + offset);
+                push(frame->getReg(op - DW_OP_breg0) + i->arg);
                 break;
             }
 
@@ -245,17 +230,17 @@ DwarfExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame
                 push(lhs >> rhs);
                 break;
             }
-            case DW_OP_addr: {
-                auto value = r.getuint(r.addrLen);
-                push(value);
-                break;
-            }
             case DW_OP_call_frame_cfa:
                push(frame->cfa);
                break;
             case DW_OP_fbreg:
                // Yuk - find DW_AT_frame_base, and offset from that.
-               frame->getFrameBase(proc, r.getsleb128(), this);
+               if (!haveFrameBase) {
+                   frame->getFrameBase(proc, 0, this);
+                   frameBase = poptop();
+                   haveFrameBase = true;
+               }
+               push(frameBase + i->arg);
                break;
 
             case DW_OP_reg0: case DW_OP_reg1: case DW_OP_reg2: case DW_OP_reg3:
@@ -271,13 +256,12 @@ DwarfExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame
                 push(frame->getReg(op - DW_OP_reg0));
                 break;
             case DW_OP_regx:
-                push(frame->getReg(r.getsleb128()));
+                push(frame->getReg(i->arg));
                 break;
 
             case DW_OP_entry_value: case DW_OP_GNU_entry_value: {
-                auto len = r.getuleb128();
-                DWARFReader r2(r, r.getOffset(), len);
-                push(eval(proc, r2, frame));
+                push(eval(proc, i + 1, i + 1 + i->arg, frame));
+                i += i->arg;
                 break;
             }
 
@@ -293,7 +277,7 @@ DwarfExpressionStack::eval(const Process &proc, DWARFReader &r, const StackFrame
 }
 
 Elf_Addr
-StackFrame::getCFA(const Process &proc, const DwarfCallFrame &dcf) const
+StackFrame::getCFA(const Process &proc, const DwarfCallFrame &dcf, const Reader &memory) const
 {
     switch (dcf.cfaValue.type) {
         case SAME:
@@ -309,27 +293,31 @@ StackFrame::getCFA(const Process &proc, const DwarfCallFrame &dcf) const
         case OFFSET:
             return getReg(dcf.cfaReg) + dcf.cfaValue.u.offset;
         case EXPRESSION: {
-            DwarfExpressionStack stack;
-            DWARFReader r(frameInfo->section, dcf.cfaValue.u.expression.offset, dcf.cfaValue.u.expression.length);
-            return stack.eval(proc, r, this);
+            DwarfExpressionStack stack(&memory);
+            auto &expr = dcf.cfaValue.u.expression;
+            return stack.eval(proc, frameInfo->dwarf->expression(frameInfo->section, expr.offset, expr.length), this);
         }
     }
     return -1;
 }
 
-StackFrame *
-StackFrame::unwind(Process &p)
+bool
+StackFrame::unwind(Process &p, const Reader &memory, StackFrame &out)
 {
     Elf_Off reloc;
     auto elf = p.findObject(ip, &reloc);
     if (!elf)
-       return 0;
+       return false;
     Elf_Off objaddr = ip - reloc; // relocate process address to object address
-    // Try and find DWARF data with debug frame information, or an eh_frame section.
+    // Try and find DWARF data with debug frame information, or an eh_frame
+    // section. We hold its lock only while we look in its FDE and row
+    // caches: once decoded, the FDE and its rows don't change.
+    const DwarfCallFrame *frame = 0;
     for (bool debug : {true, false}) {
        dwarf = p.getDwarf(elf, debug);
        if (dwarf) {
-          auto frames = { dwarf->debugFrame.get(), dwarf->ehFrame.get() };
+          std::lock_guard<std::recursive_mutex> guard(dwarf->lock);
+          auto frames = { dwarf->getDebugFrame(), dwarf->getEhFrame() };
           for (auto f : frames) {
              if (f) {
                  fde = f->findFDE(objaddr);
@@ -339,58 +327,67 @@ StackFrame::unwind(Process &p)
                  }
              }
           }
-          if (fde)
+          if (fde) {
+              frame = &fde->callFrame(objaddr);
               break;
+          }
        }
     }
     if (!fde)
-       return 0;
+       return false;
 
-    DWARFReader r(frameInfo->section, fde->instructions, fde->end - fde->instructions);
-
-    auto iter = dwarf->callFrameForAddr.find(objaddr);
-    if (iter == dwarf->callFrameForAddr.end())
-        dwarf->callFrameForAddr[objaddr] = fde->cie->execInsns(r, fde->iloc, objaddr);
-
-    const DwarfCallFrame &dcf = dwarf->callFrameForAddr[objaddr];
+    const DwarfCallFrame &dcf = *frame;
 
     // Given the registers available, and the state of the call unwind data, calculate the CFA at this point.
-    cfa = getCFA(p, dcf);
+    cfa = getCFA(p, dcf, memory);
 
-    StackFrame *out = new StackFrame();
+    out = StackFrame();
 #ifdef CFA_RESTORE_REGNO
     // "The CFA is defined to be the stack pointer in the calling frame."
-    out->setReg(CFA_RESTORE_REGNO, cfa);
+    out.setReg(CFA_RESTORE_REGNO, cfa);
 #endif
 
-    for (auto &entry : dcf.registers) {
-        const auto &unwind = entry.second;
-        const int regno = entry.first;
+    // Fetch all the registers saved relative to the CFA in one batch.
+    Elf_Addr saved[DWARF_MAXREG]; // XXX: assume addrLen = sizeof Elf_Addr
+    ReadReq reads[DWARF_MAXREG];
+    size_t savedCount = 0;
+    for (int regno = 0; regno < DWARF_MAXREG; ++regno) {
+        if (dcf.registers[regno].type == OFFSET) {
+            auto &addr = saved[savedCount];
+            reads[savedCount++] = ReadReq(cfa + dcf.registers[regno].u.offset, sizeof addr, (char *)&addr);
+        }
+    }
+    memory.readv(reads, savedCount);
+    for (size_t i = 0; i < savedCount; ++i)
+        if (reads[i].rc != reads[i].count)
+            throw Exception() << "incomplete object read from " << memory.describe()
+               << " at offset " << reads[i].offset << " for " << reads[i].count << " bytes";
+    const Elf_Addr *savedValue = saved;
+
+    for (int regno = 0; regno < DWARF_MAXREG; ++regno) {
+        const auto &unwind = dcf.registers[regno];
         switch (unwind.type) {
             case UNDEF:
             case SAME:
-                out->setReg(regno, getReg(regno));
+                out.setReg(regno, getReg(regno));
                 break;
-            case OFFSET: {
-                Elf_Addr reg; // XXX: assume addrLen = sizeof Elf_Addr
-                p.io->readObj(cfa + unwind.u.offset, &reg);
-                out->setReg(regno, reg);
+            case OFFSET:
+                out.setReg(regno, *savedValue++);
                 break;
-            }
             case REG:
-                out->setReg(regno, getReg(unwind.u.reg));
+                out.setReg(regno, getReg(unwind.u.reg));
                 break;
 
             case VAL_EXPRESSION:
             case EXPRESSION: {
-                DwarfExpressionStack stack;
+                DwarfExpressionStack stack(&memory);
                 stack.push(cfa);
-                DWARFReader reader(frameInfo->section, unwind.u.expression.offset, unwind.u.expression.length);
-                auto val = stack.eval(p, reader, this);
+                auto &expr = unwind.u.expression;
+                auto val = stack.eval(p, frameInfo->dwarf->expression(frameInfo->section, expr.offset, expr.length), this);
                 // EXPRESSIONs give an address, VAL_EXPRESSION gives a literal.
                 if (unwind.type == EXPRESSION)
-                    p.io->readObj(val, &val);
-                out->setReg(regno, val);
+                    memory.readObj(val, &val);
+                out.setReg(regno, val);
                 break;
             }
 
@@ -402,26 +399,43 @@ StackFrame::unwind(Process &p)
 
     // If the return address isn't defined, then we can't unwind.
     auto rar = fde->cie->rar;
-    auto rarInfo = dcf.registers.find(rar);
-    if (rarInfo == dcf.registers.end() || rarInfo->second.type == UNDEF) {
-        delete out;
-        return 0;
-    }
-
-    out->ip = out->getReg(rar);
-    return out;
-}
+    if (rar >= DWARF_MAXREG || dcf.registers[rar].type == UNDEF)
+        return false;
 
-void
-StackFrame::setReg(unsigned regno, uintmax_t regval)
-{
-    regs[regno] = regval;
+    out.ip = out.getReg(rar);
+    return true;
 }
 
-
-uintmax_t
-StackFrame::getReg(unsigned regno) const
+/*
+ * Find the caller from the conventional chain of frame pointers: the frame
+ * pointer register points at the caller's saved frame pointer, with the
+ * return address just above it. This needs no unwind information, so it's
+ * cheap, and works for code we have none for, as long as the code maintains
+ * a frame pointer. Other registers we can't recover, and just copy.
+ */
+bool
+StackFrame::unwindFP(const Reader &memory, StackFrame &out)
 {
-    auto i = regs.find(regno);
-    return i != regs.end() ? i->second : 0;
+#ifdef FPREG
+    Elf_Addr fp = getReg(FPREG);
+    // Stacks grow down, so the caller's frame must be above ours.
+    if (fp == 0 || fp % sizeof fp != 0 || fp < getReg(CFA_RESTORE_REGNO))
+        return false;
+    Elf_Addr saved[2]; // the caller's frame pointer, and our return address.
+    if (memory.read(fp, sizeof saved, (char *)saved) != sizeof saved || saved[1] == 0)
+        return false;
+    cfa = fp + sizeof saved;
+    out = StackFrame();
+    std::copy(regs, regs + DWARF_MAXREG, out.regs);
+    out.haveRegs = haveRegs;
+    out.setReg(FPREG, saved[0]);
+    out.setReg(CFA_RESTORE_REGNO, cfa);
+    out.setReg(IPREG, saved[1]);
+    out.ip = saved[1];
+    return true;
+#else
+    (void)memory;
+    (void)out;
+    return false;
+#endif
 }
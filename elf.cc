@@ -3,6 +3,8 @@
 #include <iomanip>
 #include <unistd.h>
 #include <algorithm>
+#include <mutex>
+#include <set>
 #include <zlib.h>
 
 #include "libpstack/util.h"
@@ -15,6 +17,7 @@ using std::shared_ptr;
 std::ostream *debug = &std::clog;
 int verbose = 0;
 static uint32_t elf_hash(string);
+static uint32_t gnu_hash(const string &);
 bool noDebugLibs;
 
 GlobalDebugDirectories globalDebugDirectories;
@@ -46,22 +49,28 @@ ElfNotes::end() const
 std::string
 ElfNoteDesc::name() const
 {
-   char *buf = new char[note.n_namesz + 1];
-   io->readObj(sizeof note, buf, note.n_namesz);
-   buf[note.n_namesz] = 0;
-   std::string s = buf;
-   delete[] buf;
+   const char *view = io->view(sizeof note, note.n_namesz);
+   if (view)
+      return std::string(view, strnlen(view, note.n_namesz));
+   std::string s(note.n_namesz, 0);
+   io->readObj(sizeof note, &s[0], note.n_namesz);
+   s.resize(strnlen(s.c_str(), s.size()));
    return s;
 }
 
 const unsigned char *
 ElfNoteDesc::data() const
 {
-   if (databuf == 0) {
-      databuf = new unsigned char[note.n_descsz];
-      io->readObj(roundup2(sizeof note + note.n_namesz, 4), databuf, note.n_descsz);
+   if (dataptr == 0) {
+      off_t off = roundup2(sizeof note + note.n_namesz, 4);
+      dataptr = (const unsigned char *)io->view(off, note.n_descsz);
+      if (dataptr == 0) {
+         databuf = std::make_shared<std::vector<unsigned char>>(note.n_descsz);
+         io->readObj(off, databuf->data(), note.n_descsz);
+         dataptr = databuf->data();
+      }
    }
-   return databuf;
+   return dataptr;
 }
 
 size_t
@@ -77,10 +86,18 @@ ElfNoteDesc::size() const
 const Elf_Phdr *
 ElfObject::findHeaderForAddress(Elf_Off a) const
 {
-    for (const auto &hdr : getSegments(PT_LOAD))
-        if (hdr.p_vaddr <= a && hdr.p_vaddr + hdr.p_memsz > a)
-            return &hdr;
-    return 0;
+    // If segments overlap, prefer the first in the headers.
+    auto it = std::upper_bound(loadSegments.begin(), loadSegments.end(), a,
+        [](Elf_Off a, const ElfSegmentRange &range) { return a < range.start; });
+    const ElfSegmentRange *found = 0;
+    while (it != loadSegments.begin()) {
+        --it;
+        if (it->maxEnd <= a)
+            break;
+        if (it->end > a && (found == 0 || it->index < found->index))
+            found = &*it;
+    }
+    return found ? &getSegments(PT_LOAD)[found->index] : 0;
 }
 
 ElfObject::ElfObject(shared_ptr<Reader> io_)
@@ -112,6 +129,7 @@ ElfObject::getInterpreter() const
 void
 ElfObject::init(const shared_ptr<Reader> &io_)
 {
+    StatTimer _("parse elf", *io_);
     debugLoaded = false;
     io = io_;
     int i;
@@ -129,6 +147,15 @@ ElfObject::init(const shared_ptr<Reader> &io_)
         off += elfHeader.e_phentsize;
     }
 
+    auto &loads = getSegments(PT_LOAD);
+    for (size_t i = 0; i < loads.size(); ++i)
+        if (loads[i].p_memsz != 0)
+            loadSegments.emplace_back(loads[i].p_vaddr, loads[i].p_vaddr + loads[i].p_memsz, i);
+    std::stable_sort(loadSegments.begin(), loadSegments.end(),
+        [](const ElfSegmentRange &l, const ElfSegmentRange &r) { return l.start < r.start; });
+    for (size_t i = 1; i < loadSegments.size(); ++i)
+        loadSegments[i].maxEnd = std::max(loadSegments[i].end, loadSegments[i - 1].maxEnd);
+
     for (off = elfHeader.e_shoff, i = 0; i < elfHeader.e_shnum; i++) {
         sectionHeaders.push_back(std::make_shared<ElfSection>(*this, off));
         off += elfHeader.e_shentsize;
@@ -146,6 +173,17 @@ ElfObject::init(const shared_ptr<Reader> &io_)
             auto strings = getSection((*syms)->sh_link);
             hash.reset(new ElfSymHash(tab, syms, strings));
         }
+        auto gnuTab = getSection(".gnu.hash", SHT_GNU_HASH);
+        if (gnuTab) {
+            auto syms = getSection((*gnuTab)->sh_link);
+            auto strings = getSection((*syms)->sh_link);
+            try {
+                gnuHash.reset(new ElfGnuHash(gnuTab, syms, strings));
+            }
+            catch (const Exception &ex) {
+                std::clog << "can't use .gnu.hash for " << io->describe() << ": " << ex.what() << "\n";
+            }
+        }
     } else {
         hash = 0;
     }
@@ -160,6 +198,61 @@ SymbolIterator::operator *()
         return std::make_pair(sym, name);
 }
 
+/*
+ * Build the address index for one symbol table, holding only the symbols
+ * findSymbolByAddress can return for the given type. We read the symbols
+ * themselves, but not their names.
+ */
+const ElfSymbolIndex &
+ElfObject::symbolIndex(const std::string &table, std::shared_ptr<const ElfSection> symSection, int type)
+{
+    std::lock_guard<std::mutex> guard(symbolLock);
+    auto key = std::make_pair(table, type);
+    auto it = symbolIndexes.find(key);
+    if (it != symbolIndexes.end())
+        return it->second;
+
+    auto &index = symbolIndexes[key];
+    std::vector<Elf_Sym> syms(symSection->getSize() / sizeof (Elf_Sym));
+    symSection->io->readObj(0, syms.data(), syms.size());
+    for (size_t i = 0; i < syms.size(); ++i) {
+        auto &candidate = syms[i];
+        if (candidate.st_shndx >= sectionHeaders.size())
+            continue;
+        auto shdr = sectionHeaders[candidate.st_shndx];
+        if (!((*shdr)->sh_flags & SHF_ALLOC))
+            continue;
+        if (type != STT_NOTYPE && ELF_ST_TYPE(candidate.st_info) != type)
+            continue;
+        if (candidate.st_size)
+            index.sized.emplace_back(candidate.st_value, candidate.st_value + candidate.st_size, i);
+        else
+            index.sizeless.emplace_back(candidate.st_value, candidate.st_value, i);
+    }
+    auto byStart = [](const ElfSymbolRange &l, const ElfSymbolRange &r) { return l.start < r.start; };
+    std::stable_sort(index.sized.begin(), index.sized.end(), byStart);
+    std::stable_sort(index.sizeless.begin(), index.sizeless.end(), byStart);
+    for (size_t i = 1; i < index.sized.size(); ++i)
+        index.sized[i].maxEnd = std::max(index.sized[i].end, index.sized[i - 1].maxEnd);
+    return index;
+}
+
+const ElfSymbolIndex *
+ElfObject::getSymbolIndex(const std::string &table, int type)
+{
+    const auto symSection = getSection(table, SHT_NULL);
+    if (symSection == 0 || (*symSection)->sh_type == SHT_NOBITS)
+        return 0;
+    return &symbolIndex(table, symSection, type);
+}
+
+void
+ElfObject::setSymbolIndex(const std::string &table, int type, ElfSymbolIndex &&index)
+{
+    std::lock_guard<std::mutex> guard(symbolLock);
+    symbolIndexes.insert(std::make_pair(std::make_pair(table, type), std::move(index)));
+}
+
 /*
  * Find the symbol that represents a particular address.
  * If we fail to find a symbol whose virtual range includes our target address
@@ -168,6 +261,8 @@ SymbolIterator::operator *()
  * A side-effect is a few false-positives: A stripped, dynamically linked,
  * executable will typically report functions as being "_init", because it is
  * the only symbol in the image, and it has no size.
+ * Where several symbols qualify, we take the first in the table, as a linear
+ * search of the table would.
  */
 bool
 ElfObject::findSymbolByAddress(Elf_Addr addr, int type, Elf_Sym &sym, string &name)
@@ -176,42 +271,46 @@ ElfObject::findSymbolByAddress(Elf_Addr addr, int type, Elf_Sym &sym, string &na
     static const char *sectionNames[] = {
         ".symtab", ".dynsym", 0
     };
-    bool exact = false;
+    auto byStart = [](Elf_Addr addr, const ElfSymbolRange &range) { return addr < range.start; };
     Elf_Addr lowest = 0;
-    for (size_t i = 0; sectionNames[i] && !exact; i++) {
+    for (size_t i = 0; sectionNames[i]; i++) {
         const auto symSection = getSection(sectionNames[i], SHT_NULL);
         if (symSection == 0 || (*symSection)->sh_type == SHT_NOBITS)
             continue;
+        auto &index = symbolIndex(sectionNames[i], symSection, type);
         SymbolSection syms(*this, symSection);
-        for (auto syminfo : syms) {
-            auto &candidate = syminfo.first;
-            if (candidate.st_shndx >= sectionHeaders.size())
-                continue;
-            auto shdr = sectionHeaders[candidate.st_shndx];
-            if (!((*shdr)->sh_flags & SHF_ALLOC))
-                continue;
-            if (type != STT_NOTYPE && ELF_ST_TYPE(candidate.st_info) != type)
-                continue;
-            if (candidate.st_value > addr)
-                continue;
-            if (candidate.st_size) {
-                // symbol has a size: we can check if our address lies within it.
-                if (candidate.st_size + candidate.st_value > addr) {
-                    // yep: return this one.
-                    sym = candidate;
-                    name = syminfo.second;
-                    return true;
-                }
-            } else if (lowest < candidate.st_value) {
-                /*
-                 * No size, but hold on to it as a possibility. We'll return
-                 * the symbol with the highest value not aabove the required
-                 * value
-                 */
-                sym = candidate;
-                name = syminfo.second;
-                lowest = candidate.st_value;
-            }
+
+        // symbols with a size: we can check if our address lies within them.
+        const ElfSymbolRange *found = 0;
+        auto it = std::upper_bound(index.sized.begin(), index.sized.end(), addr, byStart);
+        while (it != index.sized.begin()) {
+            --it;
+            if (it->maxEnd <= addr)
+                break;
+            if (it->end > addr && (found == 0 || it->index < found->index))
+                found = &*it;
+        }
+        if (found) {
+            auto syminfo = *SymbolIterator(&syms, found->index * sizeof (Elf_Sym));
+            sym = syminfo.first;
+            name = syminfo.second;
+            return true;
+        }
+
+        /*
+         * No size, but hold on to the one with the highest value not above
+         * the required value as a possibility.
+         */
+        it = std::upper_bound(index.sizeless.begin(), index.sizeless.end(), addr, byStart);
+        if (it != index.sizeless.begin() && lowest < (it - 1)->start) {
+            // sizeless is sorted stably, so the first with this value is
+            // the first in the table.
+            it = std::lower_bound(index.sizeless.begin(), it, (it - 1)->start,
+                [](const ElfSymbolRange &range, Elf_Addr addr) { return range.start < addr; });
+            auto syminfo = *SymbolIterator(&syms, it->index * sizeof (Elf_Sym));
+            sym = syminfo.first;
+            name = syminfo.second;
+            lowest = it->start;
         }
     }
     return lowest != 0;
@@ -257,13 +356,17 @@ ElfSymHash::ElfSymHash(std::shared_ptr<const ElfSection> &hash_, std::shared_ptr
     , syms(syms_)
     , strings(strings_)
 {
-    // read the hash table into local memory.
+    // use the hash table in-place if we can, otherwise read it into local memory.
     size_t words = hash->getSize() / sizeof (Elf_Word);
-    data.resize(words);
-    hash->io->readObj(0, &data[0], words);
-    nbucket = data[0];
-    nchain = data[1];
-    buckets = &data[0] + 2;
+    const Elf_Word *table = (const Elf_Word *)hash->io->view(0, words * sizeof (Elf_Word));
+    if (table == 0) {
+        data.resize(words);
+        hash->io->readObj(0, &data[0], words);
+        table = &data[0];
+    }
+    nbucket = table[0];
+    nchain = table[1];
+    buckets = table + 2;
     chains = buckets + nbucket;
 }
 
@@ -283,17 +386,81 @@ ElfSymHash::findSymbol(Elf_Sym &sym, const string &name)
     return false;
 }
 
+ElfGnuHash::ElfGnuHash(std::shared_ptr<const ElfSection> &hash_, std::shared_ptr<const ElfSection> &syms_, std::shared_ptr<const ElfSection> &strings_)
+    : hash(hash_)
+    , syms(syms_)
+    , strings(strings_)
+{
+    // use the hash table in-place if we can, otherwise read it into local memory.
+    size_t words = hash->getSize() / sizeof (Elf_Word);
+    if (words < 4)
+        throw Exception() << "truncated header";
+    const Elf_Word *table = (const Elf_Word *)hash->io->view(0, words * sizeof (Elf_Word));
+    if (table == 0) {
+        data.resize(words);
+        hash->io->readObj(0, &data[0], words);
+        table = &data[0];
+    }
+    nbucket = table[0];
+    symoffset = table[1];
+    bloomSize = table[2];
+    bloomShift = table[3];
+    const size_t bloomWords = bloomSize * (sizeof (Elf_Addr) / sizeof (Elf_Word));
+    if (nbucket == 0 || bloomSize == 0 || 4 + bloomWords + nbucket > words)
+        throw Exception() << "bad header";
+    bloom = (const Elf_Addr *)(table + 4);
+    buckets = table + 4 + bloomWords;
+    chains = buckets + nbucket;
+    nchain = words - (4 + bloomWords + nbucket);
+}
+
+bool
+ElfGnuHash::findSymbol(Elf_Sym &sym, const string &name)
+{
+    const uint32_t bits = sizeof (Elf_Addr) * 8;
+    uint32_t h1 = gnu_hash(name);
+    Elf_Addr word = bloom[(h1 / bits) % bloomSize];
+    Elf_Addr mask = Elf_Addr(1) << (h1 % bits) | Elf_Addr(1) << ((h1 >> bloomShift) % bits);
+    if ((word & mask) != mask)
+        return false;
+
+    Elf_Word i = buckets[h1 % nbucket];
+    if (i < symoffset)
+        return false;
+    for (; i - symoffset < nchain; ++i) {
+        Elf_Word h2 = chains[i - symoffset];
+        if ((h1 | 1) == (h2 | 1)) {
+            Elf_Sym candidate;
+            syms->io->readObj(i * sizeof candidate, &candidate);
+            if (strings->io->readString(candidate.st_name) == name) {
+                sym = candidate;
+                return true;
+            }
+        }
+        if (h2 & 1)
+            break;
+    }
+    return false;
+}
+
 /*
- * Locate a named symbol in an ELF image.
+ * Locate a named symbol in an ELF image. The GNU hash covers all the
+ * defined dynamic symbols, so if we have one, there's no point searching
+ * .dynsym after it misses.
  */
 bool
 ElfObject::findSymbolByName(const string &name, Elf_Sym &sym)
 {
-    if (hash && hash->findSymbol(sym, name))
-        return true;
-    auto dyn = getSection(".dynsym", SHT_DYNSYM);
-    if (dyn && linearSymSearch(dyn, name, sym))
-        return true;
+    if (gnuHash) {
+        if (gnuHash->findSymbol(sym, name))
+            return true;
+    } else {
+        if (hash && hash->findSymbol(sym, name))
+            return true;
+        auto dyn = getSection(".dynsym", SHT_DYNSYM);
+        if (dyn && linearSymSearch(dyn, name, sym))
+            return true;
+    }
     auto symtab = getSection(".symtab", SHT_SYMTAB);
     return symtab && linearSymSearch(symtab, name, sym);
 }
@@ -309,18 +476,46 @@ ElfObject::getDebug(std::shared_ptr<ElfObject> &in)
    return sp ? sp : in;
 }
 
+/*
+ * Paths we've failed to load debug images from. Most of the paths we try
+ * don't exist, and on a network filesystem finding that out each time for
+ * each object and process we look at is slow. They're remembered until
+ * someone calls forgetMissing, as each ImageCache does when it goes.
+ */
+static std::set<std::string> missingDebugImages;
+static std::mutex missingDebugLock; // protects missingDebugImages.
+
+void
+GlobalDebugDirectories::forgetMissing()
+{
+    std::lock_guard<std::mutex> guard(missingDebugLock);
+    missingDebugImages.clear();
+}
+
 static std::shared_ptr<ElfObject>
 tryLoad(const std::string &name) {
+    static auto &probes = Stats::counter("debug image probes");
+    static auto &knownMissing = Stats::counter("debug image probes known missing");
     // XXX: verify checksum.
     for (auto dir : globalDebugDirectories.dirs) {
+        auto path = dir + "/" + name;
+        {
+            std::lock_guard<std::mutex> guard(missingDebugLock);
+            if (missingDebugImages.find(path) != missingDebugImages.end()) {
+                Stats::add(knownMissing);
+                continue;
+            }
+        }
+        Stats::add(probes);
         try {
-           auto debugObject = make_shared<ElfObject>(loadFile((dir + "/" + name).c_str()));
+           auto debugObject = make_shared<ElfObject>(loadFile(path));
            if (verbose >= 2)
-              *debug << "found debug object " << dir << "/" << name << "\n";
+              *debug << "found debug object " << path << "\n";
            return debugObject;
         }
         catch (const std::exception &ex) {
-            continue;
+            std::lock_guard<std::mutex> guard(missingDebugLock);
+            missingDebugImages.insert(path);
         }
     }
     if (verbose >= 2)
@@ -334,6 +529,7 @@ ElfObject::getDebug()
     if (noDebugLibs)
         return std::shared_ptr<ElfObject>();
 
+    std::lock_guard<std::mutex> guard(debugLock);
     if (!debugLoaded) {
         debugLoaded = true;
 
@@ -370,6 +566,18 @@ ElfObject::getDebug()
     return debugObject;
 }
 
+/*
+ * The hash function for .gnu.hash.
+ */
+static uint32_t
+gnu_hash(const string &name)
+{
+    uint32_t h = 5381;
+    for (auto c : name)
+        h = h * 33 + (unsigned char)c;
+    return h;
+}
+
 /*
  * Culled from System V Application Binary Interface
  */
@@ -386,76 +594,133 @@ elf_hash(string name)
     return (h);
 }
 
-struct inflateCtx {
-    char *uncompressed;
-    std::shared_ptr<Reader> output;
-    std::shared_ptr<Reader> input;
-    off_t outputOffset;
-    off_t inputOffset;
-    z_stream stream;
-    unsigned char window[32 * 1024];
-    unsigned char xferbuf[4096];
-    inflateCtx(const Elf_Chdr &hdr, std::shared_ptr<Reader> inputBuf);
-    ~inflateCtx();
-    void inflate();
+/*
+ * A reader for the content of an SHF_COMPRESSED section. Nothing is inflated
+ * until someone reads the section, and then only as far as the furthest byte
+ * anyone has asked for, in chunks of "chunkSize" bytes.
+ */
+class InflateReader : public Reader {
+    static const size_t chunkSize = 64 * 1024;
+    std::shared_ptr<Reader> upstream;
+    size_t size;
+    mutable std::mutex lock;
+    mutable std::unique_ptr<char[]> data;
+    mutable size_t inflated; // bytes of "data" that are valid
+    mutable off_t inputOffset;
+    mutable z_stream stream;
+    mutable bool finished;
+    mutable unsigned char xferbuf[16 * 1024];
+    void inflateTo(size_t offset) const;
+public:
+    InflateReader(std::shared_ptr<Reader> upstream, const Elf_Chdr &);
+    ~InflateReader();
+    size_t read(off_t off, size_t count, char *ptr) const;
+    const char *view(off_t off, size_t count) const;
+    const char *viewString(off_t off) const;
+    std::string describe() const { return "inflated " + upstream->describe(); }
 };
 
-extern "C" {
-
-static unsigned incb(void *arg, z_const unsigned char **ptr)
+InflateReader::InflateReader(std::shared_ptr<Reader> upstream_, const Elf_Chdr &hdr)
+    : upstream(upstream_)
+    , size(hdr.ch_size)
+    , inflated(0)
+    , inputOffset(sizeof hdr)
+    , finished(false)
 {
-    inflateCtx *ctx = (inflateCtx *)arg;
-    *ptr = ctx->xferbuf;
-    size_t amount = ctx->input->read(ctx->inputOffset, sizeof ctx->xferbuf, (char *)ctx->xferbuf);
-    ctx->inputOffset += amount;
-    return amount;
+    if (hdr.ch_type != ELFCOMPRESS_ZLIB)
+        throw Exception() << "unknown compression type " << hdr.ch_type
+            << " for " << upstream->describe();
+    memset(&stream, 0, sizeof stream);
 }
 
-static int outcb(void *arg, unsigned char *ptr, unsigned amount)
+InflateReader::~InflateReader()
 {
-    inflateCtx *ctx = (inflateCtx *)arg;
-    memcpy(ctx->uncompressed + ctx->outputOffset, ptr, amount);
-    ctx->outputOffset += amount;
-    return 0;
-}
-
+    if (data && !finished)
+        inflateEnd(&stream);
 }
 
-void inflateCtx::inflate()
+// Inflate at least the first "offset" bytes of the section.
+void
+InflateReader::inflateTo(size_t offset) const
 {
-    inflateBack(&stream, incb, this, outcb, this);
+    if (!data) {
+        if (verbose >= 2)
+            *debug << "decompressing section " << upstream->describe() << "\n";
+        if (inflateInit(&stream) != Z_OK)
+            throw Exception() << "inflateInit failed";
+        data.reset(new char[size]);
+    }
+    size_t want = std::min(size, std::max(offset, inflated + chunkSize));
+    while (inflated < want && !finished) {
+        if (stream.avail_in == 0) {
+            size_t amount = upstream->read(inputOffset, sizeof xferbuf, (char *)xferbuf);
+            if (amount == 0)
+                throw Exception() << "truncated compressed data in " << upstream->describe();
+            inputOffset += amount;
+            stream.next_in = xferbuf;
+            stream.avail_in = amount;
+        }
+        stream.next_out = (unsigned char *)data.get() + inflated;
+        stream.avail_out = want - inflated;
+        int rc = ::inflate(&stream, Z_NO_FLUSH);
+        inflated = want - stream.avail_out;
+        if (rc == Z_STREAM_END) {
+            finished = true;
+            inflateEnd(&stream);
+        } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            throw Exception() << "can't inflate " << upstream->describe() << ": "
+                << (stream.msg ? stream.msg : "unknown error");
+        }
+    }
 }
 
-inflateCtx::~inflateCtx()
+size_t
+InflateReader::read(off_t off, size_t count, char *ptr) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (size_t(off) >= size)
+        return 0;
+    count = std::min(count, size - off);
+    inflateTo(off + count);
+    count = std::min(count, inflated - std::min(inflated, size_t(off)));
+    memcpy(ptr, data.get() + off, count);
+    return count;
+}
+
+const char *
+InflateReader::view(off_t off, size_t count) const
 {
-   inflateBackEnd(&stream);
+    std::lock_guard<std::mutex> guard(lock);
+    if (size_t(off) + count > size)
+        return 0;
+    inflateTo(off + count);
+    return size_t(off) + count <= inflated ? data.get() + off : 0;
 }
 
-inflateCtx::inflateCtx(const Elf_Chdr &hdr, std::shared_ptr<Reader> inputBuf)
-    : uncompressed(new char[hdr.ch_size])
-    , output(std::make_shared<AllocMemReader>(hdr.ch_size, uncompressed))
-    , input(inputBuf)
-    , outputOffset(0)
-    , inputOffset(sizeof hdr)
+const char *
+InflateReader::viewString(off_t off) const
 {
-    memset(&stream, 0, sizeof stream);
-    if (inflateBackInit(&stream, 15, window) != 0)
-       throw Exception() << "inflateBackInit failed";
+    std::lock_guard<std::mutex> guard(lock);
+    if (size_t(off) >= size)
+        return 0;
+    for (size_t scanned = off;;) {
+        inflateTo(scanned + 1);
+        if (inflated <= scanned)
+            return 0;
+        if (memchr(data.get() + scanned, 0, inflated - scanned))
+            return data.get() + off;
+        scanned = inflated;
+    }
 }
 
-
 ElfSection::ElfSection(const ElfObject &obj_, off_t off)
 {
     obj_.getio()->readObj(off, &shdr);
     auto rawIo = std::make_shared<OffsetReader>(obj_.getio(), shdr.sh_offset, shdr.sh_size);
     if (shdr.sh_flags & SHF_COMPRESSED) {
-        if (verbose >= 2)
-            *debug << "decompressing section " << rawIo->describe() << "\n";
         Elf_Chdr chdr;
         rawIo->readObj(0, &chdr);
-        inflateCtx ctx(chdr, rawIo);
-        ctx.inflate();
-        io = ctx.output;
+        io = std::make_shared<InflateReader>(rawIo, chdr);
         size = chdr.ch_size;
     } else {
         io = rawIo;
@@ -159,12 +159,13 @@ std::ostream &operator << (std::ostream &, const DwarfAttribute &);
 std::ostream &operator << (std::ostream &, const DwarfAttributeSpec &);
 std::ostream &operator << (std::ostream &, const DwarfBlock &);
 std::ostream &operator << (std::ostream &, const DwarfEntry &);
+std::ostream &operator << (std::ostream &, const DwarfEntries &);
 std::ostream &operator << (std::ostream &, const DwarfExpressionOp);
 std::ostream &operator << (std::ostream &, const DwarfFileEntry &);
 std::ostream &operator << (std::ostream &, const DwarfFrameInfo &);
 std::ostream &operator << (std::ostream &, DwarfInfo &);
 std::ostream &operator << (std::ostream &, const DwarfLineInfo &);
-std::ostream &operator << (std::ostream &, const DwarfLineState &);
+std::ostream &operator << (std::ostream &, const DwarfLineRow &);
 std::ostream &operator << (std::ostream &, const DwarfPubname &);
 std::ostream &operator << (std::ostream &, const DwarfPubnameUnit &);
 std::ostream &operator << (std::ostream &, const DwarfUnit &);
@@ -2,9 +2,12 @@
 #define DWARF_H
 
 #include <libpstack/elf.h>
+#include <algorithm>
+#include <atomic>
 #include <limits>
 #include <map>
 #include <list>
+#include <mutex>
 #include <vector>
 #include <string>
 
@@ -18,8 +21,18 @@ class DwarfLineInfo;
 struct DwarfUnit;
 struct DwarfFrameInfo;
 class DwarfEntry;
-// The DWARF Unit's allEntries map contains the underlying data for the tree.
-typedef std::list<DwarfEntry *> DwarfEntries;
+class DwarfIndex;
+// A run of sibling entries. The entries, and the array itself, live in the
+// owning unit's arena.
+struct DwarfEntries {
+    DwarfEntry **first;
+    size_t count;
+    DwarfEntries() : first(0), count(0) {}
+    DwarfEntry **begin() const { return first; }
+    DwarfEntry **end() const { return first + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+};
 
 
 
@@ -65,6 +78,26 @@ enum DwarfLineEOpcode {
 };
 #undef DWARF_LINE_E
 
+#define DWARF_OP(op, value, args) op = value,
+enum DwarfExpressionOp {
+#include <libpstack/dwarf/ops.h>
+    LASTOP = 0x100
+};
+#undef DWARF_OP
+
+/*
+ * A DWARF expression, decoded once from its bytes: each op with its operand,
+ * if it has one. DW_OP_entry_value's operand is the number of ops following
+ * it that make up its subexpression. Decoding stops at the first op we don't
+ * know how to decode, which is left at the end for evaluation to report.
+ */
+struct DwarfOp {
+    DwarfExpressionOp op;
+    intmax_t arg;
+    DwarfOp(DwarfExpressionOp op_, intmax_t arg_ = 0) : op(op_), arg(arg_) {}
+};
+typedef std::vector<DwarfOp> DwarfExpression;
+
 struct DwarfAttributeSpec {
     enum DwarfAttrName name;
     enum DwarfForm form;
@@ -75,7 +108,7 @@ struct DwarfAbbreviation {
     intmax_t code;
     DwarfTag tag;
     enum DwarfHasChildren hasChildren;
-    std::list<DwarfAttributeSpec> specs;
+    std::vector<DwarfAttributeSpec> specs;
     DwarfAbbreviation(DWARFReader &, intmax_t code);
     DwarfAbbreviation() {}
 };
@@ -129,54 +162,47 @@ union DwarfValue {
 struct DwarfAttribute {
     const DwarfAttributeSpec *spec; /* From abbrev table attached to type */
     const DwarfEntry *entry;
-    DwarfValue value;
+    DwarfValue value; // DW_FORM_string values point into the section, or the unit's arena.
     DwarfAttribute(DWARFReader &, const DwarfEntry *, const DwarfAttributeSpec *spec);
-    ~DwarfAttribute() {
-        if (spec && spec->form == DW_FORM_string)
-            free((void *)(const void *)value.string);
-    }
     DwarfAttribute() : spec(0), entry(0) {}
-    DwarfAttribute(const DwarfAttribute &rhs) : spec(rhs.spec), entry(rhs.entry) {
-        if (spec && spec->form == DW_FORM_string)
-            value.string = strdup(rhs.value.string);
-        else
-            value.block = rhs.value.block;
-    }
-    DwarfAttribute &operator = (const DwarfAttribute &rhs) {
-        entry = rhs.entry;
-        if (spec && spec->form == DW_FORM_string)
-            value.string = strdup(rhs.value.string);
-        spec = rhs.spec;
-        if (spec && spec->form == DW_FORM_string)
-            value.string = strdup(rhs.value.string);
-        else
-            value.block = rhs.value.block;
-        return *this;
-    }
 };
 
+/*
+ * DIEs are decoded lazily: constructing a DwarfEntry just notes where its
+ * attributes and children live in .debug_info. The attributes and children
+ * are decoded on first access.
+ */
 class DwarfEntry {
+    friend struct DwarfUnit;
     DwarfEntry() = delete;
     DwarfEntry(const DwarfEntry &) = delete;
+    Elf_Off attrOffset; // offset of our attributes.
+    Elf_Off childOffset; // offset of our first child.
+    mutable Elf_Off nextOffset; // offset of our next sibling, or 0 if not yet known.
+    mutable bool childrenDecoded;
+    mutable DwarfAttribute *attrs; // one per entry in type->specs, in the same order.
+    mutable DwarfEntries childList;
 public:
-    DwarfEntry *parent;
-    DwarfEntries children;
-    const DwarfUnit *unit;
+    const DwarfEntry *parent;
+    DwarfUnit *unit;
     const DwarfAbbreviation *type;
     intmax_t offset;
-    std::unordered_map<DwarfAttrName, DwarfAttribute> attributes;
 
+    const DwarfAttribute *attributes() const;
+    const DwarfEntries &children() const;
+    Elf_Off next() const;
     const DwarfAttribute *attrForName(DwarfAttrName name) const;
     const DwarfEntry *referencedEntry(DwarfAttrName name) const;
+    bool addrRanges(std::vector<std::pair<uintmax_t, uintmax_t>> &) const;
 
-    DwarfEntry(DWARFReader &r, intmax_t, DwarfUnit *unit, intmax_t offset, DwarfEntry *parent);
+    DwarfEntry(DWARFReader &r, intmax_t, DwarfUnit *unit, intmax_t offset, const DwarfEntry *parent);
     std::string name() const {
         const DwarfAttribute *attr = attrForName(DW_AT_name);
         if (attr)
            return attr->value.string;
         return "";
     }
-    DwarfEntry *firstChild(DwarfTag tag);
+    const DwarfEntry *firstChild(DwarfTag tag) const;
 };
 
 enum FIType {
@@ -196,11 +222,12 @@ public:
     DwarfFileEntry(DWARFReader &r, DwarfLineInfo *info);
 };
 
+// The registers of the line number state machine.
 class DwarfLineState {
     DwarfLineState() = delete;
 public:
     uintmax_t addr;
-    const DwarfFileEntry *file;
+    unsigned file; // index into the line info's "files".
     unsigned line;
     unsigned column;
     unsigned is_stmt:1;
@@ -212,27 +239,96 @@ public:
     void reset(DwarfLineInfo *);
 };
 
+// A row of a line number matrix, packed: we keep only what we look up.
+struct DwarfLineRow {
+    uintmax_t addr;
+    uint32_t line;
+    uint32_t file:30; // index into the line info's "files".
+    uint32_t is_stmt:1;
+    uint32_t end_sequence:1;
+    DwarfLineRow(const DwarfLineState &state)
+        : addr(state.addr), line(state.line), file(state.file)
+        , is_stmt(state.is_stmt), end_sequence(state.end_sequence) {}
+};
+
+// The address range covered by one row of a line number matrix.
+struct DwarfLineRange {
+    uintmax_t start;
+    uintmax_t end;
+    uintmax_t maxEnd; // the highest "end" of this and all preceding ranges.
+    uint32_t row;
+    DwarfLineRange(uintmax_t start_, uintmax_t end_, uint32_t row_)
+        : start(start_), end(end_), maxEnd(end_), row(row_) {}
+};
+
 class DwarfLineInfo {
     DwarfLineInfo(const DwarfLineInfo &) = delete;
+    // Ranges covered by each row of "matrix", sorted by start address.
+    std::vector<DwarfLineRange> index;
+    bool indexed;
 public:
-    DwarfLineInfo() {}
+    DwarfLineInfo() : indexed(false) {}
     int default_is_stmt;
     uint8_t opcode_base;
     std::vector<int> opcode_lengths;
     std::vector<std::string> directories;
     std::vector<DwarfFileEntry> files;
-    std::vector<DwarfLineState> matrix;
+    std::vector<DwarfLineRow> matrix;
     void build(DWARFReader &, const DwarfUnit *);
+    // Forget anything we've built, as if new.
+    void clear();
+    void rowsForAddr(uintmax_t addr, std::vector<const DwarfLineRow *> &);
+    const std::vector<DwarfLineRange> &addrIndex();
+};
+
+// An address range covered by the code of a function.
+struct DwarfFunctionRange {
+    uintmax_t start;
+    uintmax_t end;
+    uintmax_t maxEnd; // the highest "end" of this and all preceding ranges.
+    DwarfEntry *function;
+    DwarfFunctionRange(uintmax_t start_, uintmax_t end_, DwarfEntry *function_)
+        : start(start_), end(end_), maxEnd(end_), function(function_) {}
+};
+
+/*
+ * A unit's decoded entries, by offset: an open-addressing hash table, with
+ * linear probing, that doubles in size when it's half full.
+ */
+class DwarfEntryIndex {
+    std::vector<std::pair<Elf_Off, DwarfEntry *>> slots; // empty if the entry is null.
+    size_t count;
+    size_t slotFor(Elf_Off off) const {
+        // Fibonacci hashing spreads the (mostly small, close) offsets out.
+        return (uint64_t(off) * 0x9e3779b97f4a7c15ULL >> 20) & (slots.size() - 1);
+    }
+public:
+    DwarfEntryIndex() : count(0) {}
+    DwarfEntry *find(Elf_Off off) const {
+        if (slots.empty())
+            return 0;
+        for (size_t i = slotFor(off); slots[i].second; i = (i + 1) & (slots.size() - 1))
+            if (slots[i].first == off)
+                return slots[i].second;
+        return 0;
+    }
+    void insert(Elf_Off off, DwarfEntry *entry);
+    size_t size() const { return count; }
 };
 
 struct DwarfUnit {
     DwarfUnit() = delete;
     DwarfUnit(const DwarfUnit &) = delete;
-    std::map<off_t, DwarfEntry *> allEntries;
+    DwarfEntryIndex allEntries;
+    Arena arena; // holds the storage for all our entries.
     DwarfInfo *dwarf;
     off_t offset;
+    Elf_Off end;
     size_t dwarfLen;
-    void decodeEntries(DWARFReader &r, DwarfEntries &entries, DwarfEntry *parent);
+    void decodeEntries(DWARFReader &r, DwarfEntries &entries, const DwarfEntry *parent);
+    void skipEntries(DWARFReader &r) const;
+    const DwarfAbbreviation *abbrevForCode(intmax_t code) const;
+    DwarfEntry *entryAt(Elf_Off offset);
     uint32_t length;
     uint16_t version;
     std::map<DwarfTag, DwarfAbbreviation> abbreviations;
@@ -240,23 +336,34 @@ struct DwarfUnit {
     const unsigned char *entryPtr;
     const unsigned char *lineInfo;
     DwarfEntries entries;
-    DwarfLineInfo lines;
+private:
+    // The unit's line number program is decoded the first time we need it.
+    mutable DwarfLineInfo lines;
+    mutable bool linesDecoded;
+public:
+    DwarfLineInfo &getLines() const;
+    // Address ranges of the unit's functions, sorted by start address.
+    std::vector<DwarfFunctionRange> functions;
+    bool functionsIndexed;
+    void indexFunctions(const DwarfEntries &);
+    const DwarfFunctionRange *functionForAddr(uintmax_t addr);
+    const std::vector<DwarfFunctionRange> &functionIndex();
     DwarfUnit(DwarfInfo *, DWARFReader &);
     std::string name() const;
-    ~DwarfUnit();
 };
 
-struct DwarfFDE {
-    DwarfCIE *cie;
-    uintmax_t iloc;
-    uintmax_t irange;
-    Elf_Off instructions;
-    Elf_Off end;
-    std::vector<unsigned char> augmentation;
-    DwarfFDE(DwarfFrameInfo *, DWARFReader &, DwarfCIE * , Elf_Off end);
+// The DWARF register numbers we track are those in archreg.h.
+static constexpr int dwarfArchRegs[] = {
+#define REGMAP(number, field) number,
+#include <libpstack/dwarf/archreg.h>
+#undef REGMAP
 };
+static constexpr int dwarfMaxArchReg(size_t i = 0, int max = -1) {
+    return i == sizeof dwarfArchRegs / sizeof dwarfArchRegs[0] ? max
+        : dwarfMaxArchReg(i + 1, dwarfArchRegs[i] > max ? dwarfArchRegs[i] : max);
+}
+static constexpr int DWARF_MAXREG = dwarfMaxArchReg() + 1;
 
-#define MAXREG 128
 enum DwarfRegisterType {
     UNDEF,
     SAME,
@@ -280,13 +387,24 @@ struct DwarfRegisterUnwind {
 };
 
 struct DwarfCallFrame {
-    std::map<int, DwarfRegisterUnwind> registers;
+    // Rules for registers beyond those we track all share the last slot.
+    DwarfRegisterUnwind registers[DWARF_MAXREG + 1];
     int cfaReg;
     DwarfRegisterUnwind cfaValue;
     DwarfCallFrame();
+    DwarfRegisterUnwind &rule(uintmax_t regno) {
+        return registers[std::min(regno, uintmax_t(DWARF_MAXREG))];
+    }
     // default copy constructor is valid.
 };
 
+// The rules in effect from "start" up to the start of the next row.
+struct DwarfCallFrameRow {
+    uintmax_t start;
+    DwarfCallFrame frame;
+    DwarfCallFrameRow(uintmax_t start_, const DwarfCallFrame &frame_) : start(start_), frame(frame_) {}
+};
+
 struct DwarfCIE {
     const DwarfFrameInfo *frameInfo;
     uint8_t version;
@@ -302,28 +420,96 @@ struct DwarfCIE {
     std::string augmentation;
     DwarfCIE(const DwarfFrameInfo *, DWARFReader &, Elf_Off);
     DwarfCIE() {}
-    DwarfCallFrame execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr);
+    DwarfCallFrame execInsns(DWARFReader &r, uintmax_t addr, uintmax_t wantAddr,
+            std::vector<DwarfCallFrameRow> *rows = 0);
 };
 
+struct DwarfFDE {
+    DwarfCIE *cie;
+    uintmax_t iloc;
+    uintmax_t irange;
+    Elf_Off instructions;
+    Elf_Off end;
+    std::vector<unsigned char> augmentation;
+    DwarfFDE(const DwarfFrameInfo *, DWARFReader &, DwarfCIE * , Elf_Off end);
+    const DwarfCallFrame &callFrame(uintmax_t addr) const;
+private:
+    // The whole row table for the FDE, decoded on first use.
+    mutable std::vector<DwarfCallFrameRow> rows;
+};
+
+// The address range of an FDE, for the sorted index of a DwarfFrameInfo.
+struct DwarfFDERange {
+    uintmax_t start;
+    uintmax_t end;
+    uintmax_t maxEnd; // the highest "end" of this and all preceding ranges.
+    Elf_Off offset;
+    const DwarfFDE *fde;
+    DwarfFDERange(uintmax_t start_, uintmax_t end_, Elf_Off offset_, const DwarfFDE *fde_)
+        : start(start_), end(end_), maxEnd(end_), offset(offset_), fde(fde_) {}
+};
+
+
+/*
+ * CIEs and FDEs are decoded on demand, and cached by their offset in the
+ * section. Lookups by address use the binary search table in .eh_frame_hdr
+ * if there is one, or otherwise an index of all FDEs, sorted by address,
+ * built on first use.
+ */
 struct DwarfFrameInfo {
     const DwarfInfo *dwarf;
     std::shared_ptr<const ElfSection> section;
     FIType type;
-    std::map<Elf_Addr, DwarfCIE> cies;
-    std::list<DwarfFDE> fdeList;
+    mutable std::map<Elf_Off, DwarfCIE> cies;
+    mutable std::map<Elf_Off, DwarfFDE> fdes;
     DwarfFrameInfo(DwarfInfo *, std::shared_ptr<const ElfSection> section, FIType type);
     DwarfFrameInfo() = delete;
     DwarfFrameInfo(const DwarfFrameInfo &) = delete;
-    Elf_Addr decodeCIEFDEHdr(DWARFReader &, Elf_Addr &id, FIType, DwarfCIE **);
+    Elf_Addr decodeCIEFDEHdr(DWARFReader &, Elf_Addr &id, FIType, DwarfCIE **) const;
     const DwarfFDE *findFDE(Elf_Addr) const;
-    bool isCIE(Elf_Off id);
+    DwarfCIE *cieAt(Elf_Off) const;
+    const DwarfFDE *fdeAt(Elf_Off) const;
+    void decodeAll() const;
+    bool isCIE(Elf_Off id) const;
     intmax_t decodeAddress(DWARFReader &, int encoding) const;
+    bool hasHdr() const { return hdr != 0; }
+    const std::vector<DwarfFDERange> &addrIndex() const;
+private:
+    // The .eh_frame_hdr table, if any, and the number of entries in it.
+    mutable std::shared_ptr<const ElfSection> hdr;
+    Elf_Off hdrTable;
+    size_t hdrCount;
+    Elf_Addr hdrBase;
+    mutable std::vector<DwarfFDERange> fdeIndex;
+    mutable bool indexed;
+    const DwarfFDE *findFDEFromHdr(Elf_Addr) const;
+    const DwarfFDE *findFDEFromIndex(Elf_Addr) const;
+};
+
+// An address range covered by a unit.
+struct DwarfUnitRange {
+    uintmax_t start;
+    uintmax_t end;
+    uintmax_t maxEnd; // the highest "end" of this and all preceding ranges.
+    Elf_Off unit;
+    size_t seq; // order of discovery, to keep lookups in aranges order.
+    DwarfUnitRange(uintmax_t start_, uintmax_t end_, Elf_Off unit_, size_t seq_)
+        : start(start_), end(end_), maxEnd(end_), unit(unit_), seq(seq_) {}
 };
 
 class DwarfInfo {
     std::list<DwarfPubnameUnit> pubnameUnits;
     std::list<DwarfARangeSet> aranges;
     std::map<Elf_Off, std::shared_ptr<DwarfUnit>> unitsm;
+    std::mutex unitsLock; // protects unitsm.
+    // Unit address ranges, sorted by start address.
+    std::vector<DwarfUnitRange> unitRanges;
+    std::vector<Elf_Off> unrangedUnits; // units with no address ranges.
+    bool unitRangesIndexed;
+    void indexUnitRanges();
+    // Decoded expressions, by section and offset in it.
+    mutable std::map<std::pair<const ElfSection *, Elf_Off>, DwarfExpression> expressions;
+    mutable std::mutex expressionsLock; // protects expressions.
 
 public:
     std::shared_ptr<const ElfSection> info;
@@ -335,27 +521,134 @@ private:
     std::shared_ptr<ElfObject> altImage;
     std::shared_ptr<DwarfInfo> altDwarf;
     bool altImageLoaded;
+    std::recursive_mutex altLock;
+    bool canDecodeInParallel() const;
+    void decodeUnits(const std::vector<Elf_Off> &offsets);
+    // The offset of every unit, in order, found from their headers alone.
+    std::vector<Elf_Off> unitOffsets;
+    bool unitOffsetsScanned; // protected by unitsLock.
+    // .debug_str, and the call frame information, are loaded on first use.
+    std::unique_ptr<char[]> debugStringsBuf;
+    std::atomic<const char *> debugStrings;
+    std::unique_ptr<DwarfFrameInfo> debugFrame;
+    std::unique_ptr<DwarfFrameInfo> ehFrame;
+    std::atomic<bool> debugFrameLoaded;
+    std::atomic<bool> ehFrameLoaded;
+    std::mutex loadLock; // serializes loading the above.
+    std::unique_ptr<DwarfFrameInfo> loadFrameInfo(std::shared_ptr<const ElfSection>, FIType);
 public:
-    char *debugStrings;
+    const char *getDebugStrings();
+    const char *getDebugString(Elf_Off offset);
+    DwarfFrameInfo *getDebugFrame();
+    DwarfFrameInfo *getEhFrame();
 
     std::shared_ptr<ElfObject> getAltImage();
     std::shared_ptr<DwarfInfo> getAltDwarf();
-    std::map<Elf_Addr, DwarfCallFrame> callFrameForAddr;
-    std::shared_ptr<const ElfSection> abbrev, lineshdr;
+    std::shared_ptr<const ElfSection> abbrev, lineshdr, rangesh;
 
     std::shared_ptr<ElfObject> elf;
+    // Entries, line tables and call frames are decoded on demand. Threads
+    // sharing a DwarfInfo hold this while they look up or walk any of them.
+    std::recursive_mutex lock;
     std::list<DwarfARangeSet> &ranges();
     std::list<DwarfPubnameUnit> &pubnames();
     std::shared_ptr<DwarfUnit> getUnit(off_t offset);
+    // The unit whose extent in .debug_info includes "offset".
+    std::shared_ptr<DwarfUnit> unitContaining(Elf_Off offset);
     std::list<std::shared_ptr<DwarfUnit>> getUnits();
-    std::unique_ptr<DwarfFrameInfo> debugFrame;
-    std::unique_ptr<DwarfFrameInfo> ehFrame;
+    std::list<std::shared_ptr<DwarfUnit>> unitsForAddr(uintmax_t addr);
+    DwarfEntry *functionForAddr(uintmax_t addr, uintmax_t *start = 0);
     DwarfInfo(std::shared_ptr<ElfObject> object);
     std::vector<std::pair<const DwarfFileEntry *, int>> sourceFromAddr(uintmax_t addr);
+    // The expression at "off" in "sec", decoded on first use.
+    const DwarfExpression &expression(const std::shared_ptr<const ElfSection> &sec, Elf_Off off, Elf_Off len) const;
     ~DwarfInfo();
     bool hasRanges() { return arangesh || aranges.size() != 0; }
+    // The on-disk index for this object, if we are using one.
+    std::unique_ptr<DwarfIndex> index;
+    // Number of threads getUnits() uses to decode units. 0 means one per CPU.
+    static unsigned unitThreads;
+};
+
+/*
+ * A persistent index of an object's FDEs, function ranges, line table
+ * rows and function symbols. Each is a table of address ranges, sorted by
+ * start address, that we can search directly in the mapped file. Index
+ * files live in "dwarfIndexDirectory", and are named for the GNU build ID
+ * of the object.
+ */
+extern std::string dwarfIndexDirectory;
+
+struct DwarfIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t fdeTables; // bit "1 << FIType" set if we have a table of that type
+    uint64_t fdeCount[2];
+    uint64_t functionCount;
+    uint64_t lineCount;
+    uint64_t fileCount;
+    uint64_t stringsSize;
+    uint64_t symbolCount[2][2]; // by table, then sized and sizeless.
+};
+
+struct DwarfIndexFDE {
+    uint64_t start;
+    uint64_t end; // one past the end: FDE lookups include the "end" address.
+    uint64_t maxEnd;
+    uint64_t offset;
+};
+
+struct DwarfIndexFunction {
+    uint64_t start;
+    uint64_t end;
+    uint64_t maxEnd;
+    uint64_t unit;
+    uint64_t entry;
 };
 
+struct DwarfIndexLine {
+    uint64_t start;
+    uint64_t end;
+    uint64_t maxEnd;
+    uint64_t order; // unit and row, to report multiple matches in order.
+    uint32_t file;
+    uint32_t line;
+};
+
+// A function symbol, by its position in .symtab or .dynsym.
+struct DwarfIndexSymbol {
+    uint64_t start;
+    uint64_t end;
+    uint64_t maxEnd;
+    uint64_t index;
+};
+
+struct DwarfIndexFile {
+    uint32_t directory; // offsets into the string table.
+    uint32_t name;
+};
+
+class DwarfIndex {
+    DwarfIndex(const DwarfIndex &) = delete;
+    std::shared_ptr<Reader> io;
+    const DwarfIndexHeader *header;
+    const DwarfIndexFDE *fdes[2];
+    const DwarfIndexFunction *functions;
+    const DwarfIndexLine *lines;
+    const DwarfIndexSymbol *symbols[2][2];
+    std::vector<DwarfFileEntry> files;
+public:
+    DwarfIndex(std::shared_ptr<Reader>, size_t size);
+    bool hasFDEs(FIType type) const { return header->fdeTables & (1 << type); }
+    bool fdeForAddr(FIType, uintmax_t addr, Elf_Off &offset) const;
+    bool functionForAddr(uintmax_t addr, Elf_Off &unit, Elf_Off &entry, uintmax_t &start) const;
+    void sourceFromAddr(uintmax_t addr, std::vector<std::pair<const DwarfFileEntry *, int>> &) const;
+    void restoreSymbols(ElfObject &) const;
+};
+
+std::unique_ptr<DwarfIndex> loadDwarfIndex(DwarfInfo &);
+void writeDwarfIndex(DwarfInfo &, const std::string &path);
+
 const DwarfAbbreviation *dwarfUnitGetAbbrev(const DwarfUnit *unit, intmax_t code);
 const char *dwarfSOpcodeName(enum DwarfLineSOpcode code);
 const char *dwarfEOpcodeName(enum DwarfLineEOpcode code);
@@ -408,7 +701,37 @@ enum DwarfCFAInstruction {
 class DWARFReader {
     Elf_Off off;
     Elf_Off end;
+    // If the underlying data is resident in memory, "data" points at it, and
+    // primitives are decoded directly from there rather than through "io".
+    const unsigned char *data;
+    Elf_Off dataLen;
+    // For a compressed section, "data" covers only what we've needed so far,
+    // and grows as we read on, up to "mappable", so the section is inflated
+    // only as far as it's read.
+    Elf_Off mappable;
+    bool grow(Elf_Off need);
+    bool resident(size_t len) {
+        return off + len <= dataLen || (off + len <= mappable && grow(off + len));
+    }
     uintmax_t getuleb128shift(int *shift, bool &isSigned);
+    const unsigned char *span(size_t len) {
+        if (!resident(len))
+            return 0;
+        auto p = data + off;
+        off += len;
+        return p;
+    }
+    void mapSection(const ElfSection &section) {
+        if (section->sh_flags & SHF_COMPRESSED) {
+            data = 0;
+            dataLen = 0;
+            mappable = section.getSize();
+        } else {
+            data = (const unsigned char *)section.io->view(0, section.getSize());
+            dataLen = data ? section.getSize() : 0;
+            mappable = 0;
+        }
+    }
 public:
     std::shared_ptr<Reader> io;
     unsigned addrLen;
@@ -416,6 +739,9 @@ public:
     DWARFReader(DWARFReader &rhs, Elf_Off off_, Elf_Word size_)
         : off(off_)
         , end(off_ + size_)
+        , data(rhs.data)
+        , dataLen(rhs.dataLen)
+        , mappable(rhs.mappable)
         , io(rhs.io)
         , addrLen(ELF_BITS / 8)
     {
@@ -427,6 +753,7 @@ public:
         , io(section->io)
         , addrLen(ELF_BITS / 8)
     {
+        mapSection(*section);
     }
 
     DWARFReader(std::shared_ptr<const ElfSection> section)
@@ -435,6 +762,7 @@ public:
         , io(section->io)
         , addrLen(ELF_BITS / 8)
     {
+        mapSection(*section);
     }
 
 
@@ -447,6 +775,7 @@ public:
     uintmax_t getuleb128();
     intmax_t getsleb128();
     std::string getstring();
+    const char *viewstring();
     Elf_Off getOffset() { return off; }
     Elf_Off getLimit() { return end; }
     void setOffset(Elf_Off off_) { off = off_; }
@@ -455,13 +784,6 @@ public:
     void skip(Elf_Off amount) { off += amount; }
 };
 
-#define DWARF_OP(op, value, args) op = value,
-enum DwarfExpressionOp {
-#include <libpstack/dwarf/ops.h>
-    LASTOP = 0x100
-};
-#undef DWARF_OP
-
 #define DW_EH_PE_absptr 0x00
 #define DW_EH_PE_uleb128        0x01
 #define DW_EH_PE_udata2 0x02
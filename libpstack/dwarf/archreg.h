@@ -2,6 +2,7 @@
 #ifdef __i386__
 #define IPREG 8
 #define CFA_RESTORE_REGNO 4
+#define FPREG 5
 REGMAP(1, eax)
 REGMAP(2, ecx)
 REGMAP(3, ebx)
@@ -21,6 +22,7 @@ REGMAP(14, xfs)
 #ifdef __amd64__
 #define CFA_RESTORE_REGNO 7
 #define IPREG 16
+#define FPREG 6
 REGMAP(0, rax)
 REGMAP(1, rdx)
 REGMAP(2, rcx)
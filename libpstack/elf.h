@@ -40,6 +40,7 @@ extern bool noDebugLibs;
 #include <vector>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <elf.h>
 #include <sys/procfs.h>
 #include <libpstack/util.h>
@@ -120,6 +121,7 @@ roundup2(size_t val, size_t align)
 #endif
 
 class ElfSymHash;
+class ElfGnuHash;
 struct SymbolSection;
 
 class ElfSection {
@@ -137,6 +139,36 @@ public:
 
 struct ElfNoteIter;
 
+// The address range of a symbol, for the sorted index of a symbol table.
+struct ElfSymbolRange {
+    Elf_Addr start;
+    Elf_Addr end;
+    Elf_Addr maxEnd; // the highest "end" of this and all preceding ranges.
+    Elf_Word index; // the symbol's position in its table.
+    ElfSymbolRange(Elf_Addr start_, Elf_Addr end_, Elf_Word index_)
+        : start(start_), end(end_), maxEnd(end_), index(index_) {}
+};
+
+/*
+ * The symbols of one table, and of one type, that findSymbolByAddress will
+ * consider, sorted by address. Symbols with no size are kept apart, as they
+ * only match if nothing else does.
+ */
+struct ElfSymbolIndex {
+    std::vector<ElfSymbolRange> sized;
+    std::vector<ElfSymbolRange> sizeless;
+};
+
+// The address range of a PT_LOAD segment, for findHeaderForAddress.
+struct ElfSegmentRange {
+    Elf_Addr start;
+    Elf_Addr end;
+    Elf_Addr maxEnd; // the highest "end" of this and all preceding ranges.
+    size_t index; // the segment's position in the PT_LOAD headers.
+    ElfSegmentRange(Elf_Addr start_, Elf_Addr end_, size_t index_)
+        : start(start_), end(end_), maxEnd(end_), index(index_) {}
+};
+
 struct ElfNotes {
    ElfNoteIter begin() const;
    ElfNoteIter end() const;
@@ -154,13 +186,22 @@ private:
     size_t fileSize;
     Elf_Ehdr elfHeader;
     std::map<Elf_Word, ProgramHeaders> programHeaders;
+    // PT_LOAD segments, sorted by address.
+    std::vector<ElfSegmentRange> loadSegments;
     std::unique_ptr<ElfSymHash> hash;
+    std::unique_ptr<ElfGnuHash> gnuHash;
+    // Address indexes of symbol tables, by table and symbol type.
+    std::map<std::pair<std::string, int>, ElfSymbolIndex> symbolIndexes;
+    std::mutex symbolLock; // protects symbolIndexes.
+    const ElfSymbolIndex &symbolIndex(const std::string &table,
+            std::shared_ptr<const ElfSection> symSection, int type);
     void init(const std::shared_ptr<Reader> &); // want constructor chaining
     std::map<std::string, std::shared_ptr<ElfSection>> namedSection;
 
     std::string name;
     bool debugLoaded;
     std::shared_ptr<ElfObject> debugObject;
+    std::mutex debugLock; // protects debugLoaded and debugObject.
 public:
     std::shared_ptr<ElfObject> getDebug();
     static std::shared_ptr<ElfObject> getDebug(std::shared_ptr<ElfObject> &);
@@ -182,6 +223,10 @@ public:
     std::shared_ptr<const ElfSection> getSection(const std::string &name, Elf_Word type) const;
     const Elf_Ehdr &getElfHeader() const { return elfHeader; }
     bool findSymbolByAddress(Elf_Addr addr, int type, Elf_Sym &, std::string &);
+    // The address index findSymbolByAddress uses for a table, or null if
+    // there's no such table. setSymbolIndex supplies one built earlier.
+    const ElfSymbolIndex *getSymbolIndex(const std::string &table, int type);
+    void setSymbolIndex(const std::string &table, int type, ElfSymbolIndex &&);
     bool findSymbolByName(const std::string &name, Elf_Sym &sym);
     ElfObject(std::shared_ptr<Reader>);
     ~ElfObject();
@@ -206,10 +251,11 @@ struct SymbolSection {
     std::shared_ptr<const ElfSection> symbols;
     std::shared_ptr<const ElfSection> strings;
     SymbolIterator begin() { return SymbolIterator(this, 0); }
-    SymbolIterator end() { return SymbolIterator(this, symbols->getSize()); }
+    // A missing (or stripped) table has no symbols.
+    SymbolIterator end() { return SymbolIterator(this, symbols ? symbols->getSize() : 0); }
     SymbolSection(ElfObject &elf, std::shared_ptr<const ElfSection> symbols_)
         : symbols(symbols_)
-        , strings(elf.getSection((*symbols)->sh_link))
+        , strings(symbols ? elf.getSection((*symbols)->sh_link) : 0)
     {}
 };
 
@@ -227,6 +273,30 @@ public:
     bool findSymbol(Elf_Sym &sym, const std::string &name);
 };
 
+/*
+ * The GNU-style hash table in .gnu.hash. A bloom filter lets us reject
+ * most names without touching the buckets, and the chains hold the hash of
+ * each symbol, so we only read the names of likely matches. It covers only
+ * the defined symbols, from "symoffset" onwards in the dynamic symbol table.
+ */
+class ElfGnuHash {
+    std::shared_ptr<const ElfSection> hash;
+    std::shared_ptr<const ElfSection> syms;
+    std::shared_ptr<const ElfSection> strings;
+    Elf_Word nbucket;
+    Elf_Word symoffset;
+    Elf_Word bloomSize;
+    Elf_Word bloomShift;
+    size_t nchain;
+    std::vector<Elf_Word> data;
+    const Elf_Addr *bloom;
+    const Elf_Word *buckets;
+    const Elf_Word *chains;
+public:
+    ElfGnuHash(std::shared_ptr<const ElfSection> &hash, std::shared_ptr<const ElfSection> &syms, std::shared_ptr<const ElfSection> &strings_);
+    bool findSymbol(Elf_Sym &sym, const std::string &name);
+};
+
 // These are the architecture specific types representing the NT_PRSTATUS registers.
 #if defined(__ARM_ARCH)
 struct CoreRegisters {
@@ -241,18 +311,11 @@ typedef struct user_regs_struct CoreRegisters;
 class ElfNoteDesc {
    Elf_Note note;
    std::shared_ptr<Reader> io;
-   mutable unsigned char *databuf;
+   // The payload is viewed in place if the reader is mapped. Otherwise we
+   // read it once, and copies of the descriptor share the buffer.
+   mutable const unsigned char *dataptr;
+   mutable std::shared_ptr<std::vector<unsigned char>> databuf;
 public:
-   ElfNoteDesc(const ElfNoteDesc &rhs)
-      : note(rhs.note)
-      , io(rhs.io)
-      , databuf(0)
-   {
-      if (rhs.databuf) {
-         databuf = new unsigned char[rhs.size()];
-         memcpy(databuf, rhs.databuf, rhs.size());
-      }
-   }
    std::string name() const;
    const unsigned char *data() const;
    size_t size() const;
@@ -260,11 +323,8 @@ public:
    ElfNoteDesc(const Elf_Note &n, std::shared_ptr<Reader> io_)
       : note(n)
       , io(io_)
-      , databuf(0)
+      , dataptr(0)
    {}
-   ~ElfNoteDesc() {
-      delete[] databuf;
-   }
 };
 
 struct ElfNoteIter {
@@ -334,6 +394,8 @@ class GlobalDebugDirectories {
 public:
     std::vector<std::string> dirs;
     void add(const std::string &);
+    // Forget the debug images we failed to find, so we look for them again.
+    void forgetMissing();
     GlobalDebugDirectories();
 };
 extern GlobalDebugDirectories globalDebugDirectories;
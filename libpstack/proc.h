@@ -1,64 +1,140 @@
 #include <elf.h>
+#include <sys/types.h>
 extern "C" {
 #include <thread_db.h>
 }
 #include <libpstack/ps_callback.h>
 #include <libpstack/dwarf.h>
 #include <map>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <functional>
+#include <unordered_map>
 #include <bitset>
 
 struct ps_prochandle {};
 
 class Process;
+
+/*
+ * Images, and their DWARF information, shared between processes. Images
+ * loaded from files are known by the identity of the file, so processes
+ * using the same libraries load and parse each one only once.
+ */
+class ImageCache {
+    struct FileId {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        time_t mtime;
+        long mtimeNsec;
+        bool operator < (const FileId &rhs) const;
+    };
+    std::map<FileId, std::shared_ptr<ElfObject>> images;
+    std::set<const ElfObject *> shared;
+    std::map<std::shared_ptr<ElfObject>, std::unique_ptr<DwarfInfo>> dwarf;
+    mutable std::mutex lock; // protects all the above.
+public:
+    ~ImageCache();
+    // Find the image for "path", calling "load" to create it if we need to.
+    std::shared_ptr<ElfObject> getImage(const std::string &path,
+            const std::function<std::shared_ptr<ElfObject>()> &load);
+    std::shared_ptr<ElfObject> getImageForName(const std::string &path);
+    bool isShared(const std::shared_ptr<ElfObject> &obj) const;
+    void release(std::shared_ptr<ElfObject> elf);
+    DwarfInfo *getDwarf(const std::shared_ptr<ElfObject> &);
+};
 struct StackFrame;
 
-class DwarfExpressionStack : public std::stack<Elf_Addr> {
+/*
+ * Evaluates decoded DWARF expressions. The stack has a fixed capacity, far
+ * deeper than any expression a compiler emits, so evaluating one allocates
+ * nothing.
+ */
+class DwarfExpressionStack {
+    static const size_t maxDepth = 64;
+    Elf_Addr values[maxDepth];
+    size_t depth;
+    Elf_Addr eval(const Process &, const DwarfOp *begin, const DwarfOp *end, const StackFrame *frame);
 public:
     bool isReg;
     int inReg;
-    Elf_Addr poptop() { Elf_Addr tos = top(); pop(); return tos; }
-    DwarfExpressionStack(): isReg(false) {}
-    Elf_Addr eval(const Process &, DWARFReader &r, const StackFrame *frame);
+    const Reader *memory; // if set, where to read memory, rather than the process's "io"
+    // The frame's DW_AT_frame_base, once we've evaluated it. It's the same
+    // for every expression we evaluate in the frame.
+    bool haveFrameBase;
+    Elf_Addr frameBase;
+    void push(Elf_Addr value) {
+        if (depth == maxDepth)
+            throw Exception() << "DWARF expression stack overflow";
+        values[depth++] = value;
+    }
+    Elf_Addr poptop() {
+        if (depth == 0)
+            throw Exception() << "DWARF expression stack underflow";
+        return values[--depth];
+    }
+    bool empty() const { return depth == 0; }
+    void clear() { depth = 0; }
+    DwarfExpressionStack(const Reader *memory_ = 0)
+        : depth(0), isReg(false), memory(memory_), haveFrameBase(false), frameBase(0) {}
+    Elf_Addr eval(const Process &, const DwarfExpression &, const StackFrame *frame);
     Elf_Addr eval(const Process &, const DwarfAttribute *, const StackFrame *);
 };
 
 struct StackFrame {
     Elf_Addr ip;
     Elf_Addr cfa;
-    std::map<unsigned, uintmax_t> regs;
-    DwarfInfo *dwarf;
-    DwarfEntry * function;
+    // Registers by DWARF number, and which of them we have values for.
+    uintmax_t regs[DWARF_MAXREG];
+    std::bitset<DWARF_MAXREG> haveRegs;
+    // The function, and the DwarfInfo holding on to it: set in printing.
+    mutable DwarfInfo *dwarf;
+    mutable DwarfEntry * function;
     DwarfFrameInfo *frameInfo;
     const DwarfFDE *fde;
     StackFrame()
         : ip(-1)
         , cfa(0)
+        , regs()
         , dwarf(0)
         , function(0)
         , frameInfo(0)
         , fde(0)
     {}
-    void setReg(unsigned regno, uintmax_t value);
-    uintmax_t getReg(unsigned regno) const;
-    Elf_Addr getCFA(const Process &proc, const DwarfCallFrame &cfi) const;
-    StackFrame *unwind(Process &p);
+    void setReg(unsigned regno, uintmax_t value) {
+        if (regno < DWARF_MAXREG) {
+            regs[regno] = value;
+            haveRegs.set(regno);
+        }
+    }
+    uintmax_t getReg(unsigned regno) const {
+        return regno < DWARF_MAXREG && haveRegs[regno] ? regs[regno] : 0;
+    }
+    Elf_Addr getCFA(const Process &proc, const DwarfCallFrame &cfi, const Reader &memory) const;
+    // Find the caller's frame, and update ours with what we learn doing so.
+    bool unwind(Process &p, const Reader &memory, StackFrame &caller);
+    bool unwindFP(const Reader &memory, StackFrame &caller);
     void setCoreRegs(const CoreRegisters &core);
     void getCoreRegs(CoreRegisters &core) const;
     void getFrameBase(const Process &p, intmax_t offset, DwarfExpressionStack *stack) const;
 };
 
+// How to find each frame's caller.
+enum UnwindStrategy {
+    UNWIND_CFI, // use DWARF call frame information only.
+    UNWIND_FP, // follow the chain of saved frame pointers.
+    UNWIND_CFI_FP, // use CFI, following frame pointers for code without any.
+};
+
 struct ThreadStack {
     td_thrinfo_t info;
-    std::vector<StackFrame *> stack;
-    ThreadStack() {}
-    ~ThreadStack() {
-        for (auto i = stack.begin(); i != stack.end(); ++i)
-            delete *i;
-    }
-    void unwind(Process &, CoreRegisters &regs);
+    std::vector<StackFrame> stack;
+    // Unwind from "regs", reading the stack from "memory" if we have it,
+    // e.g. a copy taken earlier, rather than the process.
+    void unwind(Process &, CoreRegisters &regs, UnwindStrategy strategy = UNWIND_CFI,
+            const Reader *memory = 0);
 };
 
 
@@ -67,6 +143,8 @@ public:
     enum PstackOption {
         nosrc,
         doargs,
+        groupstacks,
+        json,
         maxopt
     };
     void operator += (PstackOption);
@@ -79,14 +157,76 @@ typedef std::vector<std::pair<std::string, std::string>> PathReplacementList;
 class Process : public ps_prochandle {
     Elf_Addr findRDebugAddr();
     Elf_Off entry; // entrypoint of process.
-    void loadSharedObjects(Elf_Addr);
+    bool loadSharedObjects(Elf_Addr);
     char *vdso;
     bool isStatic;
+    Elf_Addr rDebugAddr;
+    // An entry in the rtld's link map, as we last read it.
+    struct LinkMapEntry {
+        Elf_Addr map; // the address of the link_map.
+        Elf_Addr addr; // its l_addr
+        Elf_Addr name; // and l_name.
+        std::shared_ptr<ElfObject> object; // null if we couldn't load it.
+        LinkMapEntry(Elf_Addr map_, Elf_Addr addr_, Elf_Addr name_) : map(map_), addr(addr_), name(name_) {}
+        bool operator == (const LinkMapEntry &rhs) const
+            { return map == rhs.map && addr == rhs.addr && name == rhs.name; }
+    };
+    std::vector<LinkMapEntry> linkMap;
     Elf_Addr sysent; // for AT_SYSINFO
-    std::map<std::shared_ptr<ElfObject>, DwarfInfo *> dwarf;
+    std::map<std::shared_ptr<ElfObject>, DwarfInfo *> dwarf; // for images not in imageCache
+    std::mutex dwarfLock; // protects dwarf.
+
+    // A PT_LOAD segment of a loaded object, at its address in the process.
+    struct MappedSegment {
+        Elf_Addr start;
+        Elf_Addr end;
+        Elf_Addr maxEnd; // the highest "end" of this and all preceding ranges.
+        size_t object; // index in "objects"
+        const Elf_Phdr *phdr;
+        MappedSegment(Elf_Addr start_, Elf_Addr end_, size_t object_, const Elf_Phdr *phdr_)
+            : start(start_), end(end_), maxEnd(end_), object(object_), phdr(phdr_) {}
+    };
+    // The segments of all loaded objects, sorted by address, rebuilt on
+    // demand after objects are added.
+    mutable std::vector<MappedSegment> addressSpace;
+    mutable bool addressSpaceIndexed;
+    void indexAddressSpace() const;
+    std::shared_ptr<CacheReader> memoryCache; // the cache "io" starts as.
+    std::shared_ptr<Reader> memory; // the process's memory, without "memoryCache".
+
+public:
+    // What we print for the code at an instruction address in a stack.
+    struct FrameSymbol {
+        std::string fileName; // empty if no object contains the address.
+        std::string symName; // empty if we found no name at all.
+        DwarfEntry *function; // the function's DIE, if there's debug info.
+        DwarfInfo *dwarf; // the DwarfInfo containing "function".
+        Elf_Addr offset; // of the address from the start of the function.
+        bool sourced; // if we looked for "source".
+        std::vector<std::pair<std::string, int>> source; // path, line
+        FrameSymbol() : function(0), dwarf(0), offset(0), sourced(false) {}
+    };
+    // What we need to print a parameter of a function with -a.
+    struct FunctionArg {
+        std::string name;
+        const DwarfEntry *type; // with any typedefs resolved, or null.
+        const DwarfAttribute *location;
+        size_t size; // of the value in memory, or 0 if we don't know.
+        FunctionArg() : type(0), location(0), size(0) {}
+    };
+    typedef std::vector<FunctionArg> FunctionArgs;
+    // The parameters of "function", found once for each function.
+    const FunctionArgs &functionArgs(const DwarfEntry *function) const;
+private:
+    std::unordered_map<Elf_Addr, std::shared_ptr<const FrameSymbol>> symbols;
+    std::mutex symbolLock; // protects symbols.
+    void forgetSymbols();
+    mutable std::unordered_map<const DwarfEntry *, FunctionArgs> args;
+    mutable std::mutex argsLock; // protects args.
 
 protected:
     td_thragent_t *agent;
+    ImageCache &imageCache;
     std::shared_ptr<ElfObject> execImage;
     std::string abiPrefix;
     PathReplacementList pathReplacements;
@@ -103,10 +243,21 @@ public:
     std::shared_ptr<Reader> io;
 
     virtual bool getRegs(lwpid_t pid, CoreRegisters *reg) = 0;
+    virtual bool getFPRegs(lwpid_t, prfpregset_t *) { return false; }
     void addElfObject(std::shared_ptr<ElfObject> obj, Elf_Addr load);
     std::shared_ptr<ElfObject> findObject(Elf_Addr addr, Elf_Off *reloc) const;
+    const LoadedObject *findSegment(Elf_Addr addr, const Elf_Phdr **phdr) const;
     DwarfInfo *getDwarf(std::shared_ptr<ElfObject>, bool debug = true);
-    Process(std::shared_ptr<ElfObject> obj, std::shared_ptr<Reader> mem, const PathReplacementList &prl);
+    // Forget the process memory we've cached, before reading it afresh.
+    void flushMemory() { memoryCache->flush(); }
+    // How much of a thread's stack to read in one go before unwinding it.
+    static size_t stackPrefetch;
+    void prefetchStack(Elf_Addr sp, SnapshotReader &stack);
+    void loadUnwindInfo();
+    // Find all our objects' debug images at once, rather than as we need them.
+    static unsigned debugPrefetchThreads;
+    void prefetchDebugImages();
+    Process(std::shared_ptr<ElfObject> obj, std::shared_ptr<Reader> mem, const PathReplacementList &prl, ImageCache &);
     virtual void stop(pid_t lwpid) = 0;
     virtual void stopProcess() = 0;
 
@@ -114,11 +265,18 @@ public:
     virtual void resume(pid_t lwpid) = 0;
     virtual pid_t getPID() const = 0;
     std::ostream &dumpStackText(std::ostream &, const ThreadStack &, const PstackOptions &);
-    std::ostream &dumpStackJSON(std::ostream &, const ThreadStack &);
+    std::ostream &dumpFramesText(std::ostream &, const ThreadStack &, const PstackOptions &);
+    std::shared_ptr<const FrameSymbol> symbolize(Elf_Addr ip, bool withSource);
+    void dumpStackJSON(JsonWriter &, const ThreadStack &, const PstackOptions &);
     template <typename T> void listThreads(const T &);
     Elf_Addr findNamedSymbol(const char *objectName, const char *symbolName) const;
     ~Process();
     virtual void load();
+    // Bring our objects up to date after the process loads or unloads
+    // libraries, loading only the new ones. Returns false if nothing
+    // changed, or the loader is changing the link map as we look. This
+    // reads through "io", so flush it first if it caches memory.
+    virtual bool refresh();
 };
 
 template <typename T> int
@@ -135,19 +293,24 @@ Process::listThreads(const T &callback)
 
 struct ThreadInfo {
     int stopCount;
-    ThreadInfo() : stopCount(0) {}
+    bool seized; // stopped with PTRACE_SEIZE rather than PT_ATTACH
+    int signal; // a signal it stopped for, to deliver when we detach
+    ThreadInfo() : stopCount(0), seized(false), signal(0) {}
 };
 
 class LiveReader : public FileReader {
     pid_t pid;
     std::string base;
-    static std::string procname(pid_t, const std::string &base);
 public:
+    static std::string procname(pid_t, const std::string &base);
     static std::shared_ptr<Reader> procfile(pid_t, const std::string &base);
     virtual std::string describe() const {
         return linkResolve(procname(pid, base));
     }
     LiveReader(pid_t pid_, const std::string &base_) : FileReader(procname(pid_, base_)), pid(pid_), base(base_) {}
+    virtual size_t read(off_t off, size_t count, char *ptr) const;
+    using Reader::readv;
+    virtual void readv(ReadReq *reqs, size_t nreqs) const;
 };
 
 struct LiveThreadList;
@@ -159,8 +322,9 @@ class LiveProcess : public Process {
     timeval start;
     std::set<pid_t> lwps; // lwps we could not suspend.
     friend class StopLWP;
+    bool seizeProcess();
 public:
-    LiveProcess(std::shared_ptr<ElfObject> ex, pid_t pid, const PathReplacementList &repls);
+    LiveProcess(std::shared_ptr<ElfObject> ex, pid_t pid, const PathReplacementList &repls, ImageCache &);
     virtual bool getRegs(lwpid_t pid, CoreRegisters *reg);
     virtual void stop(pid_t lwpid);
     virtual void resume(pid_t lwpid);
@@ -183,9 +347,20 @@ public:
 class CoreProcess : public Process {
     std::shared_ptr<ElfObject> coreImage;
     friend class CoreReader;
+    // The notes we use from the core, found once when we load it. Each
+    // thread's NT_FPREGSET follows its NT_PRSTATUS.
+    std::map<lwpid_t, ElfNoteDesc> prstatus;
+    std::map<lwpid_t, ElfNoteDesc> fpregs;
+    std::unique_ptr<ElfNoteDesc> auxv;
+    std::unique_ptr<ElfNoteDesc> files;
+    pid_t pid;
+    void indexNotes();
 public:
-    CoreProcess(std::shared_ptr<ElfObject> exec, std::shared_ptr<ElfObject> core, const PathReplacementList &);
+    CoreProcess(std::shared_ptr<ElfObject> exec, std::shared_ptr<ElfObject> core, const PathReplacementList &, ImageCache &);
     virtual bool getRegs(lwpid_t pid, CoreRegisters *reg);
+    virtual bool getFPRegs(lwpid_t pid, prfpregset_t *reg);
+    // The NT_FILE note, describing the files mapped into the process.
+    const ElfNoteDesc *mappedFiles() const { return files.get(); }
     virtual void stop(lwpid_t);
     virtual void resume(lwpid_t);
     virtual pid_t getPID() const;
@@ -194,6 +369,52 @@ public:
     virtual void load();
 };
 
+/*
+ * A thread's registers, and a copy of the top of its stack, taken by
+ * SelfProcess as the thread ran, to unwind and symbolize later.
+ */
+struct StackCapture {
+    lwpid_t lwp;
+    bool captured; // false if the thread didn't answer in time.
+    CoreRegisters regs;
+    Elf_Addr sp;
+    std::vector<char> stack; // the bytes from sp up.
+    StackCapture() : lwp(0), captured(false), sp(0) {}
+};
+
+/*
+ * The process we're running in, for programs that want their own stacks.
+ * We read our memory directly, without stopping anything, and keep the
+ * objects we've loaded and their DWARF information between captures.
+ * Capturing stacks is cheap, and safe in any thread: unwinding and
+ * symbolizing them is the caller's to do when it likes, but not while
+ * another thread calls refresh().
+ */
+class SelfProcess : public Process {
+    unsigned long long adds, subs; // dl_iterate_phdr's counts when we last read the link map.
+public:
+    SelfProcess(const PathReplacementList &, ImageCache &);
+    virtual bool getRegs(lwpid_t, CoreRegisters *) { return false; }
+    virtual void stop(lwpid_t) { }
+    virtual void resume(lwpid_t) { }
+    virtual pid_t getPID() const;
+    void stopProcess() { }
+    void resumeProcess() { }
+    virtual void load();
+    // As Process::refresh, but only reread the link map if the loader's
+    // counts of objects loaded and unloaded have changed.
+    virtual bool refresh();
+    // The signal we interrupt other threads with to capture their stacks.
+    static int captureSignal;
+    // How long to wait for other threads to answer, in microseconds.
+    static long captureTimeout;
+    // Capture the calling thread's stack.
+    void capture(StackCapture &);
+    // Capture the stacks of all the process's threads.
+    void captureAll(std::vector<StackCapture> &);
+    void unwind(const StackCapture &, ThreadStack &, UnwindStrategy strategy = UNWIND_CFI);
+};
+
 // RAII to stop a process.
 struct StopProcess {
     Process *proc;
@@ -5,14 +5,23 @@
 #define LIBPSTACK_UTIL_H
 
 
+#include <atomic>
+#include <chrono>
 #include <exception>
+#include <functional>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
+#include <stdint.h>
 #include <stdio.h>
 #include <string>
 #include <string.h>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
 
 std::string dirname(const std::string &);
 
@@ -46,6 +55,114 @@ inline const E &operator << (const E &stream, const Object &o) {
 
 extern std::ostream *debug;
 extern int verbose;
+
+/*
+ * Call "work" with each number from 0 to "count", and the number of the
+ * thread it's on, on a pool of "threads" threads that includes the caller
+ * (0 means one per CPU). Once all are done, if any calls failed, rethrow
+ * the exception from the lowest numbered.
+ */
+void parallelFor(size_t count, size_t threads, const std::function<void(size_t, size_t)> &work);
+
+/*
+ * Named counters and timers, to see where the time goes. Adding to them
+ * does nothing unless statsEnabled is set, which should happen before we
+ * start work. Each lives until exit, so callers can keep a reference rather
+ * than look it up by name each time.
+ */
+extern bool statsEnabled;
+class Stats {
+public:
+    typedef std::atomic<uint64_t> Value;
+    static Value &counter(const std::string &name);
+    static Value &timer(const std::string &name); // in nanoseconds
+    static void add(Value &stat, uint64_t n = 1) {
+        if (statsEnabled)
+            stat.fetch_add(n, std::memory_order_relaxed);
+    }
+    static void report(std::ostream &os, bool json);
+};
+
+class Reader;
+
+// Adds the time it exists for to a timer.
+class StatTimer {
+    Stats::Value *total;
+    std::chrono::steady_clock::time_point start;
+public:
+    StatTimer(Stats::Value &total_) : total(statsEnabled ? &total_ : 0) {
+        if (total)
+            start = std::chrono::steady_clock::now();
+    }
+    // Time "what" for the content of "subject", e.g., a phase of work on
+    // one object. We only describe the subject if stats are enabled.
+    StatTimer(const char *what, const Reader &subject);
+    ~StatTimer() {
+        if (total)
+            total->fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Builds JSON text in a buffer, formatting strings and numbers itself rather
+ * than through an ostream, and writes the buffer to "os" only when flushed.
+ * Separators between members and elements are added as needed.
+ */
+class JsonWriter {
+    std::ostream &os;
+    std::string buf;
+    bool needSep;
+    void sep() {
+        if (needSep)
+            buf += ',';
+        needSep = false;
+    }
+    void string(const char *s, size_t len);
+    void signedNumber(intmax_t);
+    void unsignedNumber(uintmax_t);
+public:
+    explicit JsonWriter(std::ostream &os_) : os(os_), needSep(false) {}
+    ~JsonWriter() { flush(); }
+    JsonWriter &beginObject() { sep(); buf += '{'; return *this; }
+    JsonWriter &endObject() { buf += '}'; needSep = true; return *this; }
+    JsonWriter &beginArray() { sep(); buf += '['; return *this; }
+    JsonWriter &endArray() { buf += ']'; needSep = true; return *this; }
+    JsonWriter &key(const char *name) {
+        sep();
+        string(name, strlen(name));
+        buf += ':';
+        return *this;
+    }
+    JsonWriter &value(const std::string &s) { sep(); string(s.data(), s.size()); needSep = true; return *this; }
+    JsonWriter &value(const char *s) { sep(); string(s, strlen(s)); needSep = true; return *this; }
+    JsonWriter &value(bool b) { sep(); buf += b ? "true" : "false"; needSep = true; return *this; }
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, JsonWriter &>::type value(T n) {
+        sep();
+        if (std::is_signed<T>::value)
+            signedNumber(n);
+        else
+            unsignedNumber(n);
+        needSep = true;
+        return *this;
+    }
+    // End a top-level value with a newline, to write one per line.
+    JsonWriter &endLine() { buf += '\n'; needSep = false; return *this; }
+    void flush();
+};
+
+// One element of a batched read: "rc" is set to the number of bytes read.
+struct ReadReq {
+    off_t offset;
+    size_t count;
+    char *ptr;
+    size_t rc;
+    ReadReq() : offset(0), count(0), ptr(0), rc(0) {}
+    ReadReq(off_t offset_, size_t count_, char *ptr_)
+        : offset(offset_), count(count_), ptr(ptr_), rc(0) {}
+};
+
 class Reader {
     Reader(const Reader &);
 public:
@@ -63,6 +180,15 @@ public:
     virtual size_t read(off_t off, size_t count, char *ptr) const = 0;
     virtual std::string describe() const = 0;
     virtual std::string readString(off_t offset) const;
+    // If the content is resident in memory, return a pointer to "count"
+    // bytes at "offset" that can be used in-place, otherwise null.
+    virtual const char *view(off_t, size_t) const { return 0; }
+    // As view(), for the NUL-terminated string at "offset".
+    virtual const char *viewString(off_t) const { return 0; }
+    // Service a set of independent reads. Readers that can do better than
+    // calling read() for each request override this.
+    virtual void readv(ReadReq *reqs, size_t nreqs) const;
+    void readv(std::vector<ReadReq> &reqs) const { readv(reqs.data(), reqs.size()); }
 };
 
 
@@ -71,6 +197,10 @@ class FileReader : public Reader {
     std::string name;
     int file;
     bool openfile(int &file, std::string name_);
+protected:
+    // How many reads we make of the file, and how much they get, if statsEnabled.
+    Stats::Value *readCalls;
+    Stats::Value *readBytes;
 public:
     virtual size_t read(off_t off, size_t count, char *ptr) const;
     FileReader(std::string name, int fd = -1);
@@ -78,31 +208,59 @@ public:
 };
 
 class CacheReader : public Reader {
-    struct CacheEnt {
-        std::string value;
-        bool isNew;
-        CacheEnt() : isNew(true) {}
-    };
     std::shared_ptr<Reader> upstream;
-    mutable std::unordered_map<off_t, CacheEnt> stringCache;
-    static const size_t PAGESIZE = 4096;
-    static const size_t MAXPAGES = 16;
+    // Strings are cached in LRU order, like pages.
+    typedef std::list<std::pair<off_t, std::string>> Strings;
+    mutable Strings strings;
+    mutable std::unordered_map<off_t, Strings::iterator> stringCache;
+    const size_t maxStrings;
+    const size_t pageSize;
+    const size_t maxPages;
+    const size_t readAhead;
     class Page {
         Page();
         Page(const Page &);
     public:
         off_t offset;
         size_t len;
-        char data[PAGESIZE];
-        Page(Reader &r, off_t offset);
+        std::unique_ptr<char[]> data;
+        Page(off_t offset_, size_t pageSize) : offset(offset_), len(0), data(new char[pageSize]) {}
     };
-    mutable std::list<Page *> pages;
+    // Pages are kept in LRU order, most recently used at the front, and
+    // indexed by offset.
+    typedef std::list<Page> Pages;
+    mutable Pages pages;
+    mutable std::unordered_map<off_t, Pages::iterator> pageIndex;
+    mutable size_t hits;
+    mutable size_t misses;
+    mutable Stats::Value *hitCount; // for Stats, found when first needed.
+    mutable Stats::Value *missCount;
+    void count(Stats::Value *&stat, const char *what, size_t n = 1) const;
+    // Protects all the above, so threads can share the cache. readv and
+    // readString call read, so it's recursive.
+    mutable std::recursive_mutex lock;
     Page *getPage(off_t offset) const;
+    Page &allocPage(off_t offset) const;
+    void fill(off_t offset) const;
 public:
+    static size_t defaultPageSize;
+    static size_t defaultMaxPages;
+    static size_t defaultReadAhead;
+    static size_t defaultMaxStrings;
     virtual size_t read(off_t off, size_t count, char *ptr) const;
     virtual std::string describe() const { return upstream->describe(); }
-    CacheReader(std::shared_ptr<Reader> upstream);
+    CacheReader(std::shared_ptr<Reader> upstream,
+          size_t pageSize = defaultPageSize,
+          size_t maxPages = defaultMaxPages,
+          size_t readAhead = defaultReadAhead);
     std::string readString(off_t absoff) const;
+    using Reader::readv;
+    virtual void readv(ReadReq *reqs, size_t nreqs) const;
+    const std::shared_ptr<Reader> &getUpstream() const { return upstream; }
+    // Forget everything we've read, for content that may have changed.
+    void flush();
+    size_t cacheHits() const { return hits; }
+    size_t cacheMisses() const { return misses; }
     ~CacheReader();
 };
 
@@ -112,10 +270,22 @@ protected:
     char *data;
 public:
     virtual size_t read(off_t off, size_t count, char *ptr) const;
+    virtual const char *view(off_t off, size_t count) const;
+    virtual const char *viewString(off_t off) const;
+    virtual std::string readString(off_t off) const;
     MemReader(size_t, char *);
     std::string describe() const;
 };
 
+// Maps an entire (regular) file read-only.
+class MmapReader : public MemReader {
+    std::string name;
+public:
+    MmapReader(const std::string &name, int fd, size_t len);
+    ~MmapReader();
+    std::string describe() const { return name; }
+};
+
 class AllocMemReader : public MemReader {
    char *buf;
 public:
@@ -124,6 +294,74 @@ public:
 
 };
 
+// A copy of some ranges of another reader's content, taken at one moment.
+// Reads of anything outside those ranges go to the original.
+class SnapshotReader : public Reader {
+    std::shared_ptr<Reader> upstream;
+    std::map<off_t, std::vector<char>> ranges;
+    std::vector<std::vector<char>> spare; // buffers from before a reset, for capture.
+public:
+    SnapshotReader(std::shared_ptr<Reader> upstream_) : upstream(upstream_) {}
+    // Drop the ranges, and take a snapshot of "upstream_" instead, keeping
+    // the memory we had for reuse.
+    void reset(std::shared_ptr<Reader> upstream_);
+    // Copy up to "count" bytes at "offset", returning how many we got.
+    size_t capture(off_t offset, size_t count) { return capture(offset, count, *upstream); }
+    // As above, but read the bytes from "from", which has the same content as
+    // upstream. (e.g., upstream without its cache.)
+    size_t capture(off_t offset, size_t count, const Reader &from);
+    // Use "data", copied earlier, as the content at "offset".
+    void add(off_t offset, std::vector<char> data) { if (!data.empty()) ranges[offset].swap(data); }
+    virtual size_t read(off_t off, size_t count, char *ptr) const;
+    virtual const char *view(off_t off, size_t count) const;
+    std::string describe() const { return upstream->describe() + " (snapshot)"; }
+};
+
+/*
+ * The content of a gzip-compressed file, inflated as it's read, without
+ * ever holding all of it. The first time someone reads beyond what we've
+ * seen, we inflate the file up to there, noting an access point at a
+ * deflate block boundary every spanSize bytes of output: where the block
+ * starts in the compressed data, and the 32k of output before it that the
+ * block may refer to. A read then inflates only the spans it touches, from
+ * their access points, and we keep the last maxSpans of those.
+ */
+struct z_stream_s;
+class GzipReader : public Reader {
+    std::shared_ptr<Reader> upstream;
+    struct AccessPoint {
+        off_t out; // offset in the inflated content.
+        off_t in; // offset of the first whole byte of the block in upstream.
+        int bits; // how many bits of the byte before "in" start the block.
+        std::vector<unsigned char> window; // compressed, to save space.
+    };
+    mutable std::vector<AccessPoint> points;
+    // The state of our pass through the file to find the access points.
+    mutable std::unique_ptr<z_stream_s> scan;
+    mutable std::vector<unsigned char> scanInput;
+    mutable std::vector<unsigned char> scanWindow; // the last 32k inflated, circular.
+    mutable off_t scanIn;
+    mutable off_t scanOut;
+    mutable off_t scanMember; // where the gzip member we're in starts in the output.
+    mutable bool scanned; // if we've seen the end, which is at scanOut.
+    // The spans we've inflated, most recently used first, by index in "points".
+    mutable std::list<std::pair<size_t, std::vector<char>>> spans;
+    mutable std::mutex lock; // protects all the above.
+    void scanTo(off_t offset) const;
+    void addPoint() const;
+    const std::vector<char> &getSpan(size_t) const;
+    void inflateSpan(size_t, std::vector<char> &) const;
+public:
+    static size_t spanSize;
+    static size_t maxSpans;
+    // If "reader" looks like gzip data.
+    static bool isGzip(const Reader &reader);
+    GzipReader(std::shared_ptr<Reader> upstream);
+    ~GzipReader();
+    virtual size_t read(off_t off, size_t count, char *ptr) const;
+    std::string describe() const { return upstream->describe(); }
+};
+
 class NullReader : public Reader {
 public:
     virtual size_t read(off_t, size_t, char *) const {
@@ -146,6 +384,17 @@ public:
            count = length - off;
         return upstream->read(off + offset, count, ptr);
     }
+    virtual const char *view(off_t off, size_t count) const {
+        if (off + off_t(count) > length)
+           return 0;
+        return upstream->view(off + offset, count);
+    }
+    virtual const char *viewString(off_t off) const {
+        if (off >= length)
+           return 0;
+        auto str = upstream->viewString(off + offset);
+        return str && off_t(strnlen(str, length - off)) < length - off ? str : 0;
+    }
     OffsetReader(std::shared_ptr<Reader> upstream_, off_t offset_, off_t length_)
         : upstream(upstream_), offset(offset_), length(length_) {}
     std::string describe() const {
@@ -177,5 +426,31 @@ public:
     }
 };
 std::shared_ptr<Reader> loadFile(const std::string &path);
+std::shared_ptr<Reader> loadCore(const std::string &path);
+
+/*
+ * A bump allocator: objects are carved out of large blocks, and are all
+ * released together when the arena is destroyed. Destructors are never run,
+ * so only trivially destructible types may be allocated.
+ */
+class Arena {
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char *cur;
+    size_t avail;
+    static const size_t blockSize = 65536;
+public:
+    Arena() : cur(0), avail(0) {}
+    Arena(const Arena &) = delete;
+    void *alloc(size_t size, size_t align);
+    template <typename T, typename... Args> T *make(Args&&... args) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return new (alloc(sizeof (T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+    template <typename T> T *array(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+        return static_cast<T *>(alloc(sizeof (T) * count, alignof(T)));
+    }
+    const char *strdup(const std::string &);
+};
 
 #endif // LIBPSTACK_UTIL_H
@@ -1,10 +1,14 @@
 #include <iostream>
+#include <algorithm>
 #include <unistd.h>
 #include <limits.h>
 #include <sys/ptrace.h>
 #include <fcntl.h>
 #include <wait.h>
 #include <err.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <sys/time.h>
 
 #include "libpstack/proc.h"
 #include "libpstack/ps_callback.h"
@@ -17,10 +21,91 @@ LiveReader::procname(pid_t pid, const std::string &base)
     return ss.str();
 }
 
-LiveProcess::LiveProcess(std::shared_ptr<ElfObject> ex, pid_t pid_, const PathReplacementList &repls)
-    : Process(ex ? ex : std::make_shared<ElfObject>(
-            std::make_shared<CacheReader>(std::make_shared<LiveReader>(pid_, "exe"))),
-            std::make_shared<CacheReader>(std::make_shared<LiveReader>(pid_, "mem")), repls)
+/*
+ * Read the process's address space with process_vm_readv where we can, so
+ * large reads don't go through /proc/<pid>/mem a page at a time.
+ */
+size_t
+LiveReader::read(off_t off, size_t count, char *ptr) const
+{
+    if (base == "mem") {
+        iovec local = { ptr, count };
+        iovec remote = { (void *)off, count };
+        ssize_t rc = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+        if (readCalls) {
+            Stats::add(*readCalls);
+            Stats::add(*readBytes, std::max(rc, ssize_t(0)));
+        }
+        if (rc > 0)
+            return rc;
+    }
+    return FileReader::read(off, count, ptr);
+}
+
+/*
+ * For the process's address space, use process_vm_readv to read many ranges
+ * with one system call. The kernel stops a transfer at the first range it
+ * can't read: we let FileReader's pread deal with that range, and carry on
+ * with the rest.
+ */
+void
+LiveReader::readv(ReadReq *reqs, size_t nreqs) const
+{
+    if (base != "mem") {
+        FileReader::readv(reqs, nreqs);
+        return;
+    }
+    std::vector<iovec> local, remote;
+    for (size_t next = 0; next < nreqs;) {
+        size_t count = std::min(nreqs - next, size_t(IOV_MAX));
+        local.resize(count);
+        remote.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            auto &req = reqs[next + i];
+            local[i].iov_base = req.ptr;
+            local[i].iov_len = req.count;
+            remote[i].iov_base = (void *)req.offset;
+            remote[i].iov_len = req.count;
+        }
+        ssize_t rc = process_vm_readv(pid, &local[0], count, &remote[0], count, 0);
+        if (readCalls) {
+            Stats::add(*readCalls);
+            Stats::add(*readBytes, std::max(rc, ssize_t(0)));
+        }
+        if (rc == -1) {
+            if (errno == ENOSYS || errno == EPERM) {
+                // no support from the kernel, or not allowed: use /proc/<pid>/mem.
+                FileReader::readv(reqs + next, nreqs - next);
+                return;
+            }
+            rc = 0;
+        }
+        // Distribute what we got over the requests.
+        size_t got = rc;
+        for (; count != 0 && got >= reqs[next].count; --count) {
+            got -= reqs[next].count;
+            reqs[next].rc = reqs[next].count;
+            next++;
+        }
+        if (count != 0) {
+            // a partial (or failed) transfer: retry this one on its own.
+            auto &req = reqs[next++];
+            try {
+                req.rc = FileReader::read(req.offset, req.count, req.ptr);
+            }
+            catch (const std::exception &) {
+                req.rc = 0;
+            }
+        }
+    }
+}
+
+LiveProcess::LiveProcess(std::shared_ptr<ElfObject> ex, pid_t pid_, const PathReplacementList &repls,
+        ImageCache &cache)
+    : Process(ex ? ex : cache.getImage(LiveReader::procname(pid_, "exe"), [pid_]() {
+                return std::make_shared<ElfObject>(
+                    std::make_shared<CacheReader>(std::make_shared<LiveReader>(pid_, "exe"))); }),
+            std::make_shared<CacheReader>(std::make_shared<LiveReader>(pid_, "mem")), repls, cache)
     , pid(pid_)
     , stopCount(0)
 {
@@ -30,19 +115,22 @@ LiveProcess::LiveProcess(std::shared_ptr<ElfObject> ex, pid_t pid_, const PathRe
 void
 LiveProcess::load()
 {
-    StopProcess here(this);
-    char path[PATH_MAX];
-    snprintf(path, sizeof path, "/proc/%d/auxv", pid);
-    int fd = open(path, O_RDONLY);
-    if (fd == -1)
-        throw Exception() << "failed to open " << path << ": " << strerror(errno);
-    char buf[4096];
-    ssize_t rc = ::read(fd, buf, sizeof buf);
-    close(fd);
-    if (rc == -1)
-        throw Exception() << "failed to read 4k from " << path;
-    processAUXV(buf, rc);
-    Process::load();
+    {
+        StopProcess here(this);
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, "/proc/%d/auxv", pid);
+        int fd = open(path, O_RDONLY);
+        if (fd == -1)
+            throw Exception() << "failed to open " << path << ": " << strerror(errno);
+        char buf[4096];
+        ssize_t rc = ::read(fd, buf, sizeof buf);
+        close(fd);
+        if (rc == -1)
+            throw Exception() << "failed to read 4k from " << path;
+        processAUXV(buf, rc);
+        Process::load();
+    }
+    prefetchDebugImages();
 }
 
 bool
@@ -72,17 +160,28 @@ LiveProcess::resume(lwpid_t pid)
     if (--tcb.stopCount != 0)
         return;
 
-    kill(pid, SIGCONT);
-    if (ptrace(PT_DETACH, pid, (caddr_t)1, 0) != 0)
-        std::clog << "failed to detach from process " << pid << ": " << strerror(errno);
+    if (tcb.seized) {
+        // A seized LWP got no SIGSTOP, but may have stopped for a signal.
+        tcb.seized = false;
+        if (ptrace(PT_DETACH, pid, 0, (caddr_t)(intptr_t)tcb.signal) != 0)
+            std::clog << "failed to detach from process " << pid << ": " << strerror(errno);
+        tcb.signal = 0;
+    } else {
+        kill(pid, SIGCONT);
+        if (ptrace(PT_DETACH, pid, (caddr_t)1, 0) != 0)
+            std::clog << "failed to detach from process " << pid << ": " << strerror(errno);
+    }
 
-    if (verbose >= 2 && --stopCount == 0) {
+    if (--stopCount == 0 && (verbose >= 2 || statsEnabled)) {
         timeval tv;
         gettimeofday(&tv, 0);
         long long secs = (tv.tv_sec - start.tv_sec) * 1000000;
         secs += tv.tv_usec;
         secs -= start.tv_usec;
-        *debug << "child was stopped for " << std::dec << secs << " microseconds" << std::endl;
+        static auto &stopped = Stats::timer("stopped");
+        Stats::add(stopped, secs * 1000);
+        if (verbose >= 2)
+            *debug << "child was stopped for " << std::dec << secs << " microseconds" << std::endl;
     }
 }
 
@@ -108,9 +207,94 @@ public:
     }
 };
 
+/*
+ * Stop every LWP listed in /proc/<pid>/task. We seize and interrupt them
+ * all before waiting for any, so they stop in parallel, and we don't need
+ * libthread_db to find them. We go round again until we find no new LWPs,
+ * in case threads were created while we were attaching. Returns false if we
+ * can't do this, and should attach to each LWP in turn instead.
+ */
+bool
+LiveProcess::seizeProcess()
+{
+#if defined(__linux__) && defined(PTRACE_SEIZE)
+    std::set<lwpid_t> seen;
+    bool counted = false;
+    for (bool found = true; found; ) {
+        found = false;
+        std::string task = LiveReader::procname(pid, "task");
+        DIR *dir = opendir(task.c_str());
+        if (dir == 0) {
+            if (seen.empty())
+                return false;
+            break;
+        }
+        std::vector<lwpid_t> seized;
+        for (struct dirent *ent; (ent = readdir(dir)) != 0; ) {
+            lwpid_t lwp = atoi(ent->d_name);
+            if (lwp == 0 || !seen.insert(lwp).second)
+                continue;
+            found = true;
+            auto &tcb = stoppedLwps[lwp];
+            if (lwp == pid)
+                counted = true;
+            if (tcb.stopCount++ != 0)
+                continue;
+            if (ptrace(__ptrace_request(PTRACE_SEIZE), lwp, 0, 0) != 0) {
+                int err = errno;
+                tcb.stopCount--;
+                if (lwp == pid)
+                    counted = false;
+                if (err == ESRCH) // it's gone.
+                    continue;
+                if (seen.size() == 1) {
+                    // The kernel may not support it: attach the old way.
+                    closedir(dir);
+                    return false;
+                }
+                if (verbose)
+                    *debug << "can't seize LWP " << lwp << ": " << strerror(err) << "\n";
+                continue;
+            }
+            if (stopCount++ == 0)
+                gettimeofday(&start, 0);
+            tcb.seized = true;
+            if (ptrace(__ptrace_request(PTRACE_INTERRUPT), lwp, 0, 0) != 0 && verbose)
+                *debug << "can't interrupt LWP " << lwp << ": " << strerror(errno) << "\n";
+            seized.push_back(lwp);
+            if (lwp != pid)
+                lwps.insert(lwp);
+        }
+        closedir(dir);
+
+        for (auto lwp : seized) {
+            int status;
+            if (waitpid(lwp, &status, __WALL) == -1) {
+                if (verbose)
+                    *debug << "wait for LWP " << lwp << " failed: " << strerror(errno) << "\n";
+                continue;
+            }
+            // If it stopped for a signal rather than our interrupt, pass it
+            // on when we detach.
+            if (WIFSTOPPED(status) && (status >> 16) != PTRACE_EVENT_STOP)
+                stoppedLwps[lwp].signal = WSTOPSIG(status);
+        }
+    }
+    // resumeProcess expects the process itself to be stopped: if we didn't
+    // seize it above, try attaching to it the old way.
+    if (!counted)
+        stop(pid);
+    return true;
+#else
+    return false;
+#endif
+}
+
 void
 LiveProcess::stopProcess()
 {
+    if (seizeProcess())
+        return;
     stop(pid);
     // suspend everything quickly.
     StopLWP lister(this);
@@ -141,7 +325,7 @@ LiveProcess::stop(lwpid_t pid)
     if (tcb.stopCount++ != 0)
         return;
 
-    if (stopCount++ == 0 && verbose)
+    if (stopCount++ == 0)
         gettimeofday(&start, 0);
 
     if (ptrace(PT_ATTACH, pid, 0, 0) == 0) {
@@ -146,10 +146,10 @@ ps_lsetxmmregs (struct ps_prochandle *, lwpid_t, const char *)
 }
 #endif
 
-ps_err_e ps_lgetfpregs(struct ps_prochandle *, lwpid_t, prfpregset_t *)
+ps_err_e ps_lgetfpregs(struct ps_prochandle *ph, lwpid_t pid, prfpregset_t *fpregset)
 {
-    abort();
-    return (PS_ERR);
+    Process *p = static_cast<Process *>(ph);
+    return p->getFPRegs(pid, fpregset) ? PS_OK : PS_ERR;
 }
 
 ps_err_e ps_lgetregs(struct ps_prochandle *ph, lwpid_t pid, prgregset_t gregset)
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <set>
 #include <iomanip>
 #include <limits>
@@ -6,16 +7,20 @@
 #include <limits.h>
 #include <iostream>
 #include <link.h>
+#include <sys/stat.h>
+#include <tuple>
 #include <unistd.h>
 #include <libpstack/ps_callback.h>
 #define REGMAP(a,b)
 #include "libpstack/dwarf/archreg.h"
+#undef REGMAP
 
 #include <libpstack/proc.h>
 #include <libpstack/dwarf.h>
 #include <libpstack/dump.h>
 
 static size_t gMaxFrames = 1024; /* max number of frames to read */
+size_t Process::stackPrefetch = 65536;
 
 void
 PstackOptions::operator += (PstackOption opt)
@@ -42,15 +47,29 @@ delall(T &container)
         delete *i;
 }
 
-Process::Process(std::shared_ptr<ElfObject> exec, std::shared_ptr<Reader> io_, const PathReplacementList &prl)
+// The reader's own cache, if it has one, so there's only one to flush.
+static std::shared_ptr<CacheReader>
+cacheFor(const std::shared_ptr<Reader> &io)
+{
+    auto cache = std::dynamic_pointer_cast<CacheReader>(io);
+    return cache ? cache : std::make_shared<CacheReader>(io);
+}
+
+Process::Process(std::shared_ptr<ElfObject> exec, std::shared_ptr<Reader> io_, const PathReplacementList &prl,
+        ImageCache &cache)
     : entry(0)
     , vdso(0)
     , isStatic(false)
+    , rDebugAddr(0)
     , sysent(0)
+    , addressSpaceIndexed(false)
+    , memoryCache(cacheFor(io_))
+    , memory(memoryCache->getUpstream())
     , agent(0)
+    , imageCache(cache)
     , execImage(exec)
     , pathReplacements(prl)
-    , io(std::make_shared<CacheReader>(io_))
+    , io(memoryCache)
 {
    if (exec)
       entry = exec->getElfHeader().e_entry;
@@ -59,6 +78,8 @@ Process::Process(std::shared_ptr<ElfObject> exec, std::shared_ptr<Reader> io_, c
 void
 Process::load()
 {
+    static auto &loadTime = Stats::timer("load");
+    StatTimer _(loadTime);
 
     /*
      * Attach the executable and any shared libs.
@@ -70,12 +91,13 @@ Process::load()
     if (!execImage)
         throw Exception() << "no executable image located for process";
 
-    Elf_Addr r_debug_addr = findRDebugAddr();
-    isStatic = (r_debug_addr == 0 || r_debug_addr == (Elf_Addr)-1);
+    rDebugAddr = findRDebugAddr();
+    isStatic = (rDebugAddr == 0 || rDebugAddr == (Elf_Addr)-1);
     if (isStatic)
         addElfObject(execImage, 0);
     else
-        loadSharedObjects(r_debug_addr);
+        loadSharedObjects(rDebugAddr);
+    indexAddressSpace();
 
     td_err_e the;
     the = td_ta_new(this, &agent);
@@ -87,18 +109,86 @@ Process::load()
 
 }
 
+/*
+ * Libraries the process loaded or unloaded since we last looked are found
+ * by comparing its link map with the one we saw then: the objects for the
+ * entries that are still there are kept, with everything we've decoded
+ * from them.
+ */
+bool
+Process::refresh()
+{
+    static auto &refreshTime = Stats::timer("refresh objects");
+    StatTimer _(refreshTime);
+    if (isStatic || !loadSharedObjects(rDebugAddr))
+        return false;
+    indexAddressSpace();
+    return true;
+}
+
+unsigned Process::debugPrefetchThreads = 16;
+
+/*
+ * Find the debug images for all our objects, each on a thread of its own,
+ * up to debugPrefetchThreads: it's mostly waiting for the filesystem to tell
+ * us the files we try don't exist. Call this while the process is running,
+ * so we needn't go looking for them later while it's stopped.
+ */
+void
+Process::prefetchDebugImages()
+{
+    if (noDebugLibs || objects.empty())
+        return;
+    static auto &prefetchTime = Stats::timer("prefetch debug images");
+    StatTimer _(prefetchTime);
+    parallelFor(objects.size(), debugPrefetchThreads, [&](size_t i, size_t) {
+        try {
+            objects[i].object->getDebug();
+        }
+        catch (const std::exception &ex) {
+            if (verbose)
+                *debug << "can't find debug image for "
+                    << objects[i].object->getio()->describe() << ": " << ex.what() << "\n";
+        }
+    });
+}
+
 DwarfInfo *
 Process::getDwarf(std::shared_ptr<ElfObject> elf, bool debug)
 {
+    // A shared image's debug image lives as long as it does, so can share
+    // its DWARF information too.
+    bool shared = imageCache.isShared(elf);
     if (debug)
         elf = ElfObject::getDebug(elf);
+    if (shared)
+        return imageCache.getDwarf(elf);
 
+    std::lock_guard<std::mutex> guard(dwarfLock);
     auto &info = dwarf[elf];
     if (info == 0)
         info = new DwarfInfo(elf);
     return info;
 }
 
+/*
+ * Load the DWARF information and FDE indexes we'd use to unwind stacks in
+ * any of the loaded objects, so we don't have to while the process is
+ * stopped.
+ */
+void
+Process::loadUnwindInfo()
+{
+    for (auto &loaded : objects) {
+        for (bool debug : {true, false}) {
+            auto dwarf = getDwarf(loaded.object, debug);
+            for (auto frames : { dwarf->getDebugFrame(), dwarf->getEhFrame() })
+                if (frames && !frames->hasHdr())
+                    frames->addrIndex();
+        }
+    }
+}
+
 void
 Process::processAUXV(const void *datap, size_t len)
 {
@@ -139,7 +229,7 @@ Process::processAUXV(const void *datap, size_t len)
                 if (verbose >= 2)
                     *debug << "filename from auxv: " << exeName << "\n";
                 if (!execImage) {
-                    execImage = std::make_shared<ElfObject>(loadFile(exeName));
+                    execImage = imageCache.getImageForName(exeName);
                     if (!entry)
                        entry = execImage->getElfHeader().e_entry;
                 }
@@ -150,106 +240,44 @@ Process::processAUXV(const void *datap, size_t len)
     }
 }
 
-std::ostream &
-Process::dumpStackJSON(std::ostream &os, const ThreadStack &thread)
+/*
+ * Write one thread's stack as a JSON object, with what we'd print for each
+ * frame alongside its addresses.
+ */
+void
+Process::dumpStackJSON(JsonWriter &json, const ThreadStack &thread, const PstackOptions &options)
 {
+    json.beginObject()
+        .key("pid").value(getPID())
+        .key("ti_tid").value(uintmax_t(thread.info.ti_tid))
+        .key("ti_lid").value(thread.info.ti_lid)
+        .key("ti_type").value(int(thread.info.ti_type))
+        .key("stack").beginArray();
 
-
-    os << "{ \"ti_tid\": " << thread.info.ti_tid
-        << ", \"ti_type\": " << thread.info.ti_type
-        << ", \"stack\": [ ";
-
-    const char *frameSep = "";
     for (auto &frame : thread.stack) {
-        Elf_Addr objIp = 0;
-        std::shared_ptr<ElfObject> obj;
-        Elf_Sym sym;
-        std::string fileName;
-        std::string symName = "unknown";
-        if (frame->ip == sysent) {
-            symName = "(syscall)";
+        json.beginObject()
+            .key("ip").value(frame.ip)
+            .key("cfa").value(frame.cfa);
+        if (frame.ip == sysent) {
+            json.key("function").value("(syscall)");
         } else {
-            Elf_Off reloc;
-            obj = findObject(frame->ip, &reloc);
-            if (obj) {
-               fileName = obj->getio()->describe();
-               objIp = frame->ip - reloc;
-               obj->findSymbolByAddress(objIp, STT_FUNC, sym, symName);
+            auto sym = symbolize(frame.ip, !options(PstackOptions::nosrc));
+            if (sym->symName != "")
+                json.key("function").value(sym->symName).key("off").value(sym->offset);
+            if (sym->fileName != "")
+                json.key("file").value(sym->fileName);
+            if (frame.fde && frame.fde->cie->isSignalHandler)
+                json.key("signal_handler").value(true);
+            if (!sym->source.empty()) {
+                json.key("source").beginArray();
+                for (auto &ent : sym->source)
+                    json.beginObject().key("path").value(ent.first).key("line").value(ent.second).endObject();
+                json.endArray();
             }
         }
-
-        os << frameSep << "{ \"ip\": " << intptr_t(frame->ip);
-
-        frameSep = ", ";
-
-        if (symName != "")
-            os << ", \"function\": \"" << symName << "\"";
-
-        if (obj) {
-            os << ", \"off\": " << intptr_t(objIp) - sym.st_value;
-            os << ", \"file\": " << "\"" << fileName << "\"";
-            auto di = getDwarf(obj);
-            if (di) {
-                auto src = di->sourceFromAddr(objIp - 1);
-                for (auto ent = src.begin(); ent != src.end(); ++ent)
-                    os
-                        << ", \"source\": \"" << ent->first << "\""
-                        << ", \"line\": " << ent->second;
-            }
-        }
-        os << " }";
-        frameSep = ", ";
+        json.endObject();
     }
-    return os << " ] }";
-}
-
-DwarfEntry *
-findEntryForFunc(Elf_Addr address, DwarfEntry *entry)
-{
-   switch (entry->type->tag) {
-      case DW_TAG_subprogram: {
-         const DwarfAttribute *lowAttr = entry->attrForName(DW_AT_low_pc);
-         const DwarfAttribute *highAttr =entry->attrForName(DW_AT_high_pc);
-         if (lowAttr && highAttr) {
-            Elf_Addr start, end;
-            switch (lowAttr->spec->form) {
-               case DW_FORM_addr:
-                  start = lowAttr->value.addr;
-                  break;
-               default:
-                  abort();
-                  break;
-            }
-            switch (highAttr->spec->form) {
-               case DW_FORM_addr:
-                  end = highAttr->value.addr;
-                  break;
-               case DW_FORM_data1:
-               case DW_FORM_data2:
-               case DW_FORM_data4:
-               case DW_FORM_data8:
-               case DW_FORM_udata:
-                  end = start + highAttr->value.sdata;
-                  break;
-               default:
-                  abort();
-
-            }
-            if (start <= address && end > address)
-               return entry;
-         }
-         break;
-      }
-
-      default:
-         for (auto &child : entry->children) {
-            auto descendent = findEntryForFunc(address, child);
-            if (descendent)
-               return descendent;
-         }
-         break;
-   }
-   return nullptr;
+    json.endArray().endObject();
 }
 
 struct ArgPrint {
@@ -280,7 +308,7 @@ typeName(const DwarfEntry *type)
         case DW_TAG_subroutine_type:
             s = typeName(base) + "(";
             sep = "";
-            for (auto &arg : type->children) {
+            for (auto &arg : type->children()) {
                 if (arg->type->tag != DW_TAG_formal_parameter)
                     continue;
                 s += sep;
@@ -303,13 +331,15 @@ typeName(const DwarfEntry *type)
 
 
 struct RemoteValue {
-    const Process &p;
     const Elf_Addr addr;
-    const DwarfEntry *type;
-    RemoteValue(const Process &p_, Elf_Addr addr_, const DwarfEntry *type_)
-        : p(p_)
-        , addr(addr_)
+    const DwarfEntry *type; // with typedefs resolved.
+    const std::vector<char> &buf; // what we read from "addr".
+    size_t rc;
+    RemoteValue(Elf_Addr addr_, const DwarfEntry *type_, const std::vector<char> &buf_, size_t rc_)
+        : addr(addr_)
         , type(type_)
+        , buf(buf_)
+        , rc(rc_)
     {}
 };
 
@@ -319,38 +349,26 @@ operator << (std::ostream &os, const RemoteValue &rv)
     if (rv.addr == 0)
        return os << "(null)";
     auto type = rv.type;
-    while (type->type->tag == DW_TAG_typedef)
-       type = type->referencedEntry(DW_AT_type);
-
-
-    auto size = type->attrForName(DW_AT_byte_size);
-    std::vector<char> buf;
-    if (size) {
-        buf.resize(size->value.udata);
-        auto rc = rv.p.io->read(rv.addr, size->value.udata, &buf[0]);
-        if (rc != size->value.udata) {
-            return os << "<error reading " << size->value.udata << " bytes from " << rv.addr << ", got " << rc << ">";
-        }
-    }
+    if (rv.rc != rv.buf.size())
+        return os << "<error reading " << rv.buf.size() << " bytes from " << rv.addr << ", got " << rv.rc << ">";
 
     IOFlagSave _(os);
     switch (type->type->tag) {
         case DW_TAG_base_type: {
-            if (size == 0) {
-                os << "unrepresentable(1)";
-            }
+            if (rv.buf.empty())
+                return os << "unrepresentable(1)";
             auto encoding = type->attrForName(DW_AT_encoding);
             switch (encoding->value.udata) {
                 case DW_ATE_address:
-                    os << *(void **)&buf[0];
+                    os << *(void **)rv.buf.data();
                     break;
                 case DW_ATE_boolean:
                     for (size_t i = 0;; ++i) {
-                        if (i == size->value.udata) {
+                        if (i == rv.buf.size()) {
                             os << "false";
                             break;
                         }
-                        if (buf[i] != 0) {
+                        if (rv.buf[i] != 0) {
                             os << "true";
                             break;
                         }
@@ -358,35 +376,35 @@ operator << (std::ostream &os, const RemoteValue &rv)
                     break;
 
                 case DW_ATE_signed:
-                    switch (size->value.udata) {
+                    switch (rv.buf.size()) {
                         case sizeof (int8_t):
-                            os << *(int8_t *)&buf[0];
+                            os << *(int8_t *)rv.buf.data();
                             break;
                         case sizeof (int16_t):
-                            os << *(int16_t *)&buf[0];
+                            os << *(int16_t *)rv.buf.data();
                             break;
                         case sizeof (int32_t):
-                            os << *(int32_t *)&buf[0];
+                            os << *(int32_t *)rv.buf.data();
                             break;
                         case sizeof (int64_t):
-                            os << *(int64_t *)&buf[0];
+                            os << *(int64_t *)rv.buf.data();
                             break;
                     }
                     break;
 
                 case DW_ATE_unsigned:
-                    switch (size->value.udata) {
+                    switch (rv.buf.size()) {
                         case sizeof (uint8_t):
-                            os << *(uint8_t *)&buf[0];
+                            os << *(uint8_t *)rv.buf.data();
                             break;
                         case sizeof (uint16_t):
-                            os << *(uint16_t *)&buf[0];
+                            os << *(uint16_t *)rv.buf.data();
                             break;
                         case sizeof (uint32_t):
-                            os << *(uint32_t *)&buf[0];
+                            os << *(uint32_t *)rv.buf.data();
                             break;
                         case sizeof (uint64_t):
-                            os << *(int64_t *)&buf[0];
+                            os << *(int64_t *)rv.buf.data();
                             break;
                         default:
                             abort();
@@ -398,144 +416,212 @@ operator << (std::ostream &os, const RemoteValue &rv)
             }
             break;
         }
-        case DW_TAG_pointer_type: {
-            if (size == 0) {
-               buf.resize(sizeof (void *));
-               rv.p.io->read(rv.addr, sizeof (void **), &buf[0]);
-            }
-            os << *(void **)&buf[0];
+        case DW_TAG_pointer_type:
+            os << *(void **)rv.buf.data();
             break;
-        }
         default:
             os << "<unprintable type " << type->type->tag << ">";
     }
     return os;
 }
 
+const Process::FunctionArgs &
+Process::functionArgs(const DwarfEntry *function) const
+{
+    static auto &resolved = Stats::counter("function parameter lists resolved");
+    std::lock_guard<std::mutex> guard(argsLock);
+    auto inserted = args.insert(std::make_pair(function, FunctionArgs()));
+    auto &list = inserted.first->second;
+    if (!inserted.second)
+        return list;
+    Stats::add(resolved);
+    for (auto child : function->children()) {
+        if (child->type->tag != DW_TAG_formal_parameter)
+            continue;
+        list.emplace_back();
+        auto &arg = list.back();
+        arg.name = child->name();
+        arg.type = child->referencedEntry(DW_AT_type);
+        while (arg.type && arg.type->type->tag == DW_TAG_typedef)
+            arg.type = arg.type->referencedEntry(DW_AT_type);
+        if (!arg.type)
+            continue;
+        arg.location = child->attrForName(DW_AT_location);
+        auto size = arg.type->attrForName(DW_AT_byte_size);
+        if (size)
+            arg.size = size->value.udata;
+        else if (arg.type->type->tag == DW_TAG_pointer_type)
+            arg.size = sizeof (void *);
+    }
+    return list;
+}
+
+/*
+ * Print the arguments of the function in a frame. We find where each is
+ * first, and then read all those in memory at once.
+ */
 std::ostream &
 operator << (std::ostream &os, const ArgPrint &ap)
 {
+    auto &args = ap.p.functionArgs(ap.frame->function);
+    struct Value {
+        Elf_Addr addr;
+        bool isReg;
+        int inReg;
+        std::vector<char> buf;
+        size_t read; // index in "reads", if we read it.
+        Value() : addr(0), isReg(false), inReg(0), read(-1) {}
+    };
+    std::vector<Value> values(args.size());
+    std::vector<ReadReq> reads;
+    DwarfExpressionStack stack;
+    for (size_t i = 0; i < args.size(); ++i) {
+        auto &arg = args[i];
+        auto &value = values[i];
+        if (!arg.location)
+            continue;
+        stack.clear();
+        value.addr = stack.eval(ap.p, arg.location, ap.frame);
+        value.isReg = stack.isReg;
+        value.inReg = stack.inReg;
+        if (!value.isReg && value.addr != 0 && arg.size != 0) {
+            value.buf.resize(arg.size);
+            value.read = reads.size();
+            reads.emplace_back(value.addr, arg.size, value.buf.data());
+        }
+    }
+    ap.p.io->readv(reads);
+
     const char *sep = "";
-    for (auto child : ap.frame->function->children) {
-        switch (child->type->tag) {
-            case DW_TAG_formal_parameter: {
-                auto name = child->name();
-                const DwarfEntry *type = child->referencedEntry(DW_AT_type);
-                Elf_Addr addr = 0;
-                os << sep << name;
-                if (type) {
-                    const DwarfAttribute *locationA = child->attrForName(DW_AT_location);
-                    if (locationA) {
-                        DwarfExpressionStack fbstack;
-                        addr = fbstack.eval(ap.p, locationA, ap.frame);
-                        os << "=";
-                        if (fbstack.isReg) {
-                           IOFlagSave _(os);
-                           os << std::hex << addr;
-                           os << "{in register " << fbstack.inReg << "}";
-                        } else {
-                           os << RemoteValue(ap.p, addr, type);
-                        }
-                    }
-                }
-                sep = ", ";
-                break;
+    for (size_t i = 0; i < args.size(); ++i) {
+        auto &arg = args[i];
+        auto &value = values[i];
+        os << sep << arg.name;
+        if (arg.location) {
+            os << "=";
+            if (value.isReg) {
+               IOFlagSave _(os);
+               os << std::hex << value.addr;
+               os << "{in register " << value.inReg << "}";
+            } else {
+               size_t rc = value.read == size_t(-1) ? 0 : reads[value.read].rc;
+               os << RemoteValue(value.addr, arg.type, value.buf, rc);
             }
-            default:
-                break;
         }
+        sep = ", ";
     }
     return os;
 }
 
+/*
+ * Work out what to say about the code at "ip" in a stack trace. Threads
+ * blocked in the same place share most of their frames, so we remember the
+ * answer for each address.
+ */
+std::shared_ptr<const Process::FrameSymbol>
+Process::symbolize(Elf_Addr ip, bool withSource)
+{
+    static auto &lookups = Stats::counter("symbol lookups");
+    static auto &memoHits = Stats::counter("symbol lookups memoized");
+    static auto &symbolizeTime = Stats::timer("symbolize");
+    Stats::add(lookups);
+    {
+        std::lock_guard<std::mutex> guard(symbolLock);
+        auto it = symbols.find(ip);
+        if (it != symbols.end() && (it->second->sourced || !withSource)) {
+            Stats::add(memoHits);
+            return it->second;
+        }
+    }
+    StatTimer _(symbolizeTime);
+
+    auto sym = std::make_shared<FrameSymbol>();
+    Elf_Off reloc;
+    auto obj = findObject(ip, &reloc);
+    if (obj) {
+        sym->fileName = obj->getio()->describe();
+        Elf_Addr objIp = ip - reloc;
+
+        Elf_Sym elfSym;
+        DwarfInfo *dwarf = getDwarf(obj, true);
+        std::lock_guard<std::recursive_mutex> guard(dwarf->lock);
+        uintmax_t start;
+        DwarfEntry *de = dwarf->functionForAddr(objIp - 1, &start);
+        if (de) {
+            sym->symName = de->name();
+            if (sym->symName == "") {
+                obj->findSymbolByAddress(objIp - 1, STT_FUNC, elfSym, sym->symName);
+                if (sym->symName == "")
+                    sym->symName = "<unknown>";
+                sym->symName += "%";
+            }
+            sym->function = de;
+            sym->dwarf = dwarf;
+            auto lowAttr = de->attrForName(DW_AT_low_pc);
+            if (lowAttr)
+                start = lowAttr->value.addr;
+            sym->offset = objIp - start;
+        } else if (obj->findSymbolByAddress(objIp - 1, STT_FUNC, elfSym, sym->symName)) {
+            sym->offset = objIp - elfSym.st_value;
+        } else {
+            // With no name, the offset is from the start of the object.
+            sym->symName = "";
+            sym->offset = objIp;
+        }
+        if (withSource) {
+            for (auto &ent : dwarf->sourceFromAddr(objIp - 1))
+                sym->source.push_back(std::make_pair(
+                        ent.first->directory + "/" + ent.first->name, ent.second));
+        }
+    }
+    sym->sourced = withSource;
+
+    std::lock_guard<std::mutex> guard(symbolLock);
+    symbols[ip] = sym;
+    return sym;
+}
+
 std::ostream &
 Process::dumpStackText(std::ostream &os, const ThreadStack &thread, const PstackOptions &options)
 {
     os << "thread: " << (void *)thread.info.ti_tid << ", lwp: " << thread.info.ti_lid << ", type: " << thread.info.ti_type << "\n";
-    for (auto frame : thread.stack) {
+    return dumpFramesText(os, thread, options);
+}
+
+std::ostream &
+Process::dumpFramesText(std::ostream &os, const ThreadStack &thread, const PstackOptions &options)
+{
+    for (auto &frame : thread.stack) {
 
         os << "    ";
         if (verbose) {
             IOFlagSave _(os);
-            os << "[ip=" << std::hex << std::setw(ELF_BITS/4) << std::setfill('0') << frame->ip
-                << ", cfa=" << std::hex << std::setw(ELF_BITS/4) << std::setfill('0') << frame->cfa
+            os << "[ip=" << std::hex << std::setw(ELF_BITS/4) << std::setfill('0') << frame.ip
+                << ", cfa=" << std::hex << std::setw(ELF_BITS/4) << std::setfill('0') << frame.cfa
                 << "] ";
         }
 
-        Elf_Sym sym;
-        std::string fileName = "unknown file";
-        std::string symName;
-
-        Elf_Off reloc;
-        auto obj = findObject(frame->ip, &reloc);
-        if (obj) {
-            fileName = obj->getio()->describe();
-            Elf_Addr objIp = frame->ip - reloc;
-
-            DwarfInfo *dwarf = getDwarf(obj, true);
-            DwarfEntry *de = 0;
-
-            std::list<std::shared_ptr<DwarfUnit>> units;
-            if (dwarf->hasRanges()) {
-                for (const auto &rangeset : dwarf->ranges()) {
-                    for (const auto range : rangeset.ranges) {
-                        if (objIp >= range.start && objIp <= range.start + range.length) {
-                            units.push_back(dwarf->getUnit(rangeset.debugInfoOffset));
-                            break;
-                        }
-                    }
+        auto sym = symbolize(frame.ip, !options(PstackOptions::nosrc));
+        if (sym->fileName != "") {
+            std::string sigmsg = frame.fde && frame.fde->cie->isSignalHandler ?  "[signal handler]" : "";
+            if (sym->function) {
+                frame.function = sym->function;
+                frame.dwarf = sym->dwarf; // hold on to 'function'
+                os << sym->symName << sigmsg << "+" << sym->offset << "(";
+                if (options(PstackOptions::doargs)) {
+                    std::lock_guard<std::recursive_mutex> guard(sym->dwarf->lock);
+                    os << ArgPrint(*this, &frame);
                 }
+                os << ")";
+            } else if (sym->symName != "") {
+                os << sym->symName << sigmsg << "!+" << sym->offset << "()";
             } else {
-                // no ranges - try each dwarf unit in turn. (This seems to happen for single-unit exe's only, so it's no big loss)
-                units = dwarf->getUnits();
-            }
-
-
-            std::string sigmsg = frame->fde && frame->fde->cie->isSignalHandler ?  "[signal handler]" : "";
-            std::shared_ptr<DwarfUnit> dwarfUnit;
-            for (auto u : units) {
-                // find the DIE for this function
-                for (auto it : u->entries) {
-                    de = findEntryForFunc(objIp - 1, it);
-                    if (de) {
-                        symName = de->name();
-                        if (symName == "") {
-                            obj->findSymbolByAddress(objIp - 1, STT_FUNC, sym, symName);
-                            if (symName == "")
-                                symName = "<unknown>";
-                            symName += "%";
-                        }
-                        frame->function = de;
-                        frame->dwarf = dwarf; // hold on to 'de'
-                        os << symName << sigmsg << "+" << objIp - de->attrForName(DW_AT_low_pc)->value.udata << "(";
-                        if (options(PstackOptions::doargs)) {
-                            os << ArgPrint(*this, frame);
-                        }
-                        os << ")";
-                        dwarfUnit = u;
-                        break;
-                    }
-                }
-                if (dwarfUnit)
-                    break;
-            }
-
-            if (!dwarfUnit) {
-                obj->findSymbolByAddress(objIp - 1, STT_FUNC, sym, symName);
-                if (symName != "")
-                    os << symName << sigmsg << "!+" << objIp - sym.st_value << "()";
-                else
-                    os << "unknown@" << std::hex << frame->ip << std::dec << sigmsg << "()";
+                os << "unknown@" << std::hex << frame.ip << std::dec << sigmsg << "()";
             }
 
-            os << " in " << fileName;
-            if (!options(PstackOptions::nosrc) && dwarf) {
-                auto source = dwarf->sourceFromAddr(objIp - 1);
-                for (auto ent = source.begin(); ent != source.end(); ++ent) {
-                    os << " at ";
-                    os << ent->first->directory << "/" << ent->first->name << ":" << std::dec << ent->second;
-                }
-            }
+            os << " in " << sym->fileName;
+            for (auto &ent : sym->source)
+                os << " at " << ent.first << ":" << std::dec << ent.second;
         } else {
             os << "no information for frame";
         }
@@ -548,6 +634,8 @@ void
 Process::addElfObject(std::shared_ptr<ElfObject> obj, Elf_Addr load)
 {
     objects.push_back(LoadedObject(load, obj));
+    addressSpaceIndexed = false;
+    forgetSymbols();
 
     if (verbose >= 2) {
         IOFlagSave _(*debug);
@@ -558,33 +646,103 @@ Process::addElfObject(std::shared_ptr<ElfObject> obj, Elf_Addr load)
     }
 }
 
+// Forget what we found for addresses and functions, as objects come and go.
+void
+Process::forgetSymbols()
+{
+    {
+        std::lock_guard<std::mutex> guard(symbolLock);
+        symbols.clear();
+    }
+    {
+        std::lock_guard<std::mutex> guard(argsLock);
+        args.clear();
+    }
+}
+
 /*
- * Grovel through the rtld's internals to find any shared libraries.
+ * Grovel through the rtld's internals to find any shared libraries. If
+ * we've done this before, we keep the objects for entries in the link map
+ * we've seen already, and load only the new ones. Returns true if the link
+ * map changed.
  */
-void
+bool
 Process::loadSharedObjects(Elf_Addr rdebugAddr)
 {
+    static auto &kept = Stats::counter("link map objects kept");
+    static auto &loaded = Stats::counter("link map objects loaded");
 
+    /*
+     * The loader may change the map as we walk it, so we take what we find
+     * only if it was consistent both before and after, reading r_debug past
+     * any cache. If the loader's busy, we try again, and then look again
+     * later, unless we've nothing yet.
+     */
+    static const int maxTries = 3;
+    const Reader &uncached = io == memoryCache ? *memory : *io;
     struct r_debug rDebug;
-    io->readObj(rdebugAddr, &rDebug);
-
-    /* Iterate over the r_debug structure's entries, loading libraries */
-    struct link_map map;
-    for (Elf_Addr mapAddr = (Elf_Addr)rDebug.r_map; mapAddr; mapAddr = (Elf_Addr)map.l_next) {
-        io->readObj(mapAddr, &map);
+    std::vector<LinkMapEntry> entries;
+    for (int tries = 1;; ++tries) {
+        uncached.readObj(rdebugAddr, &rDebug);
+        bool consistent = rDebug.r_state == r_debug::RT_CONSISTENT;
+        if (consistent || linkMap.empty()) {
+            entries.clear();
+            struct link_map map;
+            for (Elf_Addr mapAddr = (Elf_Addr)rDebug.r_map; mapAddr; mapAddr = (Elf_Addr)map.l_next) {
+                io->readObj(mapAddr, &map);
+                entries.emplace_back(mapAddr, Elf_Addr(map.l_addr), Elf_Addr(map.l_name));
+            }
+            struct r_debug after;
+            uncached.readObj(rdebugAddr, &after);
+            consistent = consistent && after.r_state == r_debug::RT_CONSISTENT;
+        }
+        if (consistent)
+            break;
+        if (tries == maxTries) {
+            if (!linkMap.empty())
+                return false;
+            break;
+        }
+        flushMemory(); // what we read of the map may be out of date.
+    }
+    if (entries == linkMap)
+        return false;
+
+    std::map<Elf_Addr, const LinkMapEntry *> previous;
+    for (auto &old : linkMap)
+        previous[old.map] = &old;
+
+    // Keep the objects that didn't come from the link map, like the vdso.
+    std::vector<LoadedObject> others;
+    for (auto &loaded : objects)
+        if (std::none_of(linkMap.begin(), linkMap.end(), [&loaded](const LinkMapEntry &old) {
+                    return old.object == loaded.object && old.addr == loaded.reloc; }))
+            others.push_back(loaded);
+    objects.swap(others);
+    for (auto &ent : entries) {
+        auto old = previous.find(ent.map);
+        if (old != previous.end() && *old->second == ent) {
+            ent.object = old->second->object;
+            if (ent.object)
+                addElfObject(ent.object, ent.addr);
+            Stats::add(kept);
+            continue;
+        }
+        Stats::add(loaded);
         // first one's the executable itself.
-        if (mapAddr == Elf_Addr(rDebug.r_map)) {
-            assert(map.l_addr == entry - execImage->getElfHeader().e_entry);
-            addElfObject(execImage, map.l_addr);
+        if (ent.map == Elf_Addr(rDebug.r_map)) {
+            assert(ent.addr == entry - execImage->getElfHeader().e_entry);
+            ent.object = execImage;
+            addElfObject(execImage, ent.addr);
             continue;
         }
         /* Read the path to the file */
-        if (map.l_name == 0) {
+        if (ent.name == 0) {
             IOFlagSave _(*debug);
-            *debug << "warning: no name for object loaded at " << std::hex << map.l_addr << "\n";
+            *debug << "warning: no name for object loaded at " << std::hex << ent.addr << "\n";
             continue;
         }
-        std::string path = io->readString(Elf_Off(map.l_name));
+        std::string path = io->readString(Elf_Off(ent.name));
         if (path == "") {
             // XXX: dunno why this is.
             path = execImage->getInterpreter();
@@ -600,14 +758,32 @@ Process::loadSharedObjects(Elf_Addr rdebugAddr)
             *debug << "replaced " << startPath << " with " << path << std::endl;
 
         try {
-            addElfObject(std::make_shared<ElfObject>(loadFile(path)), Elf_Addr(map.l_addr));
+            ent.object = imageCache.getImageForName(path);
+            addElfObject(ent.object, ent.addr);
         }
         catch (const std::exception &e) {
             std::clog << "warning: can't load text for '" << path << "' at " <<
-            (void *)mapAddr << "/" << (void *)map.l_addr << ": " << e.what() << "\n";
+            (void *)ent.map << "/" << (void *)ent.addr << ": " << e.what() << "\n";
             continue;
         }
     }
+    linkMap.swap(entries);
+
+    // Let the image cache drop the objects that went, once nothing refers
+    // to them: what we remember for their addresses goes first.
+    std::vector<std::shared_ptr<ElfObject>> gone;
+    for (auto &old : entries)
+        if (old.object && std::none_of(objects.begin(), objects.end(),
+                    [&old](const LoadedObject &loaded) { return loaded.object == old.object; }))
+            gone.push_back(std::move(old.object));
+    if (!gone.empty()) {
+        entries.clear();
+        others.clear(); // the objects as they were.
+        forgetSymbols();
+        for (auto &object : gone)
+            imageCache.release(std::move(object));
+    }
+    return true;
 }
 
 Elf_Addr
@@ -632,19 +808,57 @@ Process::findRDebugAddr()
     return 0;
 }
 
+void
+Process::indexAddressSpace() const
+{
+    addressSpace.clear();
+    for (size_t i = 0; i < objects.size(); ++i)
+        for (auto &phdr : objects[i].object->getSegments(PT_LOAD))
+            if (phdr.p_memsz != 0)
+                addressSpace.emplace_back(phdr.p_vaddr + objects[i].reloc,
+                        phdr.p_vaddr + objects[i].reloc + phdr.p_memsz, i, &phdr);
+    std::stable_sort(addressSpace.begin(), addressSpace.end(),
+        [](const MappedSegment &l, const MappedSegment &r) { return l.start < r.start; });
+    for (size_t i = 1; i < addressSpace.size(); ++i)
+        addressSpace[i].maxEnd = std::max(addressSpace[i].end, addressSpace[i - 1].maxEnd);
+    addressSpaceIndexed = true;
+}
+
+/*
+ * Find the loaded object, and its segment, that covers "addr". If several
+ * do, we take the first object in load order, and its first such segment.
+ */
+const Process::LoadedObject *
+Process::findSegment(Elf_Addr addr, const Elf_Phdr **phdr) const
+{
+    if (!addressSpaceIndexed)
+        indexAddressSpace();
+    auto it = std::upper_bound(addressSpace.begin(), addressSpace.end(), addr,
+        [](Elf_Addr addr, const MappedSegment &segment) { return addr < segment.start; });
+    const MappedSegment *found = 0;
+    while (it != addressSpace.begin()) {
+        --it;
+        if (it->maxEnd <= addr)
+            break;
+        if (it->end > addr && (found == 0 || it->object < found->object
+                    || (it->object == found->object && it->phdr < found->phdr)))
+            found = &*it;
+    }
+    if (found == 0)
+        return 0;
+    if (phdr)
+        *phdr = found->phdr;
+    return &objects[found->object];
+}
+
 std::shared_ptr<ElfObject>
 Process::findObject(Elf_Addr addr, Elf_Off *reloc) const
 {
-    for (auto i = objects.begin(); i != objects.end(); ++i) {
-        for (auto &phdr : i->object->getSegments(PT_LOAD)) {
-            Elf_Off addrReloc = addr - i->reloc;
-            if (addrReloc >= phdr.p_vaddr && addrReloc < phdr.p_vaddr + phdr.p_memsz) {
-                *reloc = i->reloc;
-                return i->object;
-            }
-        }
-    }
-    return 0;
+    auto loaded = findSegment(addr, 0);
+    if (loaded == 0)
+        return 0;
+    *reloc = loaded->reloc;
+    return loaded->object;
 }
 
 Elf_Addr
@@ -675,6 +889,111 @@ Process::findNamedSymbol(const char *objectName, const char *symbolName) const
     throw e;
 }
 
+// Debug images we couldn't find may be installed by the time we're next used.
+ImageCache::~ImageCache()
+{
+    globalDebugDirectories.forgetMissing();
+}
+
+bool
+ImageCache::FileId::operator < (const FileId &rhs) const
+{
+    return std::tie(dev, ino, size, mtime, mtimeNsec)
+        < std::tie(rhs.dev, rhs.ino, rhs.size, rhs.mtime, rhs.mtimeNsec);
+}
+
+std::shared_ptr<ElfObject>
+ImageCache::getImage(const std::string &path, const std::function<std::shared_ptr<ElfObject>()> &load)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return load();
+    FileId id;
+    id.dev = st.st_dev;
+    id.ino = st.st_ino;
+    id.size = st.st_size;
+    id.mtime = st.st_mtim.tv_sec;
+    id.mtimeNsec = st.st_mtim.tv_nsec;
+    std::lock_guard<std::mutex> guard(lock);
+    auto &image = images[id];
+    if (!image) {
+        try {
+            image = load();
+        }
+        catch (...) {
+            images.erase(id);
+            throw;
+        }
+        shared.insert(image.get());
+    } else if (verbose >= 2) {
+        *debug << "reusing image " << image->getio()->describe() << " for " << path << "\n";
+    }
+    return image;
+}
+
+std::shared_ptr<ElfObject>
+ImageCache::getImageForName(const std::string &path)
+{
+    return getImage(path, [&path]() { return std::make_shared<ElfObject>(loadFile(path)); });
+}
+
+/*
+ * Drop "elf", which the caller no longer uses, if no one else uses it
+ * either, with its DWARF information, and any debug images only it used.
+ */
+void
+ImageCache::release(std::shared_ptr<ElfObject> elf)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    // Our own references: "elf", the image, and the DWARF information's key
+    // and the DwarfInfo itself.
+    auto info = dwarf.find(elf);
+    long ours = 2 + (info != dwarf.end() ? 2 : 0);
+    if (elf.use_count() > ours)
+        return;
+    auto image = std::find_if(images.begin(), images.end(),
+            [&elf](const std::pair<const FileId, std::shared_ptr<ElfObject>> &i) { return i.second == elf; });
+    if (image == images.end())
+        return; // not one of ours.
+    if (verbose >= 2)
+        *debug << "releasing image " << elf->getio()->describe() << "\n";
+    images.erase(image);
+    shared.erase(elf.get());
+    if (info != dwarf.end())
+        dwarf.erase(info);
+    elf.reset();
+
+    // Anything now only referred to by its DWARF information went with it.
+    for (bool swept = true; swept;) {
+        swept = false;
+        for (auto it = dwarf.begin(); it != dwarf.end();) {
+            if (it->first.use_count() == 2 && !shared.count(it->first.get())) {
+                it = dwarf.erase(it);
+                swept = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+}
+
+bool
+ImageCache::isShared(const std::shared_ptr<ElfObject> &obj) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return shared.count(obj.get()) != 0;
+}
+
+DwarfInfo *
+ImageCache::getDwarf(const std::shared_ptr<ElfObject> &elf)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto &info = dwarf[elf];
+    if (!info)
+        info.reset(new DwarfInfo(elf));
+    return info.get();
+}
+
 Process::~Process()
 {
     td_ta_delete(agent);
@@ -683,26 +1002,57 @@ Process::~Process()
     delete[] vdso;
 }
 
+/*
+ * Set up "stack" for unwinding a thread with stack pointer "sp". Unwinding
+ * reads saved registers from all over the thread's stack, so we read the
+ * stackPrefetch bytes above sp in one go, bounded by the end of its mapping,
+ * and serve what we can from that. If "io" is still the page cache, we read
+ * the process directly, rather than evict pages other threads are using.
+ */
 void
-ThreadStack::unwind(Process &p, CoreRegisters &regs)
+Process::prefetchStack(Elf_Addr sp, SnapshotReader &stack)
 {
+    stack.reset(io);
+    stack.capture(sp, stackPrefetch, io == memoryCache ? *memory : *io);
+}
+
+void
+ThreadStack::unwind(Process &p, CoreRegisters &regs, UnwindStrategy strategy, const Reader *memory)
+{
+    static auto &unwindTime = Stats::timer("unwind");
+    static auto &frames = Stats::counter("frames unwound");
+    // Each thread keeps its snapshot's buffers from one unwind to the next.
+    static thread_local SnapshotReader prefetched(nullptr);
+    StatTimer _(unwindTime);
     stack.clear();
     try {
-        auto prevFrame = new StackFrame();
-
         // Set up the first frame using the machine context registers
-        prevFrame->setCoreRegs(regs);
-        prevFrame->ip = prevFrame->getReg(IPREG); // use the IP address in current frame
-
-        StackFrame *frame;
-        for (size_t frameCount = 0; frameCount < gMaxFrames; frameCount++, prevFrame = frame) {
-            stack.push_back(prevFrame);
-            frame = prevFrame->unwind(p);
-            if (!frame)
+        stack.emplace_back();
+        stack.back().setCoreRegs(regs);
+        stack.back().ip = stack.back().getReg(IPREG); // use the IP address in current frame
+        if (memory == 0 && Process::stackPrefetch != 0) {
+            p.prefetchStack(stack.back().getReg(CFA_RESTORE_REGNO), prefetched);
+            memory = &prefetched;
+        } else if (memory == 0) {
+            memory = p.io.get();
+        }
+
+        // Each frame is unwound into "caller", and then copied onto the stack,
+        // so once the stack has grown to size, we allocate nothing.
+        StackFrame caller;
+        for (;;) {
+            StackFrame &frame = stack.back();
+            bool found = strategy != UNWIND_FP && frame.unwind(p, *memory, caller);
+            if (!found && (strategy == UNWIND_FP || (strategy == UNWIND_CFI_FP && !frame.fde)))
+                found = frame.unwindFP(*memory, caller);
+            if (!found || stack.size() == gMaxFrames)
                 break;
+            stack.push_back(caller);
         }
     }
     catch (const std::exception &ex) {
         std::clog << "warning: exception unwinding stack: " << ex.what() << std::endl;
     }
+    prefetched.reset(nullptr); // don't keep the process alive.
+    Stats::add(frames, stack.size());
 }
@@ -1,22 +1,96 @@
 #include <sysexits.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <sys/types.h>
 #include <signal.h>
+#include <string.h>
 
 #include <libpstack/dwarf.h>
 #include <libpstack/dump.h>
 #include <libpstack/elf.h>
 #include <libpstack/proc.h>
 #include <libpstack/ps_callback.h>
+#define REGMAP(a,b)
+#include <libpstack/dwarf/archreg.h>
+#undef REGMAP
 
+/*
+ * If non-zero, the number of bytes of each thread's stack to copy while the
+ * process is stopped: we then resume it, and unwind from the copy.
+ */
+static size_t stackWindow = 0;
+static UnwindStrategy unwindStrategy = UNWIND_CFI;
+
+// The number of threads to unwind and print thread stacks with (0 => one per CPU).
+static size_t stackThreads = 1;
+
+// The area below the stack pointer that functions may use without moving it.
+static const size_t redZone = 128;
 
 struct ThreadLister {
 
-    std::list<ThreadStack> threadStacks;
+    std::vector<std::unique_ptr<ThreadStack>> threadStacks;
+    // Stacks to reuse, with the storage for their frames, when sampling.
+    std::vector<std::unique_ptr<ThreadStack>> spare;
+    // If we're deferring unwinding, the registers of each thread.
+    std::vector<CoreRegisters> registers;
     Process *process;
+    std::shared_ptr<SnapshotReader> snapshot;
+    bool defer;
+    // If set, called with each stack once it's unwound and the process
+    // has been resumed.
+    std::function<void(ThreadStack &)> unwound;
+
+    ThreadLister(Process *process_, std::shared_ptr<SnapshotReader> snapshot_, bool defer_)
+        : process(process_), snapshot(snapshot_), defer(defer_) {}
+
+    void newStack() {
+        if (spare.empty()) {
+            threadStacks.push_back(make_unique<ThreadStack>());
+        } else {
+            threadStacks.push_back(std::move(spare.back()));
+            spare.pop_back();
+        }
+    }
+
+    void add(CoreRegisters &regs) {
+        if (snapshot) {
+            StackFrame frame;
+            frame.setCoreRegs(regs);
+            snapshot->capture(frame.getReg(CFA_RESTORE_REGNO) - redZone, stackWindow + redZone);
+        }
+        if (defer) {
+            registers.push_back(regs);
+        } else {
+            threadStacks.back()->unwind(*process, regs, unwindStrategy);
+        }
+    }
 
-    ThreadLister(Process *process_ ) : process(process_) {}
+    // Unwind the stacks we deferred. Each is independent of the others. If
+    // "report", pass each to "unwound" as soon as it's done.
+    void unwind(bool report) {
+        parallelFor(threadStacks.size(), stackThreads, [this, report](size_t i, size_t) {
+            threadStacks[i]->unwind(*process, registers[i], unwindStrategy);
+            if (report && unwound)
+                unwound(*threadStacks[i]);
+        });
+    }
+
+    // Pass each stack we've unwound to "unwound".
+    void report() {
+        if (unwound)
+            parallelFor(threadStacks.size(), stackThreads, [this](size_t i, size_t) {
+                unwound(*threadStacks[i]);
+            });
+    }
 
     void operator() (const td_thrhandle_t *thr) {
         CoreRegisters regs;
@@ -27,20 +101,20 @@ struct ThreadLister {
         the = td_thr_getgregs(thr, &regs);
 #endif
         if (the == TD_OK) {
-            threadStacks.push_back(ThreadStack());
-            td_thr_get_info(thr, &threadStacks.back().info);
-            threadStacks.back().unwind(*process, regs);
+            newStack();
+            td_thr_get_info(thr, &threadStacks.back()->info);
+            add(regs);
         }
     }
 };
 
-static int usage(void);
-std::ostream &
-pstack(Process &proc, std::ostream &os, const PstackOptions &options)
+/*
+ * Get the stacks of all the threads in "proc" into "threadLister". With a
+ * snapshot, this leaves proc.io reading from it.
+ */
+static void
+collectStacks(Process &proc, ThreadLister &threadLister)
 {
-
-    // get its back trace.
-    ThreadLister threadLister(&proc);
     {
         StopProcess here(&proc);
         proc.listThreads(threadLister);
@@ -48,38 +122,306 @@ pstack(Process &proc, std::ostream &os, const PstackOptions &options)
             // get the register for the process itself, and use those.
             CoreRegisters regs;
             proc.getRegs(ps_getpid(&proc),  &regs);
-            threadLister.threadStacks.push_back(ThreadStack());
-            threadLister.threadStacks.back().unwind(proc, regs);
+            threadLister.newStack();
+            threadLister.add(regs);
         }
+        if (threadLister.defer && !threadLister.snapshot)
+            threadLister.unwind(false);
+    }
+
+    // Anything outside the snapshot is read from the (running) process.
+    if (threadLister.snapshot) {
+        proc.io = threadLister.snapshot;
+        threadLister.unwind(true);
+    } else {
+        threadLister.report();
+    }
+}
+
+static int usage(void);
+std::ostream &
+pstack(Process &proc, std::ostream &os, const PstackOptions &options)
+{
+
+    // To take a snapshot, load everything we need to unwind first, so the
+    // process is stopped only while we copy its registers and stacks.
+    std::shared_ptr<Reader> io = proc.io;
+    std::shared_ptr<SnapshotReader> snapshot;
+    if (stackWindow) {
+        proc.loadUnwindInfo();
+        snapshot = std::make_shared<SnapshotReader>(io);
+    }
+
+    // get its back trace. With a snapshot, or more than one thread to work
+    // with, we just collect the registers of each thread from libthread_db,
+    // and unwind them all afterwards.
+    ThreadLister threadLister(&proc, snapshot, snapshot || stackThreads != 1);
+
+    // JSON goes out a thread at a time, as each is unwound, but only once
+    // the process is running again. Each record is built separately, so
+    // only writing it out is serialized.
+    static auto &printTime = Stats::timer("print");
+    std::mutex outputLock;
+    if (options(PstackOptions::json)) {
+        threadLister.unwound = [&](ThreadStack &stack) {
+            StatTimer _(printTime);
+            JsonWriter json(os);
+            proc.dumpStackJSON(json, stack, options);
+            json.endLine();
+            std::lock_guard<std::mutex> guard(outputLock);
+            json.flush();
+        };
+    }
+    collectStacks(proc, threadLister);
+    if (options(PstackOptions::json)) {
+        proc.io = io;
+        return os;
     }
 
     /*
      * resume at this point - maybe a bit optimistic if a shared library gets
      * unloaded while we print stuff out, but worth the risk, normally.
      */
-    for (auto s = threadLister.threadStacks.begin(); s != threadLister.threadStacks.end(); ++s) {
-        proc.dumpStackText(os, *s, options);
-        os << "\n";
+    auto &stacks = threadLister.threadStacks;
+
+    // Each group of threads gets its stack printed once. Unless we're
+    // grouping threads with the same stack, each is in a group of its own.
+    std::vector<std::vector<size_t>> groups;
+    if (options(PstackOptions::groupstacks)) {
+        std::map<std::vector<Elf_Addr>, size_t> groupOf;
+        for (size_t i = 0; i < stacks.size(); ++i) {
+            std::vector<Elf_Addr> ips;
+            for (auto &frame : stacks[i]->stack)
+                ips.push_back(frame.ip);
+            auto group = groupOf.insert(std::make_pair(ips, groups.size())).first;
+            if (group->second == groups.size())
+                groups.emplace_back();
+            groups[group->second].push_back(i);
+        }
+        // Most common first.
+        std::stable_sort(groups.begin(), groups.end(),
+            [](const std::vector<size_t> &l, const std::vector<size_t> &r) { return l.size() > r.size(); });
+    } else {
+        for (size_t i = 0; i < stacks.size(); ++i)
+            groups.push_back(std::vector<size_t>(1, i));
     }
+
+    auto dumpGroup = [&](std::ostream &os, const std::vector<size_t> &group) {
+        const ThreadStack &stack = *stacks[group[0]];
+        if (options(PstackOptions::groupstacks)) {
+            os << "threads: " << group.size() << ", lwps:";
+            const char *sep = " ";
+            for (auto i : group) {
+                os << sep << stacks[i]->info.ti_lid;
+                sep = ", ";
+            }
+            os << "\n";
+            proc.dumpFramesText(os, stack, options);
+        } else {
+            proc.dumpStackText(os, stack, options);
+        }
+    };
+
+    StatTimer _(printTime);
+    if (stackThreads == 1) {
+        for (auto &group : groups) {
+            dumpGroup(os, group);
+            os << "\n";
+        }
+    } else {
+        // Format each stack separately, and print them in order.
+        std::vector<std::string> text(groups.size());
+        parallelFor(groups.size(), stackThreads, [&](size_t i, size_t) {
+            std::ostringstream stackText;
+            dumpGroup(stackText, groups[i]);
+            text[i] = stackText.str();
+        });
+        for (auto &stackText : text)
+            os << stackText << "\n";
+    }
+    proc.io = io;
     return os;
 }
 
+/*
+ * The name of the function containing "ip", for folded stacks.
+ */
+static std::string
+functionName(Process &proc, Elf_Addr ip)
+{
+    Elf_Off reloc;
+    auto obj = proc.findObject(ip, &reloc);
+    if (!obj)
+        return "[unknown]";
+    // A broken object shouldn't stop us profiling: fall back to its name.
+    try {
+        auto sym = proc.symbolize(ip, false);
+        if (sym->symName != "")
+            return sym->symName;
+    }
+    catch (const Exception &) {
+    }
+    std::string fileName = obj->getio()->describe();
+    return "[" + fileName.substr(fileName.rfind('/') + 1) + "]";
+}
+
+/*
+ * Sample the stacks of "proc" "hz" times a second for "seconds" seconds,
+ * and print how often we saw each distinct stack, in the "folded" format
+ * flame graph tools take: the functions from outermost to innermost,
+ * separated by semicolons, followed by a count. The process, its objects,
+ * and everything we've decoded from them are kept between samples, and we
+ * name the functions for each address only once.
+ */
+static void
+profile(Process &proc, std::ostream &os, double hz, double seconds)
+{
+    std::shared_ptr<Reader> io = proc.io;
+    if (stackWindow)
+        proc.loadUnwindInfo();
+
+    std::map<std::string, size_t> folded;
+    std::unordered_map<Elf_Addr, std::string> names;
+    typedef std::chrono::steady_clock Clock;
+    auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1 / hz));
+    auto start = Clock::now();
+    auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+    size_t samples = 0;
+    std::vector<std::unique_ptr<ThreadStack>> pool;
+    for (auto next = start; ; ) {
+        proc.flushMemory();
+        // Pick up any libraries loaded since the last sample.
+        if (proc.refresh())
+            names.clear();
+        std::shared_ptr<SnapshotReader> snapshot;
+        if (stackWindow)
+            snapshot = std::make_shared<SnapshotReader>(io);
+        ThreadLister threadLister(&proc, snapshot, snapshot || stackThreads != 1);
+        threadLister.spare.swap(pool);
+        collectStacks(proc, threadLister);
+        proc.io = io;
+
+        for (auto &stack : threadLister.threadStacks) {
+            std::string key;
+            for (auto frame = stack->stack.rbegin(); frame != stack->stack.rend(); ++frame) {
+                auto name = names.find(frame->ip);
+                if (name == names.end())
+                    name = names.insert(std::make_pair(frame->ip, functionName(proc, frame->ip))).first;
+                if (!key.empty())
+                    key += ";";
+                key += name->second;
+            }
+            folded[key]++;
+        }
+        samples++;
+
+        // Keep the stacks for the next sample.
+        pool.swap(threadLister.spare);
+        for (auto &stack : threadLister.threadStacks)
+            pool.push_back(std::move(stack));
+
+        // If we've fallen behind, don't try to catch up.
+        next += interval;
+        auto now = Clock::now();
+        if (next >= end || now >= end)
+            break;
+        if (next < now)
+            next = now;
+        std::this_thread::sleep_until(next);
+    }
+    if (verbose) {
+        std::chrono::duration<double> elapsed = Clock::now() - start;
+        *debug << "took " << samples << " samples in " << elapsed.count() << " seconds\n";
+    }
+    for (auto &stack : folded)
+        os << stack.first << " " << stack.second << "\n";
+}
+
 int
 emain(int argc, char **argv)
 {
     int i, c;
     pid_t pid;
     std::string execFile;
+    ImageCache imageCache;
     std::shared_ptr<ElfObject> exec;
 
     PstackOptions options;
+    const char *statsFormat = 0;
+    double profileHz = 0;
+    double profileSeconds = 10;
     noDebugLibs = false;
 
-    while ((c = getopt(argc, argv, "d:D:hsvnag:")) != -1) {
+    while ((c = getopt(argc, argv, "b:d:D:hjsuvnag:c:C:S:T:U:w:p:t:")) != -1) {
         switch (c) {
+        case 'c': {
+            char *p;
+            CacheReader::defaultMaxPages = strtoul(optarg, &p, 0);
+            if (*p == ',')
+                CacheReader::defaultReadAhead = strtoul(p + 1, &p, 0);
+            if (*p != 0 || CacheReader::defaultMaxPages == 0)
+                return usage();
+            break;
+        }
         case 'g':
             globalDebugDirectories.add(optarg);
             break;
+        case 'C':
+            dwarfIndexDirectory = optarg;
+            break;
+        case 'T': {
+            char *p;
+            DwarfInfo::unitThreads = stackThreads = strtoul(optarg, &p, 0);
+            if (*p == ',')
+                DwarfInfo::unitThreads = strtoul(p + 1, &p, 0);
+            if (*p != 0)
+                return usage();
+            break;
+        }
+        case 'p': {
+            char *p;
+            profileHz = strtod(optarg, &p);
+            if (*p != 0 || profileHz <= 0)
+                return usage();
+            break;
+        }
+        case 't': {
+            char *p;
+            profileSeconds = strtod(optarg, &p);
+            if (*p != 0 || profileSeconds <= 0)
+                return usage();
+            break;
+        }
+        case 'w': {
+            char *p;
+            stackWindow = strtoul(optarg, &p, 0);
+            if (*p != 0)
+                return usage();
+            break;
+        }
+        case 'S':
+            if (strcmp(optarg, "text") != 0 && strcmp(optarg, "json") != 0)
+                return usage();
+            statsFormat = optarg;
+            statsEnabled = true;
+            break;
+        case 'U':
+            if (strcmp(optarg, "cfi") == 0)
+                unwindStrategy = UNWIND_CFI;
+            else if (strcmp(optarg, "fp") == 0)
+                unwindStrategy = UNWIND_FP;
+            else if (strcmp(optarg, "cfi+fp") == 0)
+                unwindStrategy = UNWIND_CFI_FP;
+            else
+                return usage();
+            break;
+        case 'b': {
+            char *p;
+            Process::stackPrefetch = strtoul(optarg, &p, 0);
+            if (*p != 0)
+                return usage();
+            break;
+        }
         case 'D': {
             auto dumpobj = std::make_shared<ElfObject>(loadFile(optarg));
             DwarfInfo di(ElfObject::getDebug(dumpobj));
@@ -88,7 +430,7 @@ emain(int argc, char **argv)
         }
         case 'd': {
             /* Undocumented option to dump image contents */
-            std::cout << ElfObject(loadFile(optarg));
+            std::cout << ElfObject(loadCore(optarg));
             return 0;
         }
         case 'h':
@@ -100,6 +442,12 @@ emain(int argc, char **argv)
         case 's':
             options += PstackOptions::nosrc;
             break;
+        case 'u':
+            options += PstackOptions::groupstacks;
+            break;
+        case 'j':
+            options += PstackOptions::json;
+            break;
         case 'v':
             verbose++;
             break;
@@ -119,21 +467,30 @@ emain(int argc, char **argv)
         if (pid == 0 || (kill(pid, 0) == -1 && errno == ESRCH)) {
             // It's a file: should be ELF, treat core and exe differently
 
-            auto obj = std::make_shared<ElfObject>(loadFile(argv[i]));
+            auto obj = imageCache.getImage(argv[i],
+                [&]() { return std::make_shared<ElfObject>(loadCore(argv[i])); });
 
             if (obj->getElfHeader().e_type == ET_CORE) {
-                CoreProcess proc(exec, obj, PathReplacementList());
+                CoreProcess proc(exec, obj, PathReplacementList(), imageCache);
                 proc.load();
-                pstack(proc, std::cout, options);
+                if (profileHz)
+                    profile(proc, std::cout, profileHz, 0); // a core has only one sample.
+                else
+                    pstack(proc, std::cout, options);
             } else {
                 exec = obj;
             }
         } else {
-            LiveProcess proc(exec, pid, PathReplacementList());
+            LiveProcess proc(exec, pid, PathReplacementList(), imageCache);
             proc.load();
-            pstack(proc, std::cout, options);
+            if (profileHz)
+                profile(proc, std::cout, profileHz, profileSeconds);
+            else
+                pstack(proc, std::cout, options);
         }
     }
+    if (statsFormat)
+        Stats::report(std::clog, strcmp(statsFormat, "json") == 0);
     return 0;
 }
 
@@ -160,12 +517,39 @@ usage(void)
         "or\n"
         "\t[-v]                         include verbose information to stderr\n"
         "\t[-s]                         don't include source-level details\n"
+        "\t[-u]                         print each distinct stack once, with the number\n"
+        "\t                             and LWPs of the threads sharing it (arguments\n"
+        "\t                             shown with -a are from the first of them)\n"
+        "\t[-j]                         print each thread's stack as a line of JSON, as soon\n"
+        "\t                             as it is unwound (-a and -u don't apply)\n"
         "\t[-g]                         add global debug directory\n"
         "\t[-a]                         show arguments to functions where possible (TODO: not finished)\n"
         "\t[-n]                         don't try and find external debug images)\n"
+        "\t[-c <pages>[,<readahead>]]   size of page cache for process memory, and number\n"
+        "\t                             of following pages to read on a cache miss\n"
+        "\t[-C <dir>]                   keep an index of each object's unwind, function,\n"
+        "\t                             line and symbol information in <dir>, keyed by\n"
+        "\t                             build ID, and reuse it on later runs\n"
+        "\t[-T <threads>[,<units>]]     number of threads to unwind and print thread stacks\n"
+        "\t                             with, and to decode DWARF units with when reading\n"
+        "\t                             all of them, if different (0 => one per CPU)\n"
+        "\t[-w <bytes>]                 copy this much of each thread's stack while the\n"
+        "\t                             process is stopped, and unwind from the copy after\n"
+        "\t                             resuming it, to keep the time it is stopped short\n"
+        "\t[-b <bytes>]                 read this much of each thread's stack at once\n"
+        "\t                             when unwinding it (default 65536, 0 to disable)\n"
+        "\t[-U cfi|fp|cfi+fp]           unwind with DWARF call frame information (the\n"
+        "\t                             default), frame pointers, or CFI with frame\n"
+        "\t                             pointers for code that has none\n"
+        "\t[-S text|json]               report the time spent in each phase of work, and\n"
+        "\t                             counts of reads, cache hits and decoding, to stderr\n"
+        "\t[-p <hz> [-t <seconds>]]     sample stacks <hz> times a second for <seconds>\n"
+        "\t                             (default 10), and print how often each was seen,\n"
+        "\t                             in the \"folded\" format used by flame graph tools\n"
         "\t[<pid>|<core>|<executable>]* list cores and pids to examine. An executable\n"
         "\t                             will override use of in-core or in-process information\n"
-        "\t                             to predict location of the executable\n"
+        "\t                             to predict location of the executable.\n"
+        "\t                             Cores may be gzipped, or read from a pipe.\n"
         ;
     return (EX_USAGE);
 }
@@ -3,6 +3,12 @@
 #include <iostream>
 #include <fcntl.h>
 #include <assert.h>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 
 using std::string;
 
@@ -41,6 +47,8 @@ FileReader::openfile(int &file, std::string name_)
 FileReader::FileReader(string name_, int file_)
     : name(name_)
     , file(file_)
+    , readCalls(statsEnabled ? &Stats::counter("reader " + name_ + " reads") : 0)
+    , readBytes(statsEnabled ? &Stats::counter("reader " + name_ + " bytes") : 0)
 {
     if (file == -1 && !openfile(file, name_))
         throw Exception() << "cannot open file '" << name_ << "': " << strerror(errno);
@@ -62,26 +70,157 @@ MemReader::read(off_t off, size_t count, char *ptr) const
     return rc;
 }
 
+const char *
+MemReader::view(off_t off, size_t count) const
+{
+    if (off < 0 || size_t(off) + count > len)
+        return 0;
+    return data + off;
+}
+
+size_t
+SnapshotReader::capture(off_t offset, size_t count, const Reader &from)
+{
+    std::vector<char> data;
+    if (!spare.empty()) {
+        data.swap(spare.back());
+        spare.pop_back();
+    }
+    data.resize(count);
+    ReadReq req(offset, count, &data[0]);
+    from.readv(&req, 1);
+    data.resize(req.rc);
+    size_t rc = data.size();
+    if (rc != 0)
+        ranges[offset].swap(data);
+    else
+        spare.push_back(std::move(data));
+    return rc;
+}
+
+void
+SnapshotReader::reset(std::shared_ptr<Reader> upstream_)
+{
+    for (auto &range : ranges)
+        spare.push_back(std::move(range.second));
+    ranges.clear();
+    upstream = std::move(upstream_);
+}
+
+const char *
+SnapshotReader::view(off_t off, size_t count) const
+{
+    auto range = ranges.upper_bound(off);
+    if (range == ranges.begin())
+        return 0;
+    --range;
+    if (size_t(off - range->first) + count > range->second.size())
+        return 0;
+    return &range->second[off - range->first];
+}
+
+size_t
+SnapshotReader::read(off_t off, size_t count, char *ptr) const
+{
+    size_t done = 0;
+    while (done < count) {
+        off_t at = off + done;
+        auto range = ranges.upper_bound(at);
+        off_t next = range == ranges.end() ? std::numeric_limits<off_t>::max() : range->first;
+        if (range != ranges.begin()) {
+            --range;
+            off_t end = range->first + range->second.size();
+            if (at < end) {
+                size_t rc = std::min(count - done, size_t(end - at));
+                memcpy(ptr + done, &range->second[at - range->first], rc);
+                done += rc;
+                continue;
+            }
+        }
+        // Not in the snapshot: read up to the next range from the original.
+        size_t want = std::min(count - done, size_t(next - at));
+        size_t rc = upstream->read(at, want, ptr + done);
+        done += rc;
+        if (rc != want)
+            break;
+    }
+    return done;
+}
+
 string
 MemReader::describe() const
 {
     return "from memory image";
 }
 
+MmapReader::MmapReader(const string &name_, int fd, size_t len_)
+    : MemReader(len_, 0)
+    , name(name_)
+{
+    void *p = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        throw Exception() << "cannot map file '" << name << "': " << strerror(errno);
+    data = (char *)p;
+}
+
+MmapReader::~MmapReader()
+{
+    munmap(data, len);
+}
+
+const char *
+MemReader::viewString(off_t off) const
+{
+    if (off < 0 || size_t(off) >= len || memchr(data + off, 0, len - off) == 0)
+        return 0;
+    return data + off;
+}
+
 string
-Reader:: readString(off_t offset) const
+MemReader::readString(off_t off) const
 {
-    char c;
+    auto str = viewString(off);
+    return str ? string(str) : Reader::readString(off);
+}
+
+/*
+ * Read the string in chunks, looking for the terminator in each. A string
+ * that runs up to the end of the reader's content is returned unterminated.
+ */
+string
+Reader::readString(off_t offset) const
+{
+    char buf[256];
     string res;
     for (;;) {
-        read(offset++, 1, &c);
-        if (c == 0)
+        size_t rc = read(offset, sizeof buf, buf);
+        if (rc == 0)
+            break;
+        auto term = (const char *)memchr(buf, 0, rc);
+        if (term) {
+            res.append(buf, term - buf);
             break;
-        res += c;
+        }
+        res.append(buf, rc);
+        offset += rc;
     }
     return res;
 }
 
+void
+Reader::readv(ReadReq *reqs, size_t nreqs) const
+{
+    for (size_t i = 0; i < nreqs; ++i) {
+        auto &req = reqs[i];
+        try {
+            req.rc = read(req.offset, req.count, req.ptr);
+        }
+        catch (const std::exception &) {
+            req.rc = 0;
+        }
+    }
+}
+
 size_t
 FileReader::read(off_t off, size_t count, char *ptr) const
 {
@@ -92,95 +231,522 @@ FileReader::read(off_t off, size_t count, char *ptr) const
             << " at " << off
             << " on " << describe()
             << " failed: " << strerror(errno);
+    if (readCalls) {
+        Stats::add(*readCalls);
+        Stats::add(*readBytes, rc);
+    }
     return rc;
 }
 
-CacheReader::Page::Page(Reader &r, off_t offset_)
-    : offset(offset_)
+size_t CacheReader::defaultPageSize = 4096;
+size_t CacheReader::defaultMaxPages = 256;
+size_t CacheReader::defaultReadAhead = 0;
+size_t CacheReader::defaultMaxStrings = 4096;
+
+CacheReader::CacheReader(std::shared_ptr<Reader> upstream_, size_t pageSize_, size_t maxPages_, size_t readAhead_)
+    : upstream(upstream_)
+    , maxStrings(defaultMaxStrings)
+    , pageSize(pageSize_)
+    , maxPages(std::max(maxPages_, readAhead_ + 1))
+    , readAhead(readAhead_)
+    , hits(0)
+    , misses(0)
+    , hitCount(0)
+    , missCount(0)
 {
-    try {
-        len = r.read(offset_, PAGESIZE, data);
-    }
-    catch (std::exception &ex) {
-        len = 0;
-    }
-    assert(offset_ % PAGESIZE == 0);
 }
 
-CacheReader::CacheReader(std::shared_ptr<Reader> upstream_)
-    : upstream(upstream_)
+/*
+ * Add to one of our counters, naming it when we first do: upstream may not
+ * be able to describe itself yet as we're constructed, e.g., a CoreReader
+ * inside its CoreProcess's constructor.
+ */
+void
+CacheReader::count(Stats::Value *&stat, const char *what, size_t n) const
+{
+    if (!statsEnabled)
+        return;
+    if (stat == 0)
+        stat = &Stats::counter("cache " + upstream->describe() + " " + what);
+    Stats::add(*stat, n);
+}
+
+void
+CacheReader::flush()
 {
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    pages.clear();
+    pageIndex.clear();
+    strings.clear();
+    stringCache.clear();
 }
 
 CacheReader::~CacheReader()
 {
-    for (auto i = pages.begin(); i != pages.end(); ++i)
-        delete *i;
+    if (verbose >= 2)
+        *debug << "page cache for " << describe() << ": "
+            << hits << " hits, " << misses << " misses" << std::endl;
+}
+
+/*
+ * Get a page to hold data for "offset", recycling the least recently used
+ * page once we have reached our limit. The page is moved to the front of the
+ * LRU list, and its content is undefined.
+ */
+CacheReader::Page &
+CacheReader::allocPage(off_t offset) const
+{
+    if (pages.size() < maxPages) {
+        pages.emplace_front(offset, pageSize);
+    } else {
+        auto victim = std::prev(pages.end());
+        pageIndex.erase(victim->offset);
+        victim->offset = offset;
+        pages.splice(pages.begin(), pages, victim);
+    }
+    Page &page = pages.front();
+    page.len = 0;
+    pageIndex[offset] = pages.begin();
+    return page;
+}
+
+static size_t
+readPage(const Reader &r, off_t offset, size_t count, char *data)
+{
+    try {
+        return r.read(offset, count, data);
+    }
+    catch (const std::exception &ex) {
+        return 0;
+    }
+}
+
+/*
+ * Populate the page at "pageoff", and up to "readAhead" pages following it
+ * that we don't already have, with one upstream read.
+ */
+void
+CacheReader::fill(off_t pageoff) const
+{
+    size_t count = 1;
+    while (count <= readAhead && pageIndex.find(pageoff + count * pageSize) == pageIndex.end())
+        ++count;
+
+    if (count == 1) {
+        Page &page = allocPage(pageoff);
+        page.len = readPage(*upstream, pageoff, pageSize, page.data.get());
+        return;
+    }
+
+    std::unique_ptr<char[]> buf(new char[count * pageSize]);
+    size_t got = readPage(*upstream, pageoff, count * pageSize, buf.get());
+    if (got < pageSize) {
+        // The read-ahead may have failed because a following page is not
+        // readable: just read the page we were asked for.
+        Page &page = allocPage(pageoff);
+        page.len = readPage(*upstream, pageoff, pageSize, page.data.get());
+        return;
+    }
+    // allocate the requested page last, so it ends up at the front of the LRU list.
+    for (size_t i = count; i-- > 0;) {
+        size_t have = got > i * pageSize ? std::min(pageSize, got - i * pageSize) : 0;
+        if (have == 0 && i != 0)
+            continue;
+        Page &page = allocPage(pageoff + i * pageSize);
+        memcpy(page.data.get(), buf.get() + i * pageSize, have);
+        page.len = have;
+    }
 }
 
 CacheReader::Page *
 CacheReader::getPage(off_t pageoff) const
 {
-    Page *p;
-    int first = true;
-    for (auto i = pages.begin(); i != pages.end(); ++i) {
-        p = *i;
-        if (p->offset == pageoff) {
-            // move page to front.
-            if (!first) {
-                pages.erase(i);
-                pages.push_front(p);
-            }
-            return p;
-        }
-        first = false;
-    }
-    p = new Page(*upstream, pageoff);
-    if (pages.size() == MAXPAGES) {
-        delete pages.back();
-        pages.pop_back();
+    auto it = pageIndex.find(pageoff);
+    if (it != pageIndex.end()) {
+        ++hits;
+        count(hitCount, "hits");
+        if (it->second != pages.begin())
+            pages.splice(pages.begin(), pages, it->second);
+        return &*it->second;
     }
-    pages.push_front(p);
-    return p;
+    ++misses;
+    count(missCount, "misses");
+    fill(pageoff);
+    return &pages.front();
 }
 
 size_t
 CacheReader::read(off_t absoff, size_t count, char *ptr) const
 {
+    std::lock_guard<std::recursive_mutex> guard(lock);
     off_t startoff = absoff;
     for (;;) {
         if (count == 0)
             break;
-        size_t offsetOfDataInPage = absoff % PAGESIZE;
+        size_t offsetOfDataInPage = absoff % pageSize;
         off_t offsetOfPageInFile = absoff - offsetOfDataInPage;
         Page *page = getPage(offsetOfPageInFile);
-        if (page == 0)
+        if (page->len <= offsetOfDataInPage)
             break;
         size_t chunk = std::min(page->len - offsetOfDataInPage, count);
-        memcpy(ptr, page->data + offsetOfDataInPage, chunk);
+        memcpy(ptr, page->data.get() + offsetOfDataInPage, chunk);
         absoff += chunk;
         count -= chunk;
         ptr += chunk;
-        if (page->len != PAGESIZE)
+        if (page->len != pageSize)
             break;
     }
     return absoff - startoff;
 }
 
+/*
+ * Find all the pages the requests need that we don't have, and fetch them
+ * with a single batch from upstream before serving the requests themselves.
+ */
+void
+CacheReader::readv(ReadReq *reqs, size_t nreqs) const
+{
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    std::vector<off_t> missing;
+    for (size_t i = 0; i < nreqs; ++i) {
+        const auto &req = reqs[i];
+        off_t end = req.offset + req.count;
+        for (off_t page = req.offset - req.offset % pageSize; page < end; page += pageSize)
+            if (pageIndex.find(page) == pageIndex.end())
+                missing.push_back(page);
+    }
+    std::sort(missing.begin(), missing.end());
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+    if (missing.size() > maxPages)
+        missing.resize(maxPages);
+
+    if (missing.size() > 1) {
+        std::vector<ReadReq> fills;
+        fills.reserve(missing.size());
+        for (auto pageoff : missing)
+            fills.emplace_back(pageoff, pageSize, allocPage(pageoff).data.get());
+        upstream->readv(fills);
+        for (auto &fill : fills)
+            pageIndex[fill.offset]->len = fill.rc;
+        misses += fills.size();
+        count(missCount, "misses", fills.size());
+    }
+    for (size_t i = 0; i < nreqs; ++i)
+        reqs[i].rc = read(reqs[i].offset, reqs[i].count, reqs[i].ptr);
+}
+
 string
 CacheReader::readString(off_t offset) const
 {
-    auto &entry = stringCache[offset];
-    if (entry.isNew) {
-        entry.value = Reader::readString(offset);
-        entry.isNew = false;
+    std::lock_guard<std::recursive_mutex> guard(lock);
+    auto it = stringCache.find(offset);
+    if (it != stringCache.end()) {
+        if (it->second != strings.begin())
+            strings.splice(strings.begin(), strings, it->second);
+        return it->second->second;
+    }
+    if (strings.size() == maxStrings) {
+        stringCache.erase(strings.back().first);
+        strings.pop_back();
     }
-    return entry.value;
+    strings.emplace_front(offset, Reader::readString(offset));
+    stringCache[offset] = strings.begin();
+    return strings.front().second;
+}
+
+size_t GzipReader::spanSize = 8 * 1024 * 1024;
+size_t GzipReader::maxSpans = 8;
+static const size_t gzipWindow = 32768; // how far back deflated data can refer.
+
+bool
+GzipReader::isGzip(const Reader &reader)
+{
+    unsigned char magic[2];
+    return reader.read(0, sizeof magic, (char *)magic) == sizeof magic && magic[0] == 0x1f && magic[1] == 0x8b;
 }
 
+GzipReader::GzipReader(std::shared_ptr<Reader> upstream_)
+    : upstream(upstream_)
+    , scan(new z_stream())
+    , scanInput(64 * 1024)
+    , scanWindow(gzipWindow)
+    , scanIn(0)
+    , scanOut(0)
+    , scanMember(0)
+    , scanned(false)
+{
+    if (inflateInit2(scan.get(), 15 + 16) != Z_OK)
+        throw Exception() << "inflateInit2 failed";
+}
+
+GzipReader::~GzipReader()
+{
+    inflateEnd(scan.get());
+}
+
+// Note an access point at the deflate block boundary "scan" is at.
+void
+GzipReader::addPoint() const
+{
+    static auto &accessPoints = Stats::counter("gzip access points");
+    AccessPoint point;
+    point.out = scanOut;
+    point.in = scanIn - scan->avail_in;
+    point.bits = scan->data_type & 7;
+
+    // Unroll the circular window, so the oldest byte comes first.
+    size_t len = std::min(size_t(scanOut), gzipWindow);
+    size_t pos = scanOut % gzipWindow;
+    std::vector<unsigned char> window(len);
+    if (len == gzipWindow)
+        std::rotate_copy(scanWindow.begin(), scanWindow.begin() + pos, scanWindow.end(), window.begin());
+    else
+        std::copy(scanWindow.begin(), scanWindow.begin() + len, window.begin());
+    if (len != 0) { // at the very start, there's no window.
+        uLongf size = compressBound(len);
+        point.window.resize(size);
+        if (compress2(point.window.data(), &size, window.data(), len, 1) != Z_OK)
+            throw Exception() << "can't compress window for " << describe();
+        point.window.resize(size);
+    }
+    points.push_back(std::move(point));
+    Stats::add(accessPoints);
+}
+
+/*
+ * Inflate the file until we have an access point beyond "offset", or the
+ * end. The output is discarded, but for the window we need at each point.
+ */
+void
+GzipReader::scanTo(off_t offset) const
+{
+    while (!scanned && (points.empty() || points.back().out <= offset)) {
+        if (scan->avail_in == 0) {
+            size_t rc = upstream->read(scanIn, scanInput.size(), (char *)&scanInput[0]);
+            if (rc == 0) {
+                if (scanOut == scanMember && scanOut != 0) {
+                    scanned = true; // the end, after a complete member.
+                    break;
+                }
+                throw Exception() << "truncated gzip data in " << upstream->describe();
+            }
+            scanIn += rc;
+            scan->next_in = &scanInput[0];
+            scan->avail_in = rc;
+        }
+        size_t pos = scanOut % gzipWindow;
+        scan->next_out = &scanWindow[pos];
+        scan->avail_out = gzipWindow - pos;
+        int rc = ::inflate(scan.get(), Z_BLOCK);
+        scanOut += gzipWindow - pos - scan->avail_out;
+        if (rc == Z_STREAM_END) {
+            // Another member may follow.
+            inflateReset(scan.get());
+            scanMember = scanOut;
+            continue;
+        }
+        if (rc == Z_DATA_ERROR && scanOut == scanMember && scanOut != 0) {
+            scanned = true; // trailing junk after the last member.
+            break;
+        }
+        if (rc != Z_OK && rc != Z_BUF_ERROR)
+            throw Exception() << "can't inflate " << upstream->describe() << ": "
+                << (scan->msg ? scan->msg : "unknown error");
+        // At the end of a block header, unless it's the last block.
+        if ((scan->data_type & 128) && !(scan->data_type & 64)
+                && (points.empty() || scanOut - points.back().out >= off_t(spanSize)))
+            addPoint();
+    }
+}
+
+// Inflate the span starting at access point "idx" into "out".
+void
+GzipReader::inflateSpan(size_t idx, std::vector<char> &out) const
+{
+    static auto &spansInflated = Stats::counter("gzip spans inflated");
+    const auto &point = points[idx];
+    out.resize((idx + 1 < points.size() ? points[idx + 1].out : scanOut) - point.out);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof stream);
+    if (inflateInit2(&stream, -15) != Z_OK)
+        throw Exception() << "inflateInit2 failed";
+    std::unique_ptr<z_stream, int (*)(z_stream *)> cleanup(&stream, inflateEnd);
+    off_t in = point.in;
+    if (point.bits != 0) {
+        unsigned char byte;
+        upstream->readObj(in - 1, &byte);
+        inflatePrime(&stream, point.bits, byte >> (8 - point.bits));
+    }
+    if (!point.window.empty()) {
+        std::vector<unsigned char> window(gzipWindow);
+        uLongf windowLen = window.size();
+        if (uncompress(window.data(), &windowLen, point.window.data(), point.window.size()) != Z_OK)
+            throw Exception() << "can't uncompress window for " << describe();
+        inflateSetDictionary(&stream, window.data(), windowLen);
+    }
+
+    std::vector<unsigned char> input(64 * 1024);
+    stream.next_out = (unsigned char *)out.data();
+    stream.avail_out = out.size();
+    bool raw = true;
+    while (stream.avail_out != 0) {
+        if (stream.avail_in == 0) {
+            size_t rc = upstream->read(in, input.size(), (char *)&input[0]);
+            if (rc == 0)
+                throw Exception() << "truncated gzip data in " << upstream->describe();
+            in += rc;
+            stream.next_in = &input[0];
+            stream.avail_in = rc;
+        }
+        int rc = ::inflate(&stream, Z_NO_FLUSH);
+        if (rc == Z_STREAM_END) {
+            // The end of a member: the next starts after this one's trailer,
+            // which raw inflation leaves for us to skip.
+            if (raw) {
+                in = in - stream.avail_in + 8;
+                stream.avail_in = 0;
+                inflateReset2(&stream, 15 + 16);
+                raw = false;
+            } else {
+                inflateReset(&stream);
+            }
+        } else if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            throw Exception() << "can't inflate " << upstream->describe() << ": "
+                << (stream.msg ? stream.msg : "unknown error");
+        }
+    }
+    Stats::add(spansInflated);
+}
+
+const std::vector<char> &
+GzipReader::getSpan(size_t idx) const
+{
+    for (auto it = spans.begin(); it != spans.end(); ++it) {
+        if (it->first == idx) {
+            spans.splice(spans.begin(), spans, it);
+            return it->second;
+        }
+    }
+    std::vector<char> data;
+    if (spans.size() >= std::max(maxSpans, size_t(1))) {
+        data.swap(spans.back().second);
+        spans.pop_back();
+    }
+    inflateSpan(idx, data);
+    spans.emplace_front(idx, std::move(data));
+    return spans.front().second;
+}
+
+size_t
+GzipReader::read(off_t off, size_t count, char *ptr) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    size_t done = 0;
+    while (done < count) {
+        off_t at = off + done;
+        scanTo(at + count - done - 1);
+        if (scanned && at >= scanOut)
+            break;
+        // The span containing "at" starts at the last point at or before it.
+        auto point = std::upper_bound(points.begin(), points.end(), at,
+                [](off_t offset, const AccessPoint &p) { return offset < p.out; });
+        if (point == points.begin())
+            break;
+        size_t idx = point - points.begin() - 1;
+        const auto &span = getSpan(idx);
+        size_t spanOff = at - points[idx].out;
+        if (spanOff >= span.size())
+            break;
+        size_t rc = std::min(count - done, span.size() - spanOff);
+        memcpy(ptr + done, &span[spanOff], rc);
+        done += rc;
+    }
+    return done;
+}
+
+/*
+ * Copy a file we can't seek, like a pipe, to an unlinked temporary file,
+ * and return a descriptor for the copy. "fd" is closed, even if we fail.
+ * For cores, it's best the pipe carries them compressed.
+ */
+static int
+spool(const std::string &path, int fd)
+{
+    const char *dir = getenv("TMPDIR");
+    std::string name = std::string(dir ? dir : "/tmp") + "/pstack.XXXXXX";
+    std::vector<char> buf(1024 * 1024);
+    int copy = mkstemp(&name[0]);
+    if (copy == -1) {
+        int error = errno;
+        close(fd);
+        throw Exception() << "cannot create temporary file to copy '" << path << "': " << strerror(error);
+    }
+    unlink(name.c_str());
+    for (;;) {
+        ssize_t rc = ::read(fd, &buf[0], buf.size());
+        if (rc == 0)
+            break;
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc == -1 || write(copy, &buf[0], rc) != rc) {
+            int error = errno;
+            close(copy);
+            close(fd);
+            throw Exception() << "cannot copy '" << path << "': " << strerror(error);
+        }
+    }
+    close(fd);
+    return copy;
+}
+
+static std::shared_ptr<Reader>
+openFile(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw Exception() << "cannot open file '" << path << "': " << strerror(errno);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        fd = spool(path, fd);
+        fstat(fd, &st);
+    }
+    if (S_ISREG(st.st_mode) && st.st_size != 0) {
+        try {
+            auto reader = std::make_shared<MmapReader>(path, fd, st.st_size);
+            close(fd);
+            return reader;
+        }
+        catch (const std::exception &ex) {
+            if (verbose >= 2)
+                *debug << ex.what() << ": falling back to pread\n";
+        }
+    }
+    return std::make_shared<CacheReader>(
+        std::make_shared<FileReader>(path, fd));
+}
+
+/*
+ * Regular files are mapped in their entirety. Anything else (pipes, devices,
+ * and procfs files, which report a size of zero) is read through the page
+ * cache, but pipes are copied to a file first, so we can seek.
+ */
 std::shared_ptr<Reader>
 loadFile(const std::string &path)
 {
-    return std::make_shared<CacheReader>(
-        std::make_shared<FileReader>(path));
+    return openFile(path);
+}
+
+/*
+ * As loadFile, for a file that may be a core, which may be gzipped, and is
+ * then inflated as it's read. Libraries and debug images we find ourselves
+ * aren't, so only files we're given get checked.
+ */
+std::shared_ptr<Reader>
+loadCore(const std::string &path)
+{
+    auto reader = openFile(path);
+    if (GzipReader::isGzip(*reader))
+        return std::make_shared<GzipReader>(reader);
+    return reader;
 }
@@ -0,0 +1,296 @@
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <dirent.h>
+#include <fcntl.h>
+#include <link.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "libpstack/proc.h"
+
+int SelfProcess::captureSignal = SIGRTMIN + 4;
+long SelfProcess::captureTimeout = 100000;
+
+/*
+ * The captures the handler for captureSignal fills in. "inHandler" counts
+ * the threads in the handler, so captureAll can wait for them to leave
+ * before it lets the captures go.
+ */
+namespace {
+struct CaptureRequest {
+    StackCapture *captures;
+    size_t count;
+    std::atomic<size_t> answered;
+};
+std::atomic<CaptureRequest *> activeCapture;
+std::atomic<int> inHandler;
+std::mutex captureLock; // one captureAll at a time.
+int memFd = -1; // /proc/self/mem, if we can't use process_vm_readv.
+
+// dl_iterate_phdr's counts of objects loaded and unloaded.
+struct ObjectCounts {
+    unsigned long long adds, subs;
+};
+}
+
+static lwpid_t
+currentLwp()
+{
+    return syscall(SYS_gettid);
+}
+
+/*
+ * Copy as much as we can of the "size" bytes of stack at "sp", stopping at
+ * the end of its mapping. This is called from signal handlers, so it does
+ * nothing but system calls.
+ */
+static size_t
+copyStack(Elf_Addr sp, char *buf, size_t size)
+{
+    iovec local = { buf, size };
+    iovec remote = { (void *)sp, size };
+    ssize_t rc = process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+    if (rc == -1 && memFd != -1)
+        rc = pread(memFd, buf, size, sp);
+    return rc > 0 ? rc : 0;
+}
+
+// Fill in "capture" from a thread's machine context. Signal safe.
+static void
+captureContext(StackCapture &capture, const ucontext_t &context)
+{
+    auto gregs = context.uc_mcontext.gregs;
+    auto &regs = capture.regs;
+    memset(&regs, 0, sizeof regs);
+#if defined(__amd64__)
+    regs.rax = gregs[REG_RAX];
+    regs.rdx = gregs[REG_RDX];
+    regs.rcx = gregs[REG_RCX];
+    regs.rbx = gregs[REG_RBX];
+    regs.rsi = gregs[REG_RSI];
+    regs.rdi = gregs[REG_RDI];
+    regs.rbp = gregs[REG_RBP];
+    regs.rsp = gregs[REG_RSP];
+    regs.r8 = gregs[REG_R8];
+    regs.r9 = gregs[REG_R9];
+    regs.r10 = gregs[REG_R10];
+    regs.r11 = gregs[REG_R11];
+    regs.r12 = gregs[REG_R12];
+    regs.r13 = gregs[REG_R13];
+    regs.r14 = gregs[REG_R14];
+    regs.r15 = gregs[REG_R15];
+    regs.rip = gregs[REG_RIP];
+    regs.eflags = gregs[REG_EFL];
+    capture.sp = regs.rsp;
+#elif defined(__i386__)
+    regs.eax = gregs[REG_EAX];
+    regs.ecx = gregs[REG_ECX];
+    regs.edx = gregs[REG_EDX];
+    regs.ebx = gregs[REG_EBX];
+    regs.esp = gregs[REG_ESP];
+    regs.ebp = gregs[REG_EBP];
+    regs.esi = gregs[REG_ESI];
+    regs.edi = gregs[REG_EDI];
+    regs.eip = gregs[REG_EIP];
+    regs.eflags = gregs[REG_EFL];
+    capture.sp = regs.esp;
+#else
+#error "SelfProcess doesn't know this architecture's machine context"
+#endif
+    capture.stack.resize(copyStack(capture.sp, &capture.stack[0], capture.stack.size())); // shrinks: no allocation.
+    capture.captured = true;
+}
+
+static void
+captureHandler(int, siginfo_t *info, void *context)
+{
+    if (info->si_code != SI_TKILL || info->si_pid != getpid())
+        return;
+    int savedErrno = errno;
+    ++inHandler;
+    CaptureRequest *request = activeCapture.load();
+    if (request != 0) {
+        lwpid_t lwp = currentLwp();
+        for (size_t i = 0; i < request->count; ++i) {
+            auto &capture = request->captures[i];
+            if (capture.lwp == lwp && !capture.captured) {
+                captureContext(capture, *(const ucontext_t *)context);
+                ++request->answered;
+                break;
+            }
+        }
+    }
+    --inHandler;
+    errno = savedErrno;
+}
+
+SelfProcess::SelfProcess(const PathReplacementList &repls, ImageCache &cache)
+    : Process(cache.getImage(LiveReader::procname(getpid(), "exe"), []() {
+                return std::make_shared<ElfObject>(
+                    std::make_shared<CacheReader>(std::make_shared<LiveReader>(getpid(), "exe"))); }),
+            std::make_shared<LiveReader>(getpid(), "mem"), repls, cache)
+    , adds(0)
+    , subs(0)
+{
+}
+
+pid_t
+SelfProcess::getPID() const
+{
+    return getpid();
+}
+
+/*
+ * Called by dl_iterate_phdr for the first object, with the loader's lock
+ * held: we just copy out the counts, and do anything else once it's let go.
+ */
+static int
+countObjects(struct dl_phdr_info *info, size_t, void *arg)
+{
+    auto &counts = *(ObjectCounts *)arg;
+    counts.adds = info->dlpi_adds;
+    counts.subs = info->dlpi_subs;
+    return 1;
+}
+
+void
+SelfProcess::load()
+{
+    char buf[4096];
+    int fd = open("/proc/self/auxv", O_RDONLY);
+    if (fd == -1)
+        throw Exception() << "failed to open /proc/self/auxv: " << strerror(errno);
+    ssize_t rc = ::read(fd, buf, sizeof buf);
+    close(fd);
+    if (rc == -1)
+        throw Exception() << "failed to read 4k from /proc/self/auxv";
+    processAUXV(buf, rc);
+    {
+        std::lock_guard<std::mutex> guard(captureLock);
+        if (memFd == -1)
+            memFd = open("/proc/self/mem", O_RDONLY | O_CLOEXEC);
+    }
+    ObjectCounts counts = { 0, 0 };
+    dl_iterate_phdr(countObjects, &counts);
+    adds = counts.adds;
+    subs = counts.subs;
+    Process::load();
+    // Pick up anything loaded or unloaded as we read the link map.
+    refresh();
+    prefetchDebugImages();
+}
+
+bool
+SelfProcess::refresh()
+{
+    flushMemory(); // the link map may have changed.
+    // If anything changes after we count, we'll see it next time.
+    ObjectCounts counts = { 0, 0 };
+    dl_iterate_phdr(countObjects, &counts);
+    if (counts.adds == adds && counts.subs == subs)
+        return false;
+    bool changed = Process::refresh();
+    adds = counts.adds;
+    subs = counts.subs;
+    return changed;
+}
+
+void __attribute__((noinline))
+SelfProcess::capture(StackCapture &capture)
+{
+    static auto &captured = Stats::counter("stacks captured");
+    ucontext_t context;
+    memset(&context, 0, sizeof context);
+    getcontext(&context);
+    capture.lwp = currentLwp();
+    capture.captured = false;
+    capture.stack.resize(stackPrefetch);
+    captureContext(capture, context);
+    Stats::add(captured);
+}
+
+/*
+ * Send captureSignal to each of our threads, and have its handler capture
+ * the thread's registers and stack, waiting up to captureTimeout for them
+ * to finish. Threads that block the signal, or are stuck in the kernel
+ * with it held off, aren't captured.
+ */
+void
+SelfProcess::captureAll(std::vector<StackCapture> &captures)
+{
+    static auto &captureTime = Stats::timer("capture stacks");
+    static auto &captured = Stats::counter("stacks captured");
+    StatTimer _(captureTime);
+
+    std::vector<lwpid_t> lwps;
+    DIR *tasks = opendir("/proc/self/task");
+    if (tasks == 0)
+        throw Exception() << "can't list threads: " << strerror(errno);
+    for (dirent *ent; (ent = readdir(tasks)) != 0; )
+        if (ent->d_name[0] != '.')
+            lwps.push_back(atoi(ent->d_name));
+    closedir(tasks);
+
+    std::lock_guard<std::mutex> guard(captureLock);
+    static bool installed;
+    if (!installed) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof sa);
+        sa.sa_sigaction = captureHandler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(captureSignal, &sa, 0) == -1)
+            throw Exception() << "can't handle signal " << captureSignal << ": " << strerror(errno);
+        installed = true;
+    }
+
+    captures.resize(lwps.size());
+    for (size_t i = 0; i < lwps.size(); ++i) {
+        captures[i].lwp = lwps[i];
+        captures[i].captured = false;
+        captures[i].stack.resize(stackPrefetch);
+    }
+    CaptureRequest request;
+    request.captures = captures.data();
+    request.count = captures.size();
+    request.answered = 0;
+    activeCapture = &request;
+    flushMemory();
+
+    lwpid_t self = currentLwp();
+    size_t sent = 0;
+    for (auto &capture : captures) {
+        if (capture.lwp == self)
+            this->capture(capture);
+        else if (syscall(SYS_tgkill, getpid(), capture.lwp, captureSignal) == 0)
+            ++sent;
+    }
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(captureTimeout);
+    while (request.answered != sent && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::yield();
+
+    activeCapture = 0;
+    while (inHandler != 0)
+        std::this_thread::yield();
+    for (auto &capture : captures)
+        if (!capture.captured)
+            capture.stack.clear();
+    Stats::add(captured, request.answered);
+}
+
+void
+SelfProcess::unwind(const StackCapture &capture, ThreadStack &thread, UnwindStrategy strategy)
+{
+    SnapshotReader stack(io);
+    stack.add(capture.sp, capture.stack);
+    memset(&thread.info, 0, sizeof thread.info);
+    thread.info.ti_lid = capture.lwp;
+    CoreRegisters regs = capture.regs;
+    thread.unwind(*this, regs, strategy, &stack);
+}
@@ -0,0 +1,35 @@
+#include <stdlib.h>
+
+typedef unsigned long counter_t;
+struct point {
+    int x;
+    int y;
+};
+
+extern void my_abort();
+
+void
+leaf(struct point *where, counter_t depth, const char *name)
+{
+    my_abort();
+}
+
+void
+middle(struct point p, int n)
+{
+    leaf(&p, n * 2, "middle");
+}
+
+void
+outer(int argc)
+{
+    struct point p = { argc, 42 };
+    middle(p, 7);
+}
+
+int
+main(int argc, char *argv[])
+{
+    outer(argc);
+    return 0;
+}
@@ -0,0 +1,118 @@
+#!/bin/sh
+# usage: core-tests.sh <pstack> <source dir> <test>
+#
+# Checks pstack's output for a core of tests/args.c, built here, against
+# what we know is in it, or against pstack's output for the same core read
+# in another way. Exits 77, for skipped, if we can't get a core.
+
+PSTACK=$1
+SRC=$2
+TEST=$3
+CC=${CC:-cc}
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+skip() {
+    echo "SKIP: $*" >&2
+    exit 77
+}
+
+# Build tests/args.c as "args", run it, and leave its core in "core".
+makecore() {
+    rm -f core core.*
+    $CC -gdwarf-4 -O0 -fno-omit-frame-pointer -o args "$SRC/args.c" "$SRC/abort.c" \
+        || fail "can't build args"
+    sh -c 'ulimit -c unlimited; exec ./args' 2>/dev/null
+    for f in core core.*; do
+        if [ -f "$f" ]; then
+            [ "$f" = core ] || mv "$f" core
+            return
+        fi
+    done
+    skip "no core file: check ulimit -c and /proc/sys/kernel/core_pattern"
+}
+
+# pstack's stack for "core" with "exe" for its executable, omitting the
+# thread's details, and naming the executable "args" wherever we found it.
+stack() {
+    exe=$1
+    core=$2
+    shift 2
+    "$PSTACK" "$@" "$exe" "$core" 2>stderr.txt | grep -v '^thread: ' | sed "s@ in $exe\$@ in args@; s@ in $exe @ in args @"
+}
+
+# Check the functions in "file" appear in the order given.
+expect() {
+    file=$1
+    shift
+    pattern=""
+    for function in "$@"; do
+        pattern="$pattern$function+[0-9]*(.*"
+    done
+    tr '\n' ' ' < "$file" | grep -q "$pattern" || fail "expected $* in $file:\n$(cat $file)"
+}
+
+same() {
+    cmp -s "$1" "$2" || fail "$1 and $2 differ:\n$(diff "$1" "$2")"
+}
+
+makecore
+case "$TEST" in
+    args)
+        # Printing arguments resolves types through DW_AT_type references.
+        stack ./args core -a > out.txt
+        expect out.txt my_abort leaf middle outer main
+        grep -q "leaf+[0-9]*(where=0x[0-9a-f]*, depth=14, name=0x[0-9a-f]*)" out.txt || fail "leaf's arguments"
+        grep -q "middle+[0-9]*(p=.*, n=7)" out.txt || fail "middle's arguments"
+        grep -q "outer+[0-9]*(argc=1)" out.txt || fail "outer's arguments"
+        grep -q "main+[0-9]*(argc=1, argv=0x[0-9a-f]*)" out.txt || fail "main's arguments"
+        ;;
+    compressed)
+        # With the debug sections compressed, we should see exactly the same.
+        objcopy --compress-debug-sections=zlib args args.z || skip "objcopy can't compress"
+        readelf -SW args.z | grep -q '\.debug_info .* C ' || skip "objcopy didn't compress"
+        stack ./args core -a > plain.txt
+        stack ./args.z core -a > compressed.txt
+        expect plain.txt my_abort leaf middle outer main
+        same plain.txt compressed.txt
+        ;;
+    ehframehdr)
+        # Without .eh_frame_hdr, we search an index of all of .eh_frame.
+        objcopy --remove-section .eh_frame_hdr args args.nohdr || skip "objcopy can't remove sections"
+        readelf -SW args | grep -q '\.eh_frame_hdr' || skip "no .eh_frame_hdr"
+        stack ./args core > hdr.txt
+        stack ./args.nohdr core > nohdr.txt
+        expect hdr.txt my_abort leaf middle outer main
+        same hdr.txt nohdr.txt
+        ;;
+    unwind-fp)
+        # my_abort calls raise, in libc, which may have no frame pointer,
+        # so the chain of frame pointers can skip it.
+        stack ./args core -U fp > fp.txt
+        expect fp.txt leaf middle outer main
+        stack ./args core -U cfi > cfi.txt
+        stack ./args core -U cfi+fp > cfifp.txt
+        same cfi.txt cfifp.txt
+        ;;
+    gzip-core)
+        # Gzipped cores, and cores in pipes, read without inflating them.
+        gzip -c core > core.gz || skip "no gzip"
+        stack ./args core > plain.txt
+        stack ./args core.gz > gz.txt
+        expect plain.txt my_abort leaf middle outer main
+        same plain.txt gz.txt
+        rm -f pipe
+        mkfifo pipe || skip "no mkfifo"
+        cat core.gz > pipe &
+        stack ./args pipe > pipe.txt
+        wait
+        same plain.txt pipe.txt
+        ;;
+    *)
+        fail "no test $TEST"
+        ;;
+esac
+echo "PASS: $TEST"
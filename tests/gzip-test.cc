@@ -0,0 +1,80 @@
+/*
+ * Check GzipReader gives the same content as the data it compressed, for
+ * reads anywhere in it, in any order, across several gzip members, with
+ * few spans kept, so we inflate from the access points again and again.
+ */
+#include <libpstack/util.h>
+#include <iostream>
+#include <random>
+#include <zlib.h>
+
+static void
+compress(const std::vector<char> &in, size_t from, size_t to, std::vector<char> &out)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof stream);
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw Exception() << "deflateInit2 failed";
+    std::vector<char> buf(deflateBound(&stream, to - from));
+    stream.next_in = (Bytef *)&in[from];
+    stream.avail_in = to - from;
+    stream.next_out = (Bytef *)&buf[0];
+    stream.avail_out = buf.size();
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+        throw Exception() << "deflate failed";
+    out.insert(out.end(), buf.begin(), buf.begin() + stream.total_out);
+    deflateEnd(&stream);
+}
+
+static int
+check()
+{
+    // Compressible, but not entirely regular.
+    std::mt19937 rng(1);
+    std::vector<char> data(3 * 1024 * 1024 + 123);
+    for (size_t i = 0; i < data.size(); ++i)
+        data[i] = rng() % 16 == 0 ? char(rng()) : char(i / 1024);
+
+    // Two members, and the trailing zeros some tools pad with.
+    std::vector<char> gz;
+    compress(data, 0, data.size() / 3, gz);
+    compress(data, data.size() / 3, data.size(), gz);
+    gz.insert(gz.end(), 512, 0);
+
+    GzipReader::spanSize = 64 * 1024;
+    GzipReader::maxSpans = 2;
+    auto upstream = std::make_shared<MemReader>(gz.size(), &gz[0]);
+    if (!GzipReader::isGzip(*upstream)) {
+        std::cerr << "gzip data not recognised\n";
+        return 1;
+    }
+    GzipReader reader(upstream);
+
+    std::vector<char> buf(300000);
+    for (int i = 0; i < 2000; ++i) {
+        off_t off = rng() % (data.size() + 1000);
+        if (i % 4 == 0)
+            off = data.size() - off % 5000; // around the end.
+        size_t count = rng() % buf.size();
+        size_t expect = off >= off_t(data.size()) ? 0 : std::min(count, data.size() - off);
+        size_t got = reader.read(off, count, &buf[0]);
+        if (got != expect || (got != 0 && memcmp(&buf[0], &data[off], got) != 0)) {
+            std::cerr << "read of " << count << " at " << off << " got " << got
+                << " bytes, expected " << expect << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int
+main()
+{
+    try {
+        return check();
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "error: " << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -0,0 +1,6 @@
+// An object for self-test to load once it's running.
+extern "C" int
+selfTestLoaded()
+{
+    return 1;
+}
@@ -0,0 +1,131 @@
+/*
+ * Check SelfProcess captures and unwinds the stacks of our own threads, and
+ * finds an object we load after we've started, and notices it go.
+ *
+ * usage: self-test <shared object to load>
+ */
+#include <libpstack/proc.h>
+#include <atomic>
+#include <dlfcn.h>
+#include <iostream>
+#include <thread>
+
+static std::atomic<bool> done;
+static std::atomic<int> started;
+
+extern "C" void __attribute__((noinline))
+selfTestSpin(int depth)
+{
+    if (depth != 0) {
+        selfTestSpin(depth - 1);
+        asm volatile(""); // not a tail call.
+        return;
+    }
+    ++started;
+    while (!done)
+        std::this_thread::yield();
+}
+
+// If the stack includes "function".
+static bool
+calls(SelfProcess &self, const ThreadStack &stack, const std::string &function)
+{
+    for (auto &frame : stack.stack)
+        if (self.symbolize(frame.ip, false)->symName == function)
+            return true;
+    return false;
+}
+
+// If we have an object for "path".
+static bool
+loaded(const SelfProcess &self, const std::string &path)
+{
+    for (auto &loaded : self.objects)
+        if (loaded.object->getio()->describe() == path)
+            return true;
+    return false;
+}
+
+static int
+check(const char *dso)
+{
+    const int count = 4;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < count; ++i)
+        threads.emplace_back(selfTestSpin, 3);
+    while (started != count)
+        std::this_thread::yield();
+
+    ImageCache cache;
+    SelfProcess self(PathReplacementList(), cache);
+    self.load();
+    std::vector<StackCapture> captures;
+    self.captureAll(captures);
+    done = true;
+    for (auto &thread : threads)
+        thread.join();
+
+    int spinning = 0;
+    for (auto &capture : captures) {
+        if (!capture.captured) {
+            std::cerr << "thread " << capture.lwp << " wasn't captured\n";
+            return 1;
+        }
+        ThreadStack stack;
+        self.unwind(capture, stack);
+        if (calls(self, stack, "selfTestSpin"))
+            ++spinning;
+        else if (!calls(self, stack, "main"))
+            std::cerr << "thread " << capture.lwp << " is neither spinning nor in main\n";
+    }
+    if (spinning != count) {
+        std::cerr << "found " << spinning << " of " << count << " threads spinning\n";
+        return 1;
+    }
+
+    if (self.refresh()) {
+        std::cerr << "nothing loaded, but refresh() found a change\n";
+        return 1;
+    }
+    void *handle = dlopen(dso, RTLD_NOW);
+    if (handle == 0) {
+        std::cerr << "can't load " << dso << ": " << dlerror() << "\n";
+        return 1;
+    }
+    if (!self.refresh()) {
+        std::cerr << "refresh() didn't see " << dso << " loaded\n";
+        return 1;
+    }
+    if (!loaded(self, dso)) {
+        std::cerr << "no object for " << dso << " after refresh()\n";
+        return 1;
+    }
+    // symbolize looks up the instruction before a return address.
+    Elf_Addr function = Elf_Addr(dlsym(handle, "selfTestLoaded"));
+    if (function == 0 || self.symbolize(function + 1, true)->symName != "selfTestLoaded") {
+        std::cerr << "can't find selfTestLoaded in " << dso << "\n";
+        return 1;
+    }
+    dlclose(handle);
+    if (!self.refresh() || loaded(self, dso)) {
+        std::cerr << "refresh() didn't see " << dso << " unloaded\n";
+        return 1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc != 2) {
+        std::cerr << "usage: self-test <shared object>\n";
+        return 2;
+    }
+    try {
+        return check(argv[1]);
+    }
+    catch (const std::exception &ex) {
+        std::cerr << "error: " << ex.what() << "\n";
+        return 1;
+    }
+}
@@ -1,4 +1,9 @@
 #include <libpstack/util.h>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <tuple>
 std::string
 dirname(const std::string &in)
 {
@@ -8,3 +13,199 @@ dirname(const std::string &in)
     return in.substr(0, it);
 
 }
+
+void *
+Arena::alloc(size_t size, size_t align)
+{
+    size_t pad = (align - uintptr_t(cur) % align) % align;
+    if (pad + size > avail) {
+        // Oversized requests get a block of their own.
+        size_t len = std::max(size + align, size_t(blockSize));
+        blocks.emplace_back(new char[len]);
+        cur = blocks.back().get();
+        avail = len;
+        pad = (align - uintptr_t(cur) % align) % align;
+    }
+    char *p = cur + pad;
+    cur = p + size;
+    avail -= pad + size;
+    return p;
+}
+
+const char *
+Arena::strdup(const std::string &str)
+{
+    char *p = array<char>(str.size() + 1);
+    memcpy(p, str.c_str(), str.size() + 1);
+    return p;
+}
+
+bool statsEnabled;
+
+namespace {
+struct StatTable {
+    std::mutex lock;
+    std::map<std::string, Stats::Value> values;
+    Stats::Value &get(const std::string &name) {
+        std::lock_guard<std::mutex> guard(lock);
+        return values.emplace(std::piecewise_construct,
+                std::forward_as_tuple(name), std::forward_as_tuple(0)).first->second;
+    }
+};
+StatTable &counters() { static StatTable table; return table; }
+StatTable &timers() { static StatTable table; return table; }
+}
+
+Stats::Value &
+Stats::counter(const std::string &name)
+{
+    return counters().get(name);
+}
+
+Stats::Value &
+Stats::timer(const std::string &name)
+{
+    return timers().get(name);
+}
+
+void
+JsonWriter::string(const char *s, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    buf += '"';
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            buf += '\\';
+            buf += c;
+        } else if (c < ' ') {
+            buf += "\\u00";
+            buf += hex[c >> 4];
+            buf += hex[c & 0xf];
+        } else {
+            buf += c;
+        }
+    }
+    buf += '"';
+}
+
+void
+JsonWriter::unsignedNumber(uintmax_t n)
+{
+    char digits[24];
+    char *p = digits + sizeof digits;
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    buf.append(p, digits + sizeof digits - p);
+}
+
+void
+JsonWriter::signedNumber(intmax_t n)
+{
+    if (n < 0) {
+        buf += '-';
+        unsignedNumber(-uintmax_t(n));
+    } else {
+        unsignedNumber(n);
+    }
+}
+
+void
+JsonWriter::flush()
+{
+    if (buf.empty())
+        return;
+    os.write(buf.data(), buf.size());
+    os.flush();
+    buf.clear();
+}
+
+StatTimer::StatTimer(const char *what, const Reader &subject)
+    : total(statsEnabled ? &Stats::timer(std::string(what) + " " + subject.describe()) : 0)
+{
+    if (total)
+        start = std::chrono::steady_clock::now();
+}
+
+/*
+ * Print all the timers, in milliseconds, and then all the counters. Timers
+ * for work done on many threads at once are the sum of the time on each, and
+ * phases include the time of any others they trigger (e.g., parsing DWARF
+ * the first time we symbolize an address in an object.)
+ */
+void
+Stats::report(std::ostream &os, bool json)
+{
+    IOFlagSave _(os);
+    os << std::fixed << std::setprecision(3);
+    const char *sep = "";
+    auto quote = [](const std::string &s) {
+        std::ostringstream quoted;
+        JsonWriter(quoted).value(s);
+        return quoted.str();
+    };
+    if (json) {
+        os << "{ \"times_ms\": { ";
+    } else {
+        os << "times (ms):\n";
+    }
+    {
+        std::lock_guard<std::mutex> guard(timers().lock);
+        for (auto &timer : timers().values) {
+            double ms = timer.second / 1e6;
+            if (json)
+                os << sep << quote(timer.first) << ": " << ms;
+            else
+                os << "    " << timer.first << ": " << ms << "\n";
+            sep = ", ";
+        }
+    }
+    if (json)
+        os << " }, \"counts\": { ";
+    else
+        os << "counts:\n";
+    sep = "";
+    {
+        std::lock_guard<std::mutex> guard(counters().lock);
+        for (auto &counter : counters().values) {
+            if (json)
+                os << sep << quote(counter.first) << ": " << counter.second;
+            else
+                os << "    " << counter.first << ": " << counter.second << "\n";
+            sep = ", ";
+        }
+    }
+    if (json)
+        os << " } }\n";
+}
+
+void
+parallelFor(size_t count, size_t threads, const std::function<void(size_t, size_t)> &work)
+{
+    std::vector<std::exception_ptr> errors(count);
+    std::atomic<size_t> next(0);
+    auto worker = [&](size_t thread) {
+        for (size_t i; (i = next++) < count; ) {
+            try {
+                work(i, thread);
+            }
+            catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    threads = std::max(size_t(1), std::min(threads, count));
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; ++i)
+        pool.emplace_back(worker, i);
+    worker(0);
+    for (auto &thread : pool)
+        thread.join();
+    for (auto &error : errors)
+        if (error)
+            std::rethrow_exception(error);
+}